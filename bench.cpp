@@ -0,0 +1,893 @@
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "include/utils.h"
+#include "include/frame_decoder.h"
+#include "include/protocol_v2.h"
+#include "include/histogram.h"
+
+/*
+ * Load generator and end-to-end latency benchmark. Publisher threads send
+ * datagrams to the server at a target rate, and subscriber connections, in
+ * the same process, subscribe to every benchmark topic and time each message
+ * they receive. The send time travels in the message itself, counted in
+ * microseconds since the benchmark started:
+ *
+ *   INT, FLOAT    the 32-bit value
+ *   SHORT_REAL    the 16-bit value, in units of 32 microseconds
+ *   STRING        the decimal digits the string starts with
+ *
+ * so the numeric types wrap around after 71 minutes (2 seconds for
+ * SHORT_REAL), far above any latency worth measuring.
+ */
+
+#define SHORT_REAL_SHIFT 5
+#define MAX_MIX_WEIGHT 100
+
+const char BENCH_TOPIC_PREFIX[] = "bench/";
+const char BENCH_PATTERN[] = "bench/*";
+
+/**
+ * @brief What the benchmark was asked to do.
+ *
+ */
+struct bench_config {
+    sockaddr_in server_address;
+    int publishers;
+    int subscribers;
+    uint64_t rate;
+    int seconds;
+    int topics;
+    int string_len;
+    uint8_t version;
+    uint8_t flags;
+
+    // The data type of each message, in turn
+    std::vector<uint8_t> schedule;
+};
+
+/**
+ * @brief A publisher thread's counters.
+ *
+ */
+struct bench_publisher {
+    uint64_t sent;
+    uint64_t errors;
+};
+
+/**
+ * @brief A subscriber connection's counters and latencies, overall and by
+ *   data type.
+ *
+ */
+struct bench_subscriber {
+    int fd;
+    std::atomic<uint64_t> delivered;
+    uint64_t wire_bytes;
+    int64_t last_delivery_us;
+    uint64_t type_count[UDP_STRING + 1];
+    uint64_t type_bytes[UDP_STRING + 1];
+    Histogram latency;
+    Histogram type_latency[UDP_STRING + 1];
+
+    bench_subscriber() : fd(-1), delivered(0), wire_bytes(0),
+            last_delivery_us(0) {
+        memset(type_count, 0, sizeof(type_count));
+        memset(type_bytes, 0, sizeof(type_bytes));
+    }
+};
+
+// What the embedded times count from
+static int64_t base_us;
+
+// How many subscribers are ready to receive, or failed to
+static std::atomic<int> subscribers_ready(0);
+static std::atomic<int> subscribers_failed(0);
+
+static const char *TYPE_NAMES[] = {
+    UDP_INT_STR, UDP_SHORT_REAL_STR, UDP_FLOAT_STR, UDP_STRING_STR
+};
+
+/**
+ * @brief Returns the time elapsed since the benchmark started.
+ *
+ * @return int64_t - the time, in microseconds
+ */
+static int64_t bench_now_us() {
+    return monotonic_us() - base_us;
+}
+
+/**
+ * @brief Parses the mix of data types, building the order in which they're
+ *   sent so that each one is spread evenly.
+ *
+ * @param mix the mix, as <TYPE>[:<WEIGHT>],...
+ * @param schedule the data type of each message, in turn
+ * @return int - the error code
+ */
+static int parse_mix(const char *mix, std::vector<uint8_t> &schedule) {
+    int weights[UDP_STRING + 1] = {0};
+
+    std::vector<char> copy(mix, mix + strlen(mix) + 1);
+    char *saved;
+    for (char *item = strtok_r(copy.data(), ",", &saved); item != NULL;
+            item = strtok_r(NULL, ",", &saved)) {
+        char *weight = strchr(item, ':');
+        if (weight != NULL) {
+            *weight++ = '\0';
+        }
+
+        int type = -1;
+        for (int i = 0; i <= UDP_STRING; ++i) {
+            if (strcmp(item, TYPE_NAMES[i]) == 0) {
+                type = i;
+            }
+        }
+
+        int value = weight == NULL ? 1 : atoi(weight);
+        if (type < 0 || value < 1 || value > MAX_MIX_WEIGHT) {
+            return -1;
+        }
+
+        weights[type] = value;
+    }
+
+    // Smooth weighted round robin: each turn goes to the type furthest
+    // behind its share
+    int total = 0;
+    for (int i = 0; i <= UDP_STRING; ++i) {
+        total += weights[i];
+    }
+
+    if (total == 0) {
+        return -1;
+    }
+
+    int current[UDP_STRING + 1] = {0};
+    schedule.clear();
+    for (int turn = 0; turn < total; ++turn) {
+        int best = -1;
+        for (int i = 0; i <= UDP_STRING; ++i) {
+            current[i] += weights[i];
+            if (weights[i] != 0 && (best < 0 || current[i] > current[best])) {
+                best = i;
+            }
+        }
+
+        current[best] -= total;
+        schedule.push_back(best);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Writes a benchmark datagram, carrying the time it's sent at.
+ *
+ * @param msg where to write it
+ * @param topic the MAX_TOPIC_LEN zero padded bytes of the topic
+ * @param data_type the data type
+ * @param string_len the length of STRING contents
+ * @param now_us the time, since the benchmark started
+ * @return size_t - the length of the datagram
+ */
+static size_t fill_datagram(udp_to_server_msg &msg, const char *topic,
+        const uint8_t data_type, const int string_len, const int64_t now_us) {
+    memcpy(msg.topic, topic, MAX_TOPIC_LEN);
+    msg.data_type = data_type;
+
+    uint32_t stamp32 = htonl((uint32_t)now_us);
+    switch (data_type) {
+        case UDP_INT:
+            msg.content[0] = 0;
+            memcpy(msg.content + 1, &stamp32, sizeof(stamp32));
+            return MAX_TOPIC_LEN + 1 + 5;
+
+        case UDP_SHORT_REAL: {
+            uint16_t stamp16 = htons((uint16_t)(now_us >> SHORT_REAL_SHIFT));
+            memcpy(msg.content, &stamp16, sizeof(stamp16));
+            return MAX_TOPIC_LEN + 1 + 2;
+        }
+
+        case UDP_FLOAT:
+            msg.content[0] = 0;
+            memcpy(msg.content + 1, &stamp32, sizeof(stamp32));
+            msg.content[5] = 0;
+            return MAX_TOPIC_LEN + 1 + 6;
+
+        default: {
+            // The digits are followed by a space, then padded to the length
+            int len = snprintf(msg.content, string_len + 1, "%ld ",
+                (long)now_us);
+            memset(msg.content + len, 'x', string_len - len);
+            return MAX_TOPIC_LEN + 1 + string_len;
+        }
+    }
+}
+
+/**
+ * @brief A publisher thread: sends its share of the rate, in batches of
+ *   datagrams, for the benchmark's duration.
+ *
+ * @param config the benchmark
+ * @param index the publisher's index
+ * @param publisher the publisher's counters
+ */
+static void run_publisher(const bench_config &config, const int index,
+        bench_publisher &publisher) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr *)&config.server_address,
+            sizeof(config.server_address)) < 0) {
+        fprintf(stderr, "Error opening publisher %d's socket.\n", index);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    // Build the padded topics once
+    std::vector<char> topics(config.topics * MAX_TOPIC_LEN, 0);
+    for (int i = 0; i < config.topics; ++i) {
+        snprintf(topics.data() + i * MAX_TOPIC_LEN, MAX_TOPIC_LEN, "%s%d",
+            BENCH_TOPIC_PREFIX, i);
+    }
+
+    std::vector<udp_to_server_msg> msgs(BENCH_SEND_BATCH);
+    mmsghdr headers[BENCH_SEND_BATCH];
+    iovec iovecs[BENCH_SEND_BATCH];
+    memset(headers, 0, sizeof(headers));
+    for (int i = 0; i < BENCH_SEND_BATCH; ++i) {
+        iovecs[i].iov_base = &msgs[i];
+        headers[i].msg_hdr.msg_iov = &iovecs[i];
+        headers[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // Each publisher starts at a different point of the schedule and of
+    // the topics, so together they keep the mix
+    uint64_t seq = index;
+    uint64_t attempted = 0;
+    double per_us = (double)config.rate / config.publishers / 1e6;
+    int64_t start_us = bench_now_us();
+    int64_t end_us = start_us + (int64_t)config.seconds * 1000000;
+
+    while (true) {
+        int64_t now_us = bench_now_us();
+        if (now_us >= end_us) {
+            break;
+        }
+
+        // Send what's due by now, or a whole batch without a rate
+        uint64_t due = BENCH_SEND_BATCH;
+        if (config.rate != 0) {
+            due = (uint64_t)((now_us - start_us) * per_us) - attempted;
+            if (due == 0) {
+                usleep(20);
+                continue;
+            }
+        }
+
+        int batch = std::min(due, (uint64_t)BENCH_SEND_BATCH);
+        for (int i = 0; i < batch; ++i, seq += config.publishers) {
+            iovecs[i].iov_len = fill_datagram(msgs[i],
+                topics.data() + (seq % config.topics) * MAX_TOPIC_LEN,
+                config.schedule[seq % config.schedule.size()],
+                config.string_len, now_us);
+        }
+
+        attempted += batch;
+
+        int n = sendmmsg(fd, headers, batch, 0);
+        if (n < 0) {
+            publisher.errors += batch;
+            continue;
+        }
+
+        publisher.sent += n;
+        publisher.errors += batch - n;
+    }
+
+    close(fd);
+}
+
+/**
+ * @brief Returns how many bytes a varint takes.
+ *
+ * @param value the value
+ * @return size_t - the number of bytes
+ */
+static size_t varint_len(uint32_t value) {
+    size_t len = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        ++len;
+    }
+
+    return len;
+}
+
+/**
+ * @brief Times a received message, from the send time it carries.
+ *
+ * @param subscriber the subscriber's counters
+ * @param data_type the message's data type
+ * @param content the message's content
+ * @param content_len the length of the content
+ * @param frame_bytes how many bytes its frame took, 0 inside a batch
+ * @param now_us when it was received, since the benchmark started
+ */
+static void record_message(bench_subscriber &subscriber,
+        const uint8_t data_type, const char *content, const size_t content_len,
+        const size_t frame_bytes, const int64_t now_us) {
+    uint64_t latency;
+    switch (data_type) {
+        case UDP_INT:
+        case UDP_FLOAT: {
+            if (content_len < 5) {
+                return;
+            }
+
+            uint32_t stamp;
+            memcpy(&stamp, content + 1, sizeof(stamp));
+            latency = (uint32_t)((uint32_t)now_us - ntohl(stamp));
+            break;
+        }
+
+        case UDP_SHORT_REAL: {
+            if (content_len < 2) {
+                return;
+            }
+
+            uint16_t stamp;
+            memcpy(&stamp, content, sizeof(stamp));
+            latency = (uint64_t)(uint16_t)((uint16_t)(now_us >>
+                SHORT_REAL_SHIFT) - ntohs(stamp)) << SHORT_REAL_SHIFT;
+            break;
+        }
+
+        case UDP_STRING: {
+            int64_t stamp = 0;
+            for (size_t i = 0; i < content_len && content[i] >= '0' &&
+                    content[i] <= '9'; ++i) {
+                stamp = stamp * 10 + content[i] - '0';
+            }
+
+            latency = now_us - stamp;
+            break;
+        }
+
+        default:
+            return;
+    }
+
+    subscriber.latency.record(latency);
+    subscriber.type_latency[data_type].record(latency);
+    ++subscriber.type_count[data_type];
+    subscriber.type_bytes[data_type] += frame_bytes;
+}
+
+/**
+ * @brief Handles a compact frame's body, ignoring topic announcements.
+ *
+ * @param subscriber the subscriber's counters
+ * @param body the body
+ * @param len the length of the body
+ * @param with_address whether the publisher address is included
+ * @param frame_bytes how many bytes the frame took, 0 inside a batch
+ * @param now_us when it was received, since the benchmark started
+ * @return int - 1 if it was a message, 0 if it was an announcement, -1 if
+ *   it's malformed
+ */
+static int handle_v2_body(bench_subscriber &subscriber, const char *body,
+        const size_t len, const bool with_address, const size_t frame_bytes,
+        const int64_t now_us) {
+    v2_message decoded;
+    if (decode_v2_frame(body, len, with_address, decoded) < 0) {
+        return -1;
+    }
+
+    if (decoded.announce) {
+        return 0;
+    }
+
+    record_message(subscriber, decoded.data_type, decoded.content,
+        decoded.content_len, frame_bytes, now_us);
+    return 1;
+}
+
+/**
+ * @brief Connects a subscriber, negotiates the protocol and subscribes to
+ *   every benchmark topic.
+ *
+ * @param config the benchmark
+ * @param index the subscriber's index
+ * @param decoder the decoder of the stream received from the server
+ * @param version the accepted protocol version
+ * @param flags the accepted flags
+ * @return int - the socket, -1 on error
+ */
+static int connect_subscriber(const bench_config &config, const int index,
+        FrameDecoder &decoder, uint8_t &version, uint8_t &flags) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int enable = 1;
+    if (connect(fd, (sockaddr *)&config.server_address,
+            sizeof(config.server_address)) < 0 ||
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable,
+                sizeof(enable)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Send the ID, asking for the protocol
+    client_to_server_msg msg;
+    memset(&msg, 0, sizeof(msg));
+    snprintf(msg.client_id.id, MAX_ID_LEN + 1, "bench%d", index);
+    msg.client_id.version = config.version;
+    msg.client_id.flags = config.flags;
+    msg.len = htons(sizeof(msg.client_id) + 2);
+    if (send(fd, &msg, ntohs(msg.len), 0) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Wait for the answer, which decides how to subscribe
+    version = PROTOCOL_V1;
+    flags = 0;
+    if (config.version == PROTOCOL_V2) {
+        frame_view frame;
+        int err;
+        while ((err = decoder.next(frame)) == 0) {
+            if (decoder.recv_from(fd) <= 0) {
+                close(fd);
+                return -1;
+            }
+        }
+
+        v2_ack ack;
+        if (err < 0 || frame.len != sizeof(ack)) {
+            close(fd);
+            return -1;
+        }
+
+        memcpy(&ack, frame.data, sizeof(ack));
+        version = ack.version;
+        flags = ack.flags;
+
+        if (version == PROTOCOL_V2 && (flags & V2_BATCH)) {
+            decoder.use_varint_lengths(v2_batch_bound(MAX_BATCH_LEN));
+        } else if (version == PROTOCOL_V2) {
+            decoder.use_varint_lengths(sizeof(server_to_client_msg));
+        }
+    }
+
+    // Subscribe to every benchmark topic
+    if (version == PROTOCOL_V2) {
+        v2_command command;
+        command.opcode = V2_SUBSCRIBE;
+        command.sf = 0;
+        memcpy(command.topic, BENCH_PATTERN, strlen(BENCH_PATTERN));
+
+        uint16_t len = offsetof(v2_command, topic) + strlen(BENCH_PATTERN);
+        command.len = htons(len);
+        if (send(fd, &command, len, 0) < 0) {
+            close(fd);
+            return -1;
+        }
+
+        return fd;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    memcpy(msg.client_sub.command, SUB_CMD, strlen(SUB_CMD));
+    memcpy(msg.client_sub.topic, BENCH_PATTERN, strlen(BENCH_PATTERN));
+    msg.client_sub.sf[0] = '0';
+    msg.len = htons(sizeof(msg.client_sub) + 2);
+    if (send(fd, &msg, ntohs(msg.len), 0) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * @brief A subscriber thread: receives and times messages until its socket
+ *   is shut down.
+ *
+ * @param config the benchmark
+ * @param index the subscriber's index
+ * @param subscriber the subscriber's counters
+ */
+static void run_subscriber(const bench_config &config, const int index,
+        bench_subscriber &subscriber) {
+    FrameDecoder decoder(CLIENT_DECODER_CAPACITY,
+        sizeof(server_to_client_msg));
+    std::vector<char> scratch(MAX_BATCH_LEN);
+
+    uint8_t version;
+    uint8_t flags;
+    subscriber.fd = connect_subscriber(config, index, decoder, version,
+        flags);
+    if (subscriber.fd < 0) {
+        fprintf(stderr, "Error connecting subscriber %d.\n", index);
+        ++subscribers_failed;
+        return;
+    }
+
+    ++subscribers_ready;
+
+    bool with_address = !(flags & V2_NO_ADDRESS);
+    while (true) {
+        ssize_t n = decoder.recv_from(subscriber.fd);
+        if (n <= 0) {
+            break;
+        }
+
+        // Every message of the chunk arrived at the same time
+        int64_t now_us = bench_now_us();
+        subscriber.wire_bytes += n;
+        uint64_t delivered = 0;
+
+        frame_view frame;
+        int err;
+        while ((err = decoder.next(frame)) == 1) {
+            if (version != PROTOCOL_V2) {
+                // Skip the ack, and anything too short to be a message
+                if (frame.len < UDP_HDR_LEN) {
+                    continue;
+                }
+
+                const server_to_client_msg *msg =
+                    (const server_to_client_msg *)frame.data;
+                record_message(subscriber, msg->data_type,
+                    msg->content.udp_string, frame.len - UDP_HDR_LEN,
+                    frame.len, now_us);
+                ++delivered;
+                continue;
+            }
+
+            if (!(flags & V2_BATCH)) {
+                err = handle_v2_body(subscriber, frame.data, frame.len,
+                    with_address, varint_len(frame.len) + frame.len, now_us);
+                if (err < 0) {
+                    break;
+                }
+
+                delivered += err;
+                continue;
+            }
+
+            // The frames of a batch can't be told apart on the wire
+            const char *frames;
+            size_t frames_len;
+            if (unpack_v2_batch(frame.data, frame.len, scratch.data(),
+                    frames, frames_len) < 0) {
+                err = -1;
+                break;
+            }
+
+            size_t pos = 0;
+            while (pos < frames_len) {
+                uint32_t len;
+                int prefix = get_varint(frames + pos, frames_len - pos, len);
+                if (prefix <= 0 || len > frames_len - pos - prefix) {
+                    err = -1;
+                    break;
+                }
+
+                err = handle_v2_body(subscriber, frames + pos + prefix, len,
+                    with_address, 0, now_us);
+                if (err < 0) {
+                    break;
+                }
+
+                delivered += err;
+                pos += prefix + len;
+            }
+
+            if (err < 0) {
+                break;
+            }
+        }
+
+        if (err < 0) {
+            fprintf(stderr, "Malformed stream received by subscriber %d.\n",
+                index);
+            break;
+        }
+
+        if (delivered != 0) {
+            subscriber.last_delivery_us = now_us;
+            subscriber.delivered.fetch_add(delivered,
+                std::memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * @brief Prints a histogram's percentiles.
+ *
+ * @param name what the latencies are of
+ * @param latency the histogram
+ */
+static void print_latency(const char *name, const Histogram &latency) {
+    printf("%s latency (us): p50 %lu, p90 %lu, p99 %lu, p99.9 %lu, "
+        "max %lu, mean %.1f.\n", name, latency.percentile(50),
+        latency.percentile(90), latency.percentile(99),
+        latency.percentile(99.9), latency.max(), latency.mean());
+}
+
+/**
+ * @brief Parses a positive number option.
+ *
+ * @param arg the option's argument
+ * @param max the largest accepted value
+ * @param value the number
+ * @return int - the error code
+ */
+static int parse_count(const char *arg, const uint64_t max, uint64_t &value) {
+    if (!is_number(arg, strlen(arg))) {
+        return -1;
+    }
+
+    value = strtoull(arg, NULL, 10);
+    return value <= max ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    // Deactivate stdout buffer
+    setvbuf(stdout, NULL, _IONBF, BUFSIZ);
+
+    if (argc < 3) {
+        fprintf(stderr, BENCH_USAGE, argv[0]);
+        return -1;
+    }
+
+    bench_config config;
+    config.publishers = DEFAULT_BENCH_PUBLISHERS;
+    config.subscribers = DEFAULT_BENCH_SUBSCRIBERS;
+    config.rate = DEFAULT_BENCH_RATE;
+    config.seconds = DEFAULT_BENCH_SECONDS;
+    config.topics = DEFAULT_BENCH_TOPICS;
+    config.string_len = DEFAULT_BENCH_STRING_LEN;
+    config.version = 0;
+    config.flags = 0;
+    parse_mix("INT,SHORT_REAL,FLOAT,STRING", config.schedule);
+
+    // Parse the options following the positional arguments
+    optind = 3;
+    int opt;
+    uint64_t value = 0;
+    while ((opt = getopt(argc, argv, "p:s:r:d:m:l:T:v:nbz")) != -1) {
+        int err = 0;
+        switch (opt) {
+            case 'p':
+                err = parse_count(optarg, MAX_BENCH_THREADS, value);
+                config.publishers = value;
+                break;
+
+            case 's':
+                err = parse_count(optarg, MAX_BENCH_THREADS, value);
+                config.subscribers = value;
+                break;
+
+            case 'r':
+                err = parse_count(optarg, UINT32_MAX, config.rate);
+                break;
+
+            case 'd':
+                err = parse_count(optarg, 3600, value);
+                config.seconds = value;
+                break;
+
+            case 'm':
+                err = parse_mix(optarg, config.schedule);
+                break;
+
+            case 'l':
+                err = parse_count(optarg, MAX_CONTENT_LEN - 1, value);
+                config.string_len = value;
+                err = err < 0 || value < 24 ? -1 : 0;
+                break;
+
+            case 'T':
+                err = parse_count(optarg, 1000000, value);
+                config.topics = value;
+                break;
+
+            case 'v':
+                config.version = atoi(optarg);
+                err = config.version == PROTOCOL_V1 ||
+                    config.version == PROTOCOL_V2 ? 0 : -1;
+                break;
+
+            case 'n':
+                config.flags |= V2_NO_ADDRESS;
+                break;
+
+            case 'b':
+                config.flags |= V2_BATCH;
+                break;
+
+            case 'z':
+                config.flags |= V2_BATCH | V2_COMPRESS;
+                break;
+
+            default:
+                err = -1;
+                break;
+        }
+
+        if (err < 0) {
+            fprintf(stderr, BENCH_USAGE, argv[0]);
+            return -1;
+        }
+    }
+
+    if (optind != argc || config.publishers < 1 || config.subscribers < 1 ||
+            config.seconds < 1 || config.topics < 1) {
+        fprintf(stderr, BENCH_USAGE, argv[0]);
+        return -1;
+    }
+
+    if (config.flags != 0 && config.version != PROTOCOL_V2) {
+        fprintf(stderr, "The -n, -b and -z options need protocol 2.\n");
+        return -1;
+    }
+
+    // Set the server address
+    memset(&config.server_address, 0, sizeof(config.server_address));
+    config.server_address.sin_family = AF_INET;
+    config.server_address.sin_port = htons(atoi(argv[2]));
+    if (inet_aton(argv[1], &config.server_address.sin_addr) == 0) {
+        fprintf(stderr, "Incorrect IP address.\n");
+        return -1;
+    }
+
+    base_us = monotonic_us();
+
+    // Connect the subscribers first, so they see every message
+    std::vector<bench_subscriber> subscribers(config.subscribers);
+    std::vector<std::thread> subscriber_threads;
+    for (int i = 0; i < config.subscribers; ++i) {
+        subscriber_threads.emplace_back(run_subscriber, std::cref(config), i,
+            std::ref(subscribers[i]));
+    }
+
+    while (subscribers_ready + subscribers_failed < config.subscribers) {
+        usleep(1000);
+    }
+
+    // Give the server time to handle the subscriptions
+    usleep(200 * 1000);
+
+    std::vector<bench_publisher> publishers(config.publishers);
+    std::vector<std::thread> publisher_threads;
+    int64_t start_us = bench_now_us();
+    for (int i = 0; i < config.publishers; ++i) {
+        publishers[i].sent = 0;
+        publishers[i].errors = 0;
+        publisher_threads.emplace_back(run_publisher, std::cref(config), i,
+            std::ref(publishers[i]));
+    }
+
+    for (std::thread &thread : publisher_threads) {
+        thread.join();
+    }
+
+    int64_t published_us = bench_now_us();
+
+    uint64_t sent = 0;
+    uint64_t errors = 0;
+    for (const bench_publisher &publisher : publishers) {
+        sent += publisher.sent;
+        errors += publisher.errors;
+    }
+
+    // Wait for the last messages, until everything arrived or nothing did
+    // for a second
+    uint64_t expected = sent * subscribers_ready;
+    uint64_t delivered = 0;
+    int64_t progress_us = bench_now_us();
+    while (delivered < expected && bench_now_us() - progress_us < 1000000) {
+        usleep(10 * 1000);
+
+        uint64_t now_delivered = 0;
+        for (bench_subscriber &subscriber : subscribers) {
+            now_delivered += subscriber.delivered.load(
+                std::memory_order_relaxed);
+        }
+
+        if (now_delivered != delivered) {
+            delivered = now_delivered;
+            progress_us = bench_now_us();
+        }
+    }
+
+    for (bench_subscriber &subscriber : subscribers) {
+        if (subscriber.fd >= 0) {
+            shutdown(subscriber.fd, SHUT_RDWR);
+        }
+    }
+
+    for (std::thread &thread : subscriber_threads) {
+        thread.join();
+    }
+
+    // Merge the subscribers' counters
+    Histogram latency;
+    Histogram type_latency[UDP_STRING + 1];
+    uint64_t wire_bytes = 0;
+    uint64_t type_count[UDP_STRING + 1] = {0};
+    uint64_t type_bytes[UDP_STRING + 1] = {0};
+    int64_t last_delivery_us = start_us;
+    delivered = 0;
+
+    for (bench_subscriber &subscriber : subscribers) {
+        if (subscriber.fd >= 0) {
+            close(subscriber.fd);
+        }
+
+        delivered += subscriber.delivered;
+        wire_bytes += subscriber.wire_bytes;
+        last_delivery_us = std::max(last_delivery_us,
+            subscriber.last_delivery_us);
+        latency.merge(subscriber.latency);
+
+        for (int i = 0; i <= UDP_STRING; ++i) {
+            type_latency[i].merge(subscriber.type_latency[i]);
+            type_count[i] += subscriber.type_count[i];
+            type_bytes[i] += subscriber.type_bytes[i];
+        }
+    }
+
+    // Print the report
+    double publish_s = (published_us - start_us) / 1e6;
+    double deliver_s = std::max(last_delivery_us - start_us, (int64_t)1) /
+        1e6;
+
+    printf("Published: %lu messages in %.2f s (%.0f msg/s) by %d publishers, "
+        "%lu send errors.\n", sent, publish_s, sent / publish_s,
+        config.publishers, errors);
+    printf("Delivered: %lu of %lu messages in %.2f s (%.0f msg/s) to %d "
+        "subscribers, %lu lost.\n", delivered, expected, deliver_s,
+        delivered / deliver_s, (int)subscribers_ready, expected > delivered ?
+        expected - delivered : 0);
+    printf("Wire: %lu bytes received, %.2f bytes per message.\n", wire_bytes,
+        delivered == 0 ? 0.0 : (double)wire_bytes / delivered);
+    print_latency("Overall", latency);
+
+    bool batched = config.flags & V2_BATCH;
+    for (int i = 0; i <= UDP_STRING; ++i) {
+        if (type_count[i] == 0) {
+            continue;
+        }
+
+        // Only frames sent on their own have a size of their own
+        if (batched) {
+            printf("%s: %lu messages.\n", TYPE_NAMES[i], type_count[i]);
+        } else {
+            printf("%s: %lu messages, %.2f bytes per message.\n",
+                TYPE_NAMES[i], type_count[i],
+                (double)type_bytes[i] / type_count[i]);
+        }
+
+        print_latency(TYPE_NAMES[i], type_latency[i]);
+    }
+
+    return 0;
+}
@@ -2,22 +2,137 @@
 #include <cstring>
 #include <cstdlib>
 #include <vector>
+#include <string>
+#include <algorithm>
+#include <thread>
+#include <atomic>
 #include <unistd.h>
+#include <getopt.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include "include/utils.h"
+#include "include/frame_decoder.h"
+#include "include/protocol_v2.h"
+#include "include/format.h"
+#include "include/spsc_queue.h"
+#include "include/trace.h"
+
+/**
+ * @brief What was negotiated with the server: the protocol, its flags, and
+ *   the topics announced by the compact protocol, by reference. Compressed
+ *   batches are decompressed into the batch buffer.
+ *
+ */
+struct protocol_state {
+    uint8_t version;
+    uint8_t flags;
+    std::vector<std::string> topics;
+    std::vector<char> batch;
+};
+
+/**
+ * @brief A message handed over to the output thread, with the length of its
+ *   content and whether its address is to be printed.
+ *
+ */
+struct queued_message {
+    size_t content_len;
+    bool with_address;
+    server_to_client_msg msg;
+};
+
+/**
+ * @brief The stage between the thread which receives messages and the one
+ *   which prints them. The receiving thread never waits for stdout: when the
+ *   ring is full, the message is dropped and counted instead.
+ *
+ */
+struct pipeline {
+    SpscQueue<queued_message> ring;
+    int wake_fd;
+    std::atomic<bool> stopping;
+
+    // Signalled by the output thread when it can't write to stdout anymore
+    int failed_fd;
+    std::thread thread;
+
+    // Kept by the receiving thread
+    uint64_t received;
+    uint64_t overflowed;
+    uint64_t queued_since_wake;
+    size_t max_occupancy;
+    uint64_t occupancy_sum;
+
+    pipeline()
+            : ring(PIPELINE_RING_LEN), wake_fd(-1), stopping(false),
+              failed_fd(-1), received(0), overflowed(0), queued_since_wake(0),
+              max_occupancy(0), occupancy_sum(0) {}
+};
+
+/**
+ * @brief Where the messages are printed: how they're printed, the lines
+ *   waiting to be written to stdout, and the text of the last publisher
+ *   address printed. The answers to commands go to the status stream, which
+ *   isn't stdout when stdout is meant for machines. When pipelined, the
+ *   messages are printed by the output thread, which alone uses the buffer
+ *   and the address. Once writing to stdout failed, nothing more is printed
+ *   and the subscriber stops.
+ *
+ */
+struct output_state {
+    output_mode mode;
+    FILE *status;
+    OutputBuffer buffer;
+    address_cache address;
+    pipeline *pipe;
+    std::atomic<bool> failed;
+
+    explicit output_state(const output_mode mode)
+            : mode(mode), status(mode == OUTPUT_TEXT ? stdout : stderr),
+              buffer(STDOUT_FILENO), pipe(NULL), failed(false) {
+        address.valid = false;
+    }
+};
+
+/**
+ * @brief Sends a compact command, once the server accepted the compact
+ *   protocol.
+ *
+ * @param tcp_socket the socket to send on
+ * @param opcode the command's opcode
+ * @param topic the topic
+ * @param sf the SF flag
+ * @return int - the error code
+ */
+int send_v2_command(const int tcp_socket, const uint8_t opcode,
+        const char *topic, const uint8_t sf) {
+    v2_command command;
+    command.opcode = opcode;
+    command.sf = sf;
+    memcpy(command.topic, topic, strlen(topic));
+
+    // The topic isn't padded
+    uint16_t len = offsetof(v2_command, topic) + strlen(topic);
+    command.len = htons(len);
+
+    return send(tcp_socket, &command, len, 0) < 0 ? -1 : 0;
+}
 
 /**
  * @brief Continues parsing the line given from stdin, sending a
  *   "subscribe" message to the server.
  * 
  * @param tcp_socket the socket to send on 
+ * @param state the negotiated protocol
+ * @param status where to print the answer
  * @return int - the error code
  */
-int send_subscribe_msg(const int tcp_socket) {
+int send_subscribe_msg(const int tcp_socket, const protocol_state &state,
+        FILE *status) {
     // Grab the topic
     char *topic = strtok(NULL, WHITESPACE);
     if (topic == NULL || strlen(topic) > MAX_TOPIC_LEN) {
@@ -39,6 +154,18 @@ int send_subscribe_msg(const int tcp_socket) {
         return 0;
     }
 
+    // Use the compact command if the server accepted it
+    if (state.version == PROTOCOL_V2) {
+        if (send_v2_command(tcp_socket, V2_SUBSCRIBE, topic,
+                sf[0] == '1') < 0) {
+            fprintf(stderr, "Error subscribing to topic.\n");
+            return -2;
+        }
+
+        fprintf(status, "Subscribed to topic.\n");
+        return 0;
+    }
+
     // Construct the message and send it
     client_to_server_msg msg;
     memset(&msg, 0, sizeof(client_to_server_msg));
@@ -54,7 +181,7 @@ int send_subscribe_msg(const int tcp_socket) {
         return -2;
     }
 
-    fprintf(stdout, "Subscribed to topic.\n");
+    fprintf(status, "Subscribed to topic.\n");
 
 
     return 0;
@@ -65,9 +192,12 @@ int send_subscribe_msg(const int tcp_socket) {
  *   "unsubscribe" message to the server.
  * 
  * @param tcp_socket the socket to send on 
+ * @param state the negotiated protocol
+ * @param status where to print the answer
  * @return int - the error code
  */
-int send_unsubscribe_msg(const int tcp_socket) {
+int send_unsubscribe_msg(const int tcp_socket, const protocol_state &state,
+        FILE *status) {
     // Grab the topic
     char *topic = strtok(NULL, WHITESPACE);
     if (topic == NULL || strlen(topic) > MAX_TOPIC_LEN) {
@@ -82,6 +212,17 @@ int send_unsubscribe_msg(const int tcp_socket) {
         return 0;
     }
 
+    // Use the compact command if the server accepted it
+    if (state.version == PROTOCOL_V2) {
+        if (send_v2_command(tcp_socket, V2_UNSUBSCRIBE, topic, 0) < 0) {
+            fprintf(stderr, "Error unsubscribing from topic.\n");
+            return -2;
+        }
+
+        fprintf(status, "Unsubscribed from topic.\n");
+        return 0;
+    }
+
     // Construct the message and send it
     client_to_server_msg msg;
     memset(&msg, 0, sizeof(client_to_server_msg));
@@ -96,7 +237,7 @@ int send_unsubscribe_msg(const int tcp_socket) {
         return -2;
     }
 
-    fprintf(stdout, "Unsubscribed from topic.\n");
+    fprintf(status, "Unsubscribed from topic.\n");
 
     return 0;
 }
@@ -105,9 +246,12 @@ int send_unsubscribe_msg(const int tcp_socket) {
  * @brief Handles input from stdin.
  * 
  * @param tcp_socket the socket towards the server
+ * @param state the negotiated protocol
+ * @param status where to print the answers
  * @return int - the error code
  */
-int handle_stdin(const int tcp_socket) {
+int handle_stdin(const int tcp_socket, const protocol_state &state,
+        FILE *status) {
     // Read the message from stdin
     char buffer[BUFLEN + 1];
     memset(buffer, 0, BUFLEN + 1);
@@ -127,15 +271,22 @@ int handle_stdin(const int tcp_socket) {
         return -1;
     }
 
+    // If the message is "trace", write the recorded events to the given
+    // file, or to the default one
+    if (strcmp(cmd, TRACE_CMD) == 0) {
+        trace_dump(strtok(NULL, WHITESPACE));
+        return 0;
+    }
+
     // If the message is "subscribe", subscribe to the topic
     if (strcmp(cmd, SUB_CMD) == 0 || strcmp(cmd, SH_SUB_CMD) == 0 ) {
-        send_subscribe_msg(tcp_socket);
+        send_subscribe_msg(tcp_socket, state, status);
         return 0;
     }
 
     // If the message is "unsubscribe", unsubscribe from the topic
     if (strcmp(cmd, UNSUB_CMD) == 0 || strcmp(cmd, SH_UNSUB_CMD) == 0) {
-        send_unsubscribe_msg(tcp_socket);
+        send_unsubscribe_msg(tcp_socket, state, status);
         return 0;
     }
 
@@ -144,136 +295,447 @@ int handle_stdin(const int tcp_socket) {
 }
 
 /**
- * @brief Used for parsing an UDP message INT.
+ * @brief Formats a message, the way the output mode asks, into what's
+ *   waiting to be written to stdout.
  * 
  * @param msg the UDP message received from the server
- * @param res the result
+ * @param content_len how many bytes of content the message has
+ * @param with_address whether the message carries the publisher address
+ * @param output where the message is printed
+ * @return int - the error code
  */
-void parse_int(const server_to_client_msg &msg, char *res) {
-    // Convert the integer
-    uint32_t integer = ntohl(msg.content.udp_int.data);
+int write_message(const server_to_client_msg &msg, const size_t content_len,
+        const bool with_address, output_state &output) {
+    TRACE_SCOPE("format");
+
+    // Make room for the longest line of the output mode, writing what was
+    // printed before if needed
+    size_t max_len = output.mode == OUTPUT_BINARY ?
+        sizeof(server_to_client_msg) :
+        output.mode == OUTPUT_NDJSON ? NDJSON_MAX_LINE : FORMAT_MAX_LINE;
+    char *line = output.buffer.reserve(max_len);
+    if (line == NULL) {
+        fprintf(stderr, "Error writing to stdout.\n");
+        output.failed.store(true, std::memory_order_relaxed);
+        return -1;
+    }
+
+    // Format the message straight into the output buffer
+    switch (output.mode) {
+        case OUTPUT_BINARY:
+            output.buffer.commit(format_message_binary(msg, content_len,
+                line));
+            break;
 
-    // Write the integer
-    if (msg.content.udp_int.sign == 0) {
-        sprintf(res, "%u", integer);
-    } else {
-        sprintf(res, "-%u", integer);
+        case OUTPUT_NDJSON:
+            output.buffer.commit(format_message_ndjson(msg, content_len,
+                with_address, output.address, line));
+            break;
+
+        default:
+            output.buffer.commit(format_message(msg, content_len,
+                with_address, output.address, line));
+            break;
     }
+
+    return 0;
+}
+
+/**
+ * @brief Writes what was printed to stdout.
+ * 
+ * @param output where the messages are printed
+ * @return int - the error code
+ */
+int write_stdout(output_state &output) {
+    TRACE_SCOPE("write_stdout");
+    if (output.buffer.flush() < 0) {
+        fprintf(stderr, "Error writing to stdout.\n");
+        output.failed.store(true, std::memory_order_relaxed);
+        return -1;
+    }
+
+    return 0;
 }
 
 /**
- * @brief Used for parsing an UDP message SHORT_REAL.
+ * @brief Hands a message over to the output thread, unless the ring is
+ *   full.
  * 
  * @param msg the UDP message received from the server
- * @param res the result
+ * @param content_len how many bytes of content the message has
+ * @param with_address whether the message carries the publisher address
+ * @param pipe the pipeline towards the output thread
  */
-void parse_short_real(const server_to_client_msg &msg, char *res) {
-    // Convert the short real
-    uint16_t sh = ntohs(msg.content.udp_short_real.data);
+void queue_message(const server_to_client_msg &msg, const size_t content_len,
+        const bool with_address, pipeline &pipe) {
+    TRACE_SCOPE("queue");
+    ++pipe.received;
+
+    queued_message *slot = pipe.ring.claim();
+    if (slot == NULL) {
+        ++pipe.overflowed;
+        return;
+    }
 
-    // Write the short real
-    sprintf(res, "%.2f", (float)sh / 100.0f);
+    // Only copy the part of the message which was received
+    slot->content_len = content_len;
+    slot->with_address = with_address;
+    memcpy(&slot->msg, &msg, UDP_HDR_LEN + content_len);
+    pipe.ring.publish();
+    ++pipe.queued_since_wake;
+
+    // Sample how full the ring gets
+    size_t occupancy = pipe.ring.size();
+    pipe.max_occupancy = std::max(pipe.max_occupancy, occupancy);
+    pipe.occupancy_sum += occupancy;
 }
 
 /**
- * @brief Used for parsing an UDP message FLOAT.
+ * @brief Handles a single UDP message received from the server, printing
+ *   it, or handing it over to the output thread when pipelined.
  * 
  * @param msg the UDP message received from the server
- * @param res the result
+ * @param content_len how many bytes of content the message has
+ * @param with_address whether the message carries the publisher address
+ * @param output where the message is printed
+ * @return int - the error code
  */
-void parse_float(const server_to_client_msg &msg, char *res) {
-    // Convert the integer
-    uint32_t integer = ntohl(msg.content.udp_float.data);
+int handle_message(const server_to_client_msg &msg,
+        const size_t content_len, const bool with_address,
+        output_state &output) {
+    if (output.pipe != NULL) {
+        queue_message(msg, content_len, with_address, *output.pipe);
+        return 0;
+    }
 
-    // Get the power of 10 byte
-    uint8_t pow_of_10 = msg.content.udp_float.pow_10;
+    return write_message(msg, content_len, with_address, output);
+}
+
+/**
+ * @brief Writes what the messages received so far printed, or wakes the
+ *   output thread up when pipelined and new messages were handed over.
+ * 
+ * @param output where the messages are printed
+ * @return int - the error code
+ */
+int flush_output(output_state &output) {
+    if (output.pipe == NULL) {
+        return write_stdout(output);
+    }
+
+    // The output thread already reported why it stopped
+    if (output.failed.load(std::memory_order_relaxed)) {
+        return -1;
+    }
 
-    // Create the number
-    float power = 1.0f;
-    for (uint8_t i = 1; i <= pow_of_10; ++i) {
-        power *= 10.0f;
+    if (output.pipe->queued_since_wake == 0) {
+        return 0;
     }
 
-    float num = 1.0f * integer / power;
+    output.pipe->queued_since_wake = 0;
 
-    // Write the float
-    if (msg.content.udp_float.sign == 0) {
-        sprintf(res, "%f", num);
-    } else {
-        sprintf(res, "-%f", num);
+    uint64_t value = 1;
+    if (write(output.pipe->wake_fd, &value, sizeof(value)) < 0) {
+        fprintf(stderr, "Error waking the output thread up.\n");
     }
+
+    return 0;
 }
 
 /**
- * @brief Handles a single UDP message received from the server, parsing
- *   and then printing it to stdout.
+ * @brief The output thread: prints the messages handed over through the
+ *   ring, writing them to stdout each time the ring runs dry, and sleeps on
+ *   the eventfd until more arrive or until it's told to stop.
  * 
- * @param msg the UDP message received from the server
- * @return int - the error code
+ * @param output where the messages are printed
  */
-int handle_message(const server_to_client_msg &msg) {
-    // Declare variables to be printed
-    char *ip = inet_ntoa((in_addr){msg.ip});
-    uint16_t port = ntohs(msg.port);
-
-    char topic[MAX_TOPIC_LEN + 1];
-    memset(topic, 0, MAX_TOPIC_LEN + 1);
-    memcpy(topic, msg.topic, MAX_TOPIC_LEN);
-
-    char data_type[12];
-    memset(data_type, 0, 12);
-
-    char content[MAX_CONTENT_LEN + 1];
-    memset(content, 0, MAX_CONTENT_LEN + 1);
-
-    // Create the message based on its data type
-    switch (msg.data_type) {
-        case UDP_INT:
-            parse_int(msg, content);
-            strcpy(data_type, UDP_INT_STR);
-            break;
+void run_output(output_state &output) {
+    TRACE_THREAD("output");
+    pipeline &pipe = *output.pipe;
 
-        case UDP_SHORT_REAL:
-            parse_short_real(msg, content);
-            strcpy(data_type, UDP_SHORT_REAL_STR);
-            break;
+    while (true) {
+        // Stop printing once stdout can't be written to anymore, and tell
+        // the receiving thread to stop too
+        queued_message *slot;
+        bool failed = false;
+        while (!failed && (slot = pipe.ring.front()) != NULL) {
+            failed = write_message(slot->msg, slot->content_len,
+                slot->with_address, output) < 0;
+            pipe.ring.release();
+        }
 
-        case UDP_FLOAT:
-            parse_float(msg, content);
-            strcpy(data_type, UDP_FLOAT_STR);
+        if (failed || write_stdout(output) < 0) {
+            uint64_t value = 1;
+            if (write(pipe.failed_fd, &value, sizeof(value)) < 0) {
+                fprintf(stderr, "Error stopping the receiving thread.\n");
+            }
+
+            return;
+        }
+
+        // Everything was handed over before stopping was asked for
+        bool stopping = pipe.stopping.load(std::memory_order_acquire);
+        if (stopping && pipe.ring.size() == 0) {
             break;
+        }
 
-        case UDP_STRING:
-            strncpy(content, msg.content.udp_string, MAX_CONTENT_LEN);
-            strcpy(data_type, UDP_STRING_STR);
+        TRACE_SCOPE("wait");
+        uint64_t value;
+        if (!stopping && read(pipe.wake_fd, &value, sizeof(value)) < 0) {
+            fprintf(stderr, "Error waiting for messages to print.\n");
             break;
+        }
     }
+}
 
-    // Print the message to stdout
-    fprintf(stdout, "%s:%hu - %s - %s - %s\n",
-            ip, port, msg.topic, data_type, content);
+/**
+ * @brief Starts the output thread.
+ * 
+ * @param output where the messages are printed
+ * @return int - the error code
+ */
+int start_pipeline(output_state &output) {
+    pipeline *pipe = new pipeline();
+
+    pipe->wake_fd = eventfd(0, EFD_CLOEXEC);
+    pipe->failed_fd = eventfd(0, EFD_CLOEXEC);
+    if (pipe->wake_fd < 0 || pipe->failed_fd < 0) {
+        fprintf(stderr, "Error creating the output thread's eventfd.\n");
+        close(pipe->wake_fd);
+        close(pipe->failed_fd);
+        delete pipe;
+        return -1;
+    }
+
+    output.pipe = pipe;
+    pipe->thread = std::thread(run_output, std::ref(output));
 
     return 0;
 }
 
+/**
+ * @brief Lets the output thread print what's left, waits for it, and
+ *   reports how full the ring got and how many messages it dropped.
+ * 
+ * @param output where the messages are printed
+ */
+void stop_pipeline(output_state &output) {
+    pipeline *pipe = output.pipe;
+
+    pipe->stopping.store(true, std::memory_order_release);
+
+    uint64_t value = 1;
+    if (write(pipe->wake_fd, &value, sizeof(value)) < 0) {
+        fprintf(stderr, "Error waking the output thread up.\n");
+    }
+
+    pipe->thread.join();
+
+    uint64_t queued = pipe->received - pipe->overflowed;
+    fprintf(stderr, "Pipeline: %lu messages received, %lu dropped with the "
+        "ring full, ring occupancy %.1f on average, %zu at most, of %d "
+        "slots.\n", pipe->received, pipe->overflowed,
+        queued == 0 ? 0.0 : (double)pipe->occupancy_sum / queued,
+        pipe->max_occupancy, PIPELINE_RING_LEN);
+
+    close(pipe->wake_fd);
+    close(pipe->failed_fd);
+    delete pipe;
+    output.pipe = NULL;
+}
+
+/**
+ * @brief Handles a single compact frame received from the server, either
+ *   remembering the topic it announces, or printing the message it carries.
+ * 
+ * @param frame the frame's body
+ * @param state the negotiated protocol
+ * @param output where the message is printed
+ * @return int - the error code
+ */
+int handle_v2_frame(const frame_view &frame, protocol_state &state,
+        output_state &output) {
+    bool with_address = !(state.flags & V2_NO_ADDRESS);
+
+    v2_message decoded;
+    if (decode_v2_frame(frame.data, frame.len, with_address, decoded) < 0) {
+        return -1;
+    }
+
+    if (decoded.announce) {
+        if (decoded.topic_ref >= state.topics.size()) {
+            state.topics.resize(decoded.topic_ref + 1);
+        }
+
+        state.topics[decoded.topic_ref].assign(decoded.topic,
+            decoded.topic_len);
+        return 0;
+    }
+
+    // Every topic is announced before its first message
+    if (decoded.topic_ref >= state.topics.size()) {
+        return -1;
+    }
+
+    // Rebuild the legacy message, to print it the same way
+    const std::string &topic = state.topics[decoded.topic_ref];
+
+    server_to_client_msg msg;
+    memset(&msg, 0, UDP_HDR_LEN);
+    msg.len = htons(UDP_HDR_LEN + decoded.content_len);
+    msg.ip = decoded.ip;
+    msg.port = decoded.port;
+    memcpy(msg.topic, topic.data(), topic.size());
+    msg.data_type = decoded.data_type;
+    memcpy(&msg.content, decoded.content, decoded.content_len);
+
+    return handle_message(msg, decoded.content_len, with_address, output);
+}
+
+/**
+ * @brief Handles a batch of compact frames received from the server.
+ * 
+ * @param frame the batch's body
+ * @param state the negotiated protocol
+ * @param output where the messages are printed
+ * @return int - the error code
+ */
+int handle_v2_batch(const frame_view &frame, protocol_state &state,
+        output_state &output) {
+    const char *frames;
+    size_t frames_len;
+    if (unpack_v2_batch(frame.data, frame.len, state.batch.data(), frames,
+            frames_len) < 0) {
+        return -1;
+    }
+
+    // The frames are whole, so none may be cut short
+    size_t pos = 0;
+    while (pos < frames_len) {
+        uint32_t len;
+        int prefix = get_varint(frames + pos, frames_len - pos, len);
+        if (prefix <= 0 || len > frames_len - pos - prefix) {
+            return -1;
+        }
+
+        frame_view inner;
+        inner.data = frames + pos + prefix;
+        inner.len = len;
+        if (handle_v2_frame(inner, state, output) < 0) {
+            return -1;
+        }
+
+        pos += prefix + len;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Checks if a legacy frame is the server's answer to the protocol
+ *   the client asked for, and switches to the protocol it accepted.
+ * 
+ * @param frame the frame
+ * @param decoder the decoder of the stream received from the server
+ * @param state the negotiated protocol
+ * @return true, if the frame was the answer
+ */
+bool handle_ack(const frame_view &frame, FrameDecoder &decoder,
+        protocol_state &state) {
+    if (frame.len != sizeof(v2_ack) ||
+            (uint8_t)frame.data[offsetof(v2_ack, magic)] != V2_ACK_MAGIC) {
+        return false;
+    }
+
+    v2_ack ack;
+    memcpy(&ack, frame.data, sizeof(ack));
+
+    state.version = ack.version;
+    state.flags = ack.flags;
+
+    // The frames which follow the answer use the accepted protocol
+    if (state.version == PROTOCOL_V2 && (state.flags & V2_BATCH)) {
+        state.batch.resize(MAX_BATCH_LEN);
+        decoder.use_varint_lengths(v2_batch_bound(MAX_BATCH_LEN));
+    } else if (state.version == PROTOCOL_V2) {
+        decoder.use_varint_lengths(sizeof(server_to_client_msg));
+    }
+
+    return true;
+}
+
 /**
  * @brief Receives all UDP messages received from the server.
  * 
  * @param tcp_socket the socket towards the server
+ * @param decoder the decoder of the stream received from the server
+ * @param state the negotiated protocol
+ * @param output where the messages are printed
  * @return int - the error code
  */
-int handle_tcp_socket(const int tcp_socket) {
-    // Receive all the messages from the server
-    std::vector<char *> messages;
-    int err = recv_messages(tcp_socket, messages);
-    if (err <= 0) {
+int handle_tcp_socket(const int tcp_socket, FrameDecoder &decoder,
+        protocol_state &state, output_state &output) {
+    // Receive the next chunk of the stream
+    ssize_t n;
+    {
+        TRACE_SCOPE("recv");
+        n = decoder.recv_from(tcp_socket);
+    }
+
+    if (n < 0) {
+        fprintf(stderr, "Error reading from TCP socket.\n");
         return -1;
     }
 
-    // Handle each server message
-    for (auto &msg : messages) {
-        handle_message(*((server_to_client_msg *)msg));
-        delete[] msg;
+    if (n == 0) {
+        // The connection to the server was lost
+        return -1;
+    }
+
+    TRACE_COUNTER("bytes_received", n);
+
+    // Handle each complete server message
+    TRACE_SCOPE("frames");
+    frame_view frame;
+    int err;
+    while ((err = decoder.next(frame)) == 1) {
+        if (state.version == PROTOCOL_V2) {
+            err = (state.flags & V2_BATCH) ?
+                handle_v2_batch(frame, state, output) :
+                handle_v2_frame(frame, state, output);
+            if (err < 0) {
+                err = -1;
+                break;
+            }
+
+            continue;
+        }
+
+        if (handle_ack(frame, decoder, state)) {
+            continue;
+        }
+
+        // Skip frames too short to hold the header
+        if (frame.len < UDP_HDR_LEN) {
+            continue;
+        }
+
+        if (handle_message(*((server_to_client_msg *)frame.data),
+                frame.len - UDP_HDR_LEN, true, output) < 0) {
+            break;
+        }
+    }
+
+    // Write what this chunk of the stream printed, all at once. A failed
+    // write was already reported
+    if (flush_output(output) < 0 || output.failed.load()) {
+        return -1;
+    }
+
+    if (err < 0) {
+        fprintf(stderr, "Malformed message received from server.\n");
+        return -1;
     }
 
     return 0;
@@ -284,10 +746,75 @@ int main(int argc, char **argv) {
     setvbuf(stdout, NULL, _IONBF, BUFSIZ);
 
     // Extract the info from the command line arguments
-    if (argc != 4) {
+    if (argc < 4) {
         fprintf(stderr, "Incorrect command arguments.\n");
-        fprintf(stderr, "Usage: %s <ID_CLIENT> <SERVER_IP> <SERVER_PORT>\n",
-            argv[0]);
+        fprintf(stderr, SUBSCRIBER_USAGE, argv[0]);
+        return -1;
+    }
+
+    // Parse the options following the positional arguments
+    uint8_t version = 0;
+    uint8_t flags = 0;
+    output_mode mode = OUTPUT_TEXT;
+    bool pipelined = false;
+
+    optind = 4;
+    int opt;
+    while ((opt = getopt(argc, argv, "v:nbzo:p")) != -1) {
+        switch (opt) {
+            case 'v':
+                version = atoi(optarg);
+                if (version != PROTOCOL_V1 && version != PROTOCOL_V2) {
+                    fprintf(stderr, "Incorrect protocol version %s.\n",
+                        optarg);
+                    return -1;
+                }
+                break;
+
+            case 'n':
+                flags |= V2_NO_ADDRESS;
+                break;
+
+            case 'b':
+                flags |= V2_BATCH;
+                break;
+
+            case 'z':
+                flags |= V2_BATCH | V2_COMPRESS;
+                break;
+
+            case 'o':
+                if (strcmp(optarg, OUTPUT_TEXT_STR) == 0) {
+                    mode = OUTPUT_TEXT;
+                } else if (strcmp(optarg, OUTPUT_BINARY_STR) == 0) {
+                    mode = OUTPUT_BINARY;
+                } else if (strcmp(optarg, OUTPUT_NDJSON_STR) == 0) {
+                    mode = OUTPUT_NDJSON;
+                } else {
+                    fprintf(stderr, "Output mode must be either %s, %s or "
+                        "%s.\n", OUTPUT_TEXT_STR, OUTPUT_BINARY_STR,
+                        OUTPUT_NDJSON_STR);
+                    return -1;
+                }
+                break;
+
+            case 'p':
+                pipelined = true;
+                break;
+
+            default:
+                fprintf(stderr, SUBSCRIBER_USAGE, argv[0]);
+                return -1;
+        }
+    }
+
+    if (optind != argc) {
+        fprintf(stderr, SUBSCRIBER_USAGE, argv[0]);
+        return -1;
+    }
+
+    if (flags != 0 && version != PROTOCOL_V2) {
+        fprintf(stderr, "The -n, -b and -z options need protocol 2.\n");
         return -1;
     }
 
@@ -339,7 +866,7 @@ int main(int argc, char **argv) {
     }
 
     // Disable Nagle
-    int enable = 0;
+    int enable = 1;
     if (setsockopt(tcp_socket, IPPROTO_TCP,
             TCP_NODELAY, &enable, sizeof(int)) < 0) {
         fprintf(stderr, "Error disabling Nagle.\n");
@@ -351,6 +878,8 @@ int main(int argc, char **argv) {
     memset(&msg, 0, sizeof(client_to_server_msg));
 
     memcpy(msg.client_id.id, id, MAX_ID_LEN);
+    msg.client_id.version = version;
+    msg.client_id.flags = flags;
     msg.len = htons(sizeof(msg.client_id) + 2);
 
     int n = send(tcp_socket, &msg, ntohs(msg.len), 0);
@@ -359,6 +888,24 @@ int main(int argc, char **argv) {
         return -1;
     }
 
+    // Create the decoder of the stream received from the server
+    FrameDecoder decoder(CLIENT_DECODER_CAPACITY, sizeof(server_to_client_msg));
+
+    // Speak the legacy protocol until the server accepts another one
+    protocol_state state;
+    state.version = PROTOCOL_V1;
+    state.flags = 0;
+
+    TRACE_THREAD("subscriber");
+
+    // Print the messages through a buffer, flushed once per received chunk
+    output_state output(mode);
+
+    // Print from another thread, so a slow stdout doesn't stall receiving
+    if (pipelined && start_pipeline(output) < 0) {
+        return -1;
+    }
+
     // Create and clear the read file descriptors
     fd_set read_fds;
     fd_set tmp_read_fds;
@@ -371,15 +918,31 @@ int main(int argc, char **argv) {
     // Add STDIN fd to read descriptors
     FD_SET(STDIN_FILENO, &read_fds);
 
+    // Add the descriptor the output thread signals its failures on
+    int max_fd = tcp_socket;
+    if (output.pipe != NULL) {
+        FD_SET(output.pipe->failed_fd, &read_fds);
+        max_fd = std::max(max_fd, output.pipe->failed_fd);
+    }
+
     // Begin an infinite loop, holding the logic of the client
     while (true) {
         // Store the read fds in a temporary variable
         tmp_read_fds = read_fds;
 
         // Detect new changes to the read fds
-        err = select(tcp_socket + 1, &tmp_read_fds, NULL, NULL, NULL);
+        {
+            TRACE_SCOPE("select");
+            err = select(max_fd + 1, &tmp_read_fds, NULL, NULL, NULL);
+        }
+
         if (err < 0) {
             fprintf(stderr, "Error selecting the read file descriptors.\n");
+
+            if (output.pipe != NULL) {
+                stop_pipeline(output);
+            }
+
             return -1;
         }
 
@@ -387,13 +950,18 @@ int main(int argc, char **argv) {
         bool should_close = false;
 
         // Go through each descriptor and check if it's set
-        for (int fd = 0; fd <= tcp_socket; ++fd) {
+        for (int fd = 0; fd <= max_fd; ++fd) {
             if (FD_ISSET(fd, &tmp_read_fds)) {
                 // Check which descriptor is set
                 if (fd == STDIN_FILENO) {
-                    err = handle_stdin(tcp_socket);
+                    err = handle_stdin(tcp_socket, state, output.status);
                 } else if (fd == tcp_socket) {
-                    err = handle_tcp_socket(tcp_socket);
+                    err = handle_tcp_socket(tcp_socket, decoder, state,
+                        output);
+                } else if (output.pipe != NULL &&
+                        fd == output.pipe->failed_fd) {
+                    // The output thread already reported why it stopped
+                    err = -1;
                 }
 
                 if (err < 0) {
@@ -410,8 +978,19 @@ int main(int argc, char **argv) {
         }
     }
 
+    // Print what's left
+    if (output.pipe != NULL) {
+        stop_pipeline(output);
+    }
+
+    // Keep what was traced until the end
+    if (TRACE_ENABLED) {
+        trace_dump(NULL);
+    }
+
     // Close the TCP socket
     close(tcp_socket);
 
-    return 0;
+    // Losing messages to a failed stdout is an error
+    return output.failed.load() ? -1 : 0;
 }
@@ -0,0 +1,206 @@
+#include <iostream>
+#include <cerrno>
+#include <unistd.h>
+#include "include/event_loop.h"
+
+#ifdef EVENT_LOOP_EPOLL
+
+/**
+ * @brief Converts the loop's interest flags to epoll flags.
+ *
+ * @param events the interest flags
+ * @return uint32_t - the epoll flags
+ */
+static uint32_t to_epoll_events(const uint32_t events) {
+    uint32_t res = 0;
+    if (events & EV_READ) {
+        res |= EPOLLIN | EPOLLRDHUP;
+    }
+
+    if (events & EV_WRITE) {
+        res |= EPOLLOUT;
+    }
+
+    if (events & EV_EDGE) {
+        res |= EPOLLET;
+    }
+
+    return res;
+}
+
+EventLoop::EventLoop() : epoll_fd(-1), epoll_events(MAX_READY_EVENTS) {}
+
+EventLoop::~EventLoop() {
+    if (epoll_fd != -1) {
+        close(epoll_fd);
+    }
+}
+
+int EventLoop::init() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        fprintf(stderr, "Error creating the epoll instance.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int EventLoop::add(const int fd, const uint32_t events) {
+    epoll_event ev;
+    ev.events = to_epoll_events(events);
+    ev.data.fd = fd;
+
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int EventLoop::modify(const int fd, const uint32_t events) {
+    epoll_event ev;
+    ev.events = to_epoll_events(events);
+    ev.data.fd = fd;
+
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int EventLoop::remove(const int fd) {
+    return epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int EventLoop::wait(std::vector<io_event> &ready, const int timeout_ms) {
+    ready.clear();
+
+    int n = epoll_wait(epoll_fd, epoll_events.data(),
+        epoll_events.size(), timeout_ms);
+    if (n < 0) {
+        // Being interrupted by a signal is not an error
+        return errno == EINTR ? 0 : -1;
+    }
+
+    // Translate the epoll flags back to the loop's flags
+    for (int i = 0; i < n; ++i) {
+        uint32_t events = 0;
+        if (epoll_events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+            events |= EV_READ;
+        }
+
+        if (epoll_events[i].events & EPOLLOUT) {
+            events |= EV_WRITE;
+        }
+
+        if (epoll_events[i].events & (EPOLLERR | EPOLLHUP)) {
+            // Let the read handler discover the error / hangup
+            events |= EV_READ | EV_ERROR;
+        }
+
+        ready.push_back({epoll_events[i].data.fd, events});
+    }
+
+    return n;
+}
+
+#else
+
+/**
+ * @brief Converts the loop's interest flags to poll flags.
+ *
+ * @param events the interest flags
+ * @return short - the poll flags
+ */
+static short to_poll_events(const uint32_t events) {
+    short res = 0;
+    if (events & EV_READ) {
+        res |= POLLIN;
+    }
+
+    if (events & EV_WRITE) {
+        res |= POLLOUT;
+    }
+
+    return res;
+}
+
+EventLoop::EventLoop() {}
+
+EventLoop::~EventLoop() {}
+
+int EventLoop::init() {
+    return 0;
+}
+
+int EventLoop::add(const int fd, const uint32_t events) {
+    if (fd_to_index.find(fd) != fd_to_index.end()) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    fd_to_index[fd] = poll_fds.size();
+    poll_fds.push_back({fd, to_poll_events(events), 0});
+
+    return 0;
+}
+
+int EventLoop::modify(const int fd, const uint32_t events) {
+    auto it = fd_to_index.find(fd);
+    if (it == fd_to_index.end()) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    poll_fds[it->second].events = to_poll_events(events);
+    return 0;
+}
+
+int EventLoop::remove(const int fd) {
+    auto it = fd_to_index.find(fd);
+    if (it == fd_to_index.end()) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    // Move the last descriptor in the removed one's place
+    size_t index = it->second;
+    poll_fds[index] = poll_fds.back();
+    fd_to_index[poll_fds[index].fd] = index;
+
+    poll_fds.pop_back();
+    fd_to_index.erase(fd);
+
+    return 0;
+}
+
+int EventLoop::wait(std::vector<io_event> &ready, const int timeout_ms) {
+    ready.clear();
+
+    int n = poll(poll_fds.data(), poll_fds.size(), timeout_ms);
+    if (n < 0) {
+        // Being interrupted by a signal is not an error
+        return errno == EINTR ? 0 : -1;
+    }
+
+    // Collect the ready descriptors
+    for (auto &pfd : poll_fds) {
+        if (pfd.revents == 0) {
+            continue;
+        }
+
+        uint32_t events = 0;
+        if (pfd.revents & POLLIN) {
+            events |= EV_READ;
+        }
+
+        if (pfd.revents & POLLOUT) {
+            events |= EV_WRITE;
+        }
+
+        if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            // Let the read handler discover the error / hangup
+            events |= EV_READ | EV_ERROR;
+        }
+
+        ready.push_back({pfd.fd, events});
+    }
+
+    return ready.size();
+}
+
+#endif
@@ -0,0 +1,432 @@
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <algorithm>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include "include/format.h"
+
+#define MAX_FLOAT_POW 256
+#define MAX_DECIMALS 9
+
+// Appends a string literal, without its terminator
+#define APPEND_LITERAL(out, str) append(out, str, sizeof(str) - 1)
+
+// The two digits of every number below 100
+static const char DIGIT_PAIRS[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233"
+    "34353637383940414243444546474849505152535455565758596061626364656667"
+    "68697071727374757677787980818283848586878889909192939495969798"
+    "99";
+
+static const uint64_t POW10[MAX_DECIMALS + 1] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL
+};
+
+/**
+ * @brief The powers of ten a FLOAT's exponent may ask for, built the same
+ *   way the values were always decoded: multiplying floats by ten one step
+ *   at a time, rounding at each step.
+ *
+ */
+struct float_power_table {
+    float powers[MAX_FLOAT_POW];
+
+    float_power_table() {
+        float power = 1.0f;
+        for (int i = 0; i < MAX_FLOAT_POW; ++i) {
+            powers[i] = power;
+            power *= 10.0f;
+        }
+    }
+};
+
+static const float_power_table FLOAT_POWERS;
+
+size_t format_u32(uint32_t value, char *out) {
+    // Write the digits backwards, two at a time, then move them in place
+    char digits[10];
+    size_t pos = sizeof(digits);
+
+    while (value >= 100) {
+        uint32_t pair = value % 100;
+        value /= 100;
+        pos -= 2;
+        memcpy(digits + pos, DIGIT_PAIRS + 2 * pair, 2);
+    }
+
+    if (value >= 10) {
+        pos -= 2;
+        memcpy(digits + pos, DIGIT_PAIRS + 2 * value, 2);
+    } else {
+        digits[--pos] = '0' + value;
+    }
+
+    size_t len = sizeof(digits) - pos;
+    memcpy(out, digits + pos, len);
+    return len;
+}
+
+/**
+ * @brief Writes an unsigned integer in decimal, padded with zeros.
+ *
+ * @param value the integer
+ * @param width the number of digits
+ * @param out where to write
+ */
+static void format_padded(uint64_t value, const int width, char *out) {
+    for (int i = width - 1; i >= 0; --i) {
+        out[i] = '0' + value % 10;
+        value /= 10;
+    }
+}
+
+size_t format_fixed(const float value, const int decimals, char *out) {
+    // The float is exactly mantissa * 2^exponent
+    int exponent;
+    float fraction = frexpf(value, &exponent);
+    uint64_t mantissa = (uint64_t)ldexpf(fraction, 24);
+    exponent -= 24;
+
+    // Scale it by 10^decimals, rounding half to even like printf()
+    unsigned __int128 scaled = (unsigned __int128)mantissa * POW10[decimals];
+    uint64_t rounded;
+    if (exponent >= 0) {
+        rounded = (uint64_t)(scaled << exponent);
+    } else if (-exponent >= 120) {
+        // Far below half of the last decimal
+        rounded = 0;
+    } else {
+        int shift = -exponent;
+        unsigned __int128 quotient = scaled >> shift;
+        unsigned __int128 remainder = scaled - (quotient << shift);
+        unsigned __int128 half = (unsigned __int128)1 << (shift - 1);
+
+        rounded = (uint64_t)quotient;
+        if (remainder > half || (remainder == half && (rounded & 1))) {
+            ++rounded;
+        }
+    }
+
+    // Write the integer part, then the decimals
+    uint64_t integer = rounded / POW10[decimals];
+    uint64_t decimal = rounded % POW10[decimals];
+
+    size_t len;
+    if (integer <= UINT32_MAX) {
+        len = format_u32(integer, out);
+    } else {
+        len = format_u32(integer / 1000000000, out);
+        format_padded(integer % 1000000000, 9, out + len);
+        len += 9;
+    }
+
+    if (decimals > 0) {
+        out[len++] = '.';
+        format_padded(decimal, decimals, out + len);
+        len += decimals;
+    }
+
+    return len;
+}
+
+/**
+ * @brief Writes an address the way inet_ntoa() and "%hu" would.
+ *
+ * @param ip the IP, in network order
+ * @param port the port, in network order
+ * @param out where to write
+ * @return size_t - how many bytes were written
+ */
+static size_t format_address(const uint32_t ip, const uint16_t port,
+        char *out) {
+    const uint8_t *octets = (const uint8_t *)&ip;
+
+    size_t len = 0;
+    for (int i = 0; i < 4; ++i) {
+        len += format_u32(octets[i], out + len);
+        out[len++] = i < 3 ? '.' : ':';
+    }
+
+    len += format_u32(ntohs(port), out + len);
+    return len;
+}
+
+/**
+ * @brief Formats the address again, only if it isn't the cached one.
+ *
+ * @param msg the message carrying the address
+ * @param cache the text of the last address formatted
+ */
+static void cache_address(const server_to_client_msg &msg,
+        address_cache &cache) {
+    if (cache.valid && cache.ip == msg.ip && cache.port == msg.port) {
+        return;
+    }
+
+    cache.valid = true;
+    cache.ip = msg.ip;
+    cache.port = msg.port;
+    cache.len = format_address(msg.ip, msg.port, cache.text);
+    cache.port_pos = (const char *)memchr(cache.text, ':', cache.len) -
+        cache.text + 1;
+}
+
+/**
+ * @brief Appends a string, returning where the next one goes.
+ *
+ * @param out where to write
+ * @param str the string
+ * @param len its length
+ * @return char* - the end of what was written
+ */
+static char *append(char *out, const char *str, const size_t len) {
+    memcpy(out, str, len);
+    return out + len;
+}
+
+size_t format_message(const server_to_client_msg &msg,
+        const size_t content_len, const bool with_address,
+        address_cache &cache, char *out) {
+    char *end = out;
+
+    // Only format the address again when it changes
+    if (with_address) {
+        cache_address(msg, cache);
+
+        end = append(end, cache.text, cache.len);
+        end = append(end, " - ", 3);
+    }
+
+    end = append(end, msg.topic, strnlen(msg.topic, MAX_TOPIC_LEN));
+    end = append(end, " - ", 3);
+
+    // Write the data type and the content, both left empty for an
+    // unknown data type
+    switch (msg.data_type) {
+        case UDP_INT:
+            end = append(end, UDP_INT_STR, sizeof(UDP_INT_STR) - 1);
+            end = append(end, " - ", 3);
+
+            if (msg.content.udp_int.sign != 0) {
+                *end++ = '-';
+            }
+
+            end += format_u32(ntohl(msg.content.udp_int.data), end);
+            break;
+
+        case UDP_SHORT_REAL:
+            end = append(end, UDP_SHORT_REAL_STR,
+                sizeof(UDP_SHORT_REAL_STR) - 1);
+            end = append(end, " - ", 3);
+
+            end += format_fixed(
+                (float)ntohs(msg.content.udp_short_real.data) / 100.0f, 2,
+                end);
+            break;
+
+        case UDP_FLOAT: {
+            end = append(end, UDP_FLOAT_STR, sizeof(UDP_FLOAT_STR) - 1);
+            end = append(end, " - ", 3);
+
+            float num = 1.0f * ntohl(msg.content.udp_float.data) /
+                FLOAT_POWERS.powers[msg.content.udp_float.pow_10];
+
+            if (msg.content.udp_float.sign != 0) {
+                *end++ = '-';
+            }
+
+            end += format_fixed(num, 6, end);
+            break;
+        }
+
+        case UDP_STRING: {
+            end = append(end, UDP_STRING_STR, sizeof(UDP_STRING_STR) - 1);
+            end = append(end, " - ", 3);
+
+            // The string ends at its terminator, or at the frame's end
+            size_t max_len = std::min((size_t)MAX_CONTENT_LEN, content_len);
+            const char *terminator = (const char *)memchr(
+                msg.content.udp_string, '\0', max_len);
+            end = append(end, msg.content.udp_string, terminator ?
+                terminator - msg.content.udp_string : max_len);
+            break;
+        }
+
+        default:
+            end = append(end, " - ", 3);
+            break;
+    }
+
+    *end++ = '\n';
+    return end - out;
+}
+
+/**
+ * @brief Appends a string as a quoted JSON string, escaping the quotes,
+ *   backslashes and control characters.
+ *
+ * @param out where to write
+ * @param str the string
+ * @param len its length
+ * @return char* - the end of what was written
+ */
+static char *append_json_string(char *out, const char *str,
+        const size_t len) {
+    static const char HEX[] = "0123456789abcdef";
+
+    *out++ = '"';
+    for (size_t i = 0; i < len; ++i) {
+        uint8_t c = str[i];
+
+        if (c == '"' || c == '\\') {
+            *out++ = '\\';
+            *out++ = c;
+        } else if (c < 0x20) {
+            out = APPEND_LITERAL(out, "\\u00");
+            *out++ = HEX[c >> 4];
+            *out++ = HEX[c & 0xf];
+        } else {
+            *out++ = c;
+        }
+    }
+
+    *out++ = '"';
+    return out;
+}
+
+size_t format_message_ndjson(const server_to_client_msg &msg,
+        const size_t content_len, const bool with_address,
+        address_cache &cache, char *out) {
+    char *end = APPEND_LITERAL(out, "{");
+
+    // The address is split back into its IP and its port
+    if (with_address) {
+        cache_address(msg, cache);
+
+        end = APPEND_LITERAL(end, "\"ip\":\"");
+        end = append(end, cache.text, cache.port_pos - 1);
+        end = APPEND_LITERAL(end, "\",\"port\":");
+        end = append(end, cache.text + cache.port_pos,
+            cache.len - cache.port_pos);
+        end = APPEND_LITERAL(end, ",");
+    }
+
+    end = APPEND_LITERAL(end, "\"topic\":");
+    end = append_json_string(end, msg.topic, strnlen(msg.topic,
+        MAX_TOPIC_LEN));
+
+    switch (msg.data_type) {
+        case UDP_INT:
+            end = APPEND_LITERAL(end, ",\"type\":\"INT\",\"value\":");
+
+            if (msg.content.udp_int.sign != 0) {
+                *end++ = '-';
+            }
+
+            end += format_u32(ntohl(msg.content.udp_int.data), end);
+            break;
+
+        case UDP_SHORT_REAL:
+            end = APPEND_LITERAL(end, ",\"type\":\"SHORT_REAL\",\"value\":");
+            end += format_fixed(
+                (float)ntohs(msg.content.udp_short_real.data) / 100.0f, 2,
+                end);
+            break;
+
+        case UDP_FLOAT: {
+            end = APPEND_LITERAL(end, ",\"type\":\"FLOAT\",\"value\":");
+
+            float num = 1.0f * ntohl(msg.content.udp_float.data) /
+                FLOAT_POWERS.powers[msg.content.udp_float.pow_10];
+
+            if (msg.content.udp_float.sign != 0) {
+                *end++ = '-';
+            }
+
+            end += format_fixed(num, 6, end);
+            break;
+        }
+
+        case UDP_STRING: {
+            end = APPEND_LITERAL(end, ",\"type\":\"STRING\",\"value\":");
+
+            size_t max_len = std::min((size_t)MAX_CONTENT_LEN, content_len);
+            const char *terminator = (const char *)memchr(
+                msg.content.udp_string, '\0', max_len);
+            end = append_json_string(end, msg.content.udp_string,
+                terminator ? terminator - msg.content.udp_string : max_len);
+            break;
+        }
+
+        default:
+            end = APPEND_LITERAL(end, ",\"type\":null,\"value\":null");
+            break;
+    }
+
+    end = APPEND_LITERAL(end, "}\n");
+    return end - out;
+}
+
+size_t format_message_binary(const server_to_client_msg &msg,
+        const size_t content_len, char *out) {
+    // The length is set again, in case the message was rebuilt
+    size_t len = UDP_HDR_LEN + content_len;
+    memcpy(out, &msg, len);
+
+    uint16_t wire_len = htons(len);
+    memcpy(out, &wire_len, sizeof(wire_len));
+
+    return len;
+}
+
+OutputBuffer::OutputBuffer(const int fd)
+        : fd(fd), buffer(new char[OUTPUT_BUFFER_LEN]), used(0) {}
+
+OutputBuffer::~OutputBuffer() {
+    flush();
+    delete[] buffer;
+}
+
+char *OutputBuffer::reserve(const size_t len) {
+    if (used + len > OUTPUT_BUFFER_LEN && flush() < 0) {
+        return NULL;
+    }
+
+    return buffer + used;
+}
+
+void OutputBuffer::commit(const size_t len) {
+    used += len;
+}
+
+int OutputBuffer::flush() {
+    size_t written = 0;
+    while (written < used) {
+        ssize_t n = write(fd, buffer + written, used - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            // A non-blocking descriptor which is full is waited on, rather
+            // than losing what's left
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                pollfd writable = {fd, POLLOUT, 0};
+                if (poll(&writable, 1, -1) >= 0 || errno == EINTR) {
+                    continue;
+                }
+            }
+
+            used = 0;
+            return -1;
+        }
+
+        written += n;
+    }
+
+    used = 0;
+    return 0;
+}
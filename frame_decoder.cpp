@@ -0,0 +1,123 @@
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "include/frame_decoder.h"
+#include "include/protocol_v2.h"
+
+FrameDecoder::FrameDecoder(const size_t capacity, const size_t max_frame)
+        : buffer(new char[capacity]), capacity(capacity),
+          max_frame(max_frame), varint_lengths(false), start(0),
+          end(0) {}
+
+FrameDecoder::~FrameDecoder() {
+    delete[] buffer;
+}
+
+void FrameDecoder::make_room() {
+    // Start over if everything was read
+    if (start == end) {
+        start = end = 0;
+        return;
+    }
+
+    // Move the unread bytes to the front if a frame may not fit anymore
+    if (capacity - end < max_frame + VARINT_MAX_LEN) {
+        memmove(buffer, buffer + start, end - start);
+        end -= start;
+        start = 0;
+    }
+}
+
+size_t FrameDecoder::feed(const char *data, const size_t len) {
+    make_room();
+
+    size_t n = std::min(len, capacity - end);
+    memcpy(buffer + end, data, n);
+    end += n;
+
+    return n;
+}
+
+ssize_t FrameDecoder::recv_from(const int fd) {
+    make_room();
+
+    // Don't mistake a full buffer for the end of the stream
+    if (end == capacity) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    ssize_t n = recv(fd, buffer + end, capacity - end, 0);
+    if (n > 0) {
+        end += n;
+    }
+
+    return n;
+}
+
+int FrameDecoder::next(frame_view &frame) {
+    if (varint_lengths) {
+        return next_varint(frame);
+    }
+
+    // Check if the length was received
+    if (end - start < 2) {
+        return 0;
+    }
+
+    // Read the length, which also counts itself
+    uint16_t len;
+    memcpy(&len, buffer + start, 2);
+    len = ntohs(len);
+
+    if (len < 2 || len > max_frame) {
+        return -1;
+    }
+
+    // Check if the whole frame was received
+    if (end - start < len) {
+        return 0;
+    }
+
+    frame.data = buffer + start;
+    frame.len = len;
+    start += len;
+
+    return 1;
+}
+
+int FrameDecoder::next_varint(frame_view &frame) {
+    // Read the length, which only counts the body
+    uint32_t len;
+    int prefix = get_varint(buffer + start, end - start, len);
+    if (prefix <= 0) {
+        return prefix;
+    }
+
+    if (len == 0 || len > max_frame) {
+        return -1;
+    }
+
+    // Check if the whole frame was received
+    if (end - start < prefix + len) {
+        return 0;
+    }
+
+    frame.data = buffer + start + prefix;
+    frame.len = len;
+    start += prefix + len;
+
+    return 1;
+}
+
+void FrameDecoder::use_varint_lengths(const size_t max_body) {
+    varint_lengths = true;
+    max_frame = max_body;
+}
+
+size_t FrameDecoder::buffered() const {
+    return end - start;
+}
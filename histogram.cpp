@@ -0,0 +1,81 @@
+#include <cstring>
+#include "include/histogram.h"
+
+#define HISTOGRAM_SUB_COUNT (1ULL << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_VALUE ((1ULL << HISTOGRAM_MAX_BITS) - 1)
+
+size_t histogram_bucket(uint64_t value) {
+    if (value > HISTOGRAM_MAX_VALUE) {
+        value = HISTOGRAM_MAX_VALUE;
+    }
+
+    if (value < HISTOGRAM_SUB_COUNT) {
+        return value;
+    }
+
+    // Keep the HISTOGRAM_SUB_BITS + 1 most significant bits, the highest of
+    // which is always set, along with how far they were shifted
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return ((size_t)shift << HISTOGRAM_SUB_BITS) + (value >> shift);
+}
+
+uint64_t histogram_value(const size_t bucket) {
+    if (bucket < 2 * HISTOGRAM_SUB_COUNT) {
+        return bucket;
+    }
+
+    int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t top = bucket - ((size_t)shift << HISTOGRAM_SUB_BITS);
+    return (top << shift) + (1ULL << (shift - 1));
+}
+
+Histogram::Histogram()
+        : counts(new uint64_t[HISTOGRAM_BUCKETS]), total(0),
+          min_value(UINT64_MAX), max_value(0), sum(0) {
+    memset(counts, 0, HISTOGRAM_BUCKETS * sizeof(uint64_t));
+}
+
+Histogram::~Histogram() {
+    delete[] counts;
+}
+
+void Histogram::merge(const Histogram &other) {
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        counts[i] += other.counts[i];
+    }
+
+    total += other.total;
+    sum += other.sum;
+
+    if (other.min_value < min_value) {
+        min_value = other.min_value;
+    }
+
+    if (other.max_value > max_value) {
+        max_value = other.max_value;
+    }
+}
+
+uint64_t Histogram::percentile(const double percentile) const {
+    if (total == 0) {
+        return 0;
+    }
+
+    // The rank of the value, counting from 1
+    uint64_t rank = (uint64_t)(percentile / 100.0 * total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += counts[i];
+        if (seen >= rank) {
+            // Never report more than was actually counted
+            uint64_t value = histogram_value(i);
+            return value > max_value ? max_value : value;
+        }
+    }
+
+    return max_value;
+}
@@ -1,7 +1,7 @@
 #ifndef __DEFINES_H_
 #define __DEFINES_H_
 
-#define MAX_PENDING_CLIENTS 5
+#define MAX_PENDING_CLIENTS 4096
 #define MAX_IP_LEN 15
 #define MAX_ID_LEN 10
 #define MAX_COMM_LEN 11
@@ -9,6 +9,32 @@
 #define MAX_CONTENT_LEN 1500
 #define UDP_HDR_LEN (MAX_TOPIC_LEN + 9) 
 #define BUFLEN 1600
+#define DEFAULT_UDP_BATCH 32
+#define MAX_UDP_BATCH 1024
+#define DEFAULT_HIGH_WATER (8 * 1024 * 1024)
+#define MAX_IOVECS 64
+#define SERVER_DECODER_CAPACITY 512
+#define CLIENT_DECODER_CAPACITY (128 * 1024)
+#define PIPELINE_RING_LEN 4096
+#define MAX_SHARDS 64
+#define SHARD_INBOX_CAPACITY 4096
+#define UDP_CONTROL_LEN CMSG_SPACE(sizeof(uint32_t))
+#define DEFAULT_LOG_BYTES (1024UL * 1024 * 1024)
+#define SF_STATE_INTERVAL_MS 1000
+#define REPLAY_BUDGET (256 * 1024)
+#define DEFAULT_SF_CLIENT_BYTES (64UL * 1024 * 1024)
+#define DEFAULT_SF_GLOBAL_BYTES (1024UL * 1024 * 1024)
+#define DEFAULT_BATCH_BYTES (16 * 1024)
+#define DEFAULT_BATCH_DELAY_US 500
+#define MAX_BATCH_LEN (32 * 1024)
+#define DEFAULT_BENCH_PUBLISHERS 2
+#define DEFAULT_BENCH_SUBSCRIBERS 4
+#define DEFAULT_BENCH_RATE 100000
+#define DEFAULT_BENCH_SECONDS 5
+#define DEFAULT_BENCH_TOPICS 16
+#define DEFAULT_BENCH_STRING_LEN 64
+#define MAX_BENCH_THREADS 1024
+#define BENCH_SEND_BATCH 32
 
 #define UDP_INT 0
 #define UDP_SHORT_REAL 1
@@ -16,15 +42,49 @@
 #define UDP_STRING 3
 
 const char EXIT_CMD[5] = "exit";
+const char STATS_CMD[6] = "stats";
+const char TRACE_CMD[6] = "trace";
 const char SUB_CMD[10] = "subscribe";
 const char SH_SUB_CMD[10] = "s";
 const char UNSUB_CMD[12] = "unsubscribe";
 const char SH_UNSUB_CMD[12] = "u";
 const char WHITESPACE[] = " \n\t";
 
+const char SLOW_DROP_STR[] = "drop";
+const char SLOW_DISCONNECT_STR[] = "disconnect";
+
+const char SF_DROP_OLDEST_STR[] = "drop-oldest";
+const char SF_DROP_NEWEST_STR[] = "drop-newest";
+const char SF_CONFLATE_STR[] = "conflate";
+const char SF_DISCONNECT_STR[] = "disconnect";
+
+const char SERVER_USAGE[] = "Usage: %s <SERVER_PORT> [-b <UDP_BATCH>] "
+    "[-w <HIGH_WATER_BYTES>] [-s drop|disconnect] [-t <THREADS>] [-r]\n"
+    "    [-c <CACHED_TOPICS>] [-B <BATCH_BYTES>] [-D <BATCH_DELAY_US>]\n"
+    "    [-d <LOG_DIR> [-L <LOG_BYTES>] [-A <LOG_AGE_SECONDS>]]\n"
+    "    [-q <CLIENT_SF_BYTES>] [-g <GLOBAL_SF_BYTES>]\n"
+    "    [-p drop-oldest|drop-newest|conflate|disconnect] "
+    "[-m <METRICS_PORT>]\n";
+
+const char SUBSCRIBER_USAGE[] = "Usage: %s <ID_CLIENT> <SERVER_IP> "
+    "<SERVER_PORT> [-v 1|2] [-n] [-b] [-z]\n"
+    "    [-o text|binary|ndjson] [-p]\n";
+
+const char BENCH_USAGE[] = "Usage: %s <SERVER_IP> <SERVER_PORT> "
+    "[-p <PUBLISHERS>] [-s <SUBSCRIBERS>]\n"
+    "    [-r <MESSAGES_PER_SECOND>] [-d <SECONDS>] [-m <TYPE>[:<WEIGHT>],...]\n"
+    "    [-l <STRING_LEN>] [-T <TOPICS>] [-v 1|2] [-n] [-b] [-z]\n";
+
+const char MICROBENCH_USAGE[] = "Usage: %s [-f <NAME_FILTER>] "
+    "[-m <MIN_MS_PER_BENCHMARK>]\n";
+
 const char UDP_INT_STR[] = "INT";
 const char UDP_SHORT_REAL_STR[] = "SHORT_REAL";
 const char UDP_FLOAT_STR[] = "FLOAT";
 const char UDP_STRING_STR[] = "STRING";
 
+const char OUTPUT_TEXT_STR[] = "text";
+const char OUTPUT_BINARY_STR[] = "binary";
+const char OUTPUT_NDJSON_STR[] = "ndjson";
+
 #endif
@@ -0,0 +1,101 @@
+#ifndef __EVENT_LOOP_H_
+#define __EVENT_LOOP_H_
+
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+
+// Use epoll on Linux, unless the poll() backend is explicitly requested
+#if defined(__linux__) && !defined(USE_POLL)
+#define EVENT_LOOP_EPOLL
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#define MAX_READY_EVENTS 256
+
+// Interest / readiness flags
+#define EV_READ 0x1
+#define EV_WRITE 0x2
+#define EV_EDGE 0x4
+#define EV_ERROR 0x8
+
+/**
+ * @brief A descriptor reported as ready by the event loop.
+ *
+ */
+struct io_event {
+    int fd;
+    uint32_t events;
+};
+
+/**
+ * @brief Readiness notification engine. Descriptors are registered together
+ *   with the events of interest (EV_READ, EV_WRITE, optionally EV_EDGE), and
+ *   wait() only reports the descriptors that are actually ready.
+ *
+ *   The epoll backend honours EV_EDGE; the poll() backend is always level
+ *   triggered, which is still correct for handlers that drain descriptors
+ *   until EAGAIN.
+ *
+ */
+class EventLoop {
+#ifdef EVENT_LOOP_EPOLL
+    int epoll_fd;
+    std::vector<epoll_event> epoll_events;
+#else
+    std::vector<pollfd> poll_fds;
+    std::unordered_map<int, size_t> fd_to_index;
+#endif
+
+public:
+    EventLoop();
+    ~EventLoop();
+
+    /**
+     * @brief Creates the underlying notification mechanism.
+     *
+     * @return int - the error code
+     */
+    int init();
+
+    /**
+     * @brief Starts watching the given descriptor.
+     *
+     * @param fd the descriptor to watch
+     * @param events the events of interest
+     * @return int - the error code
+     */
+    int add(const int fd, const uint32_t events);
+
+    /**
+     * @brief Changes the events of interest for a watched descriptor.
+     *
+     * @param fd the watched descriptor
+     * @param events the new events of interest
+     * @return int - the error code
+     */
+    int modify(const int fd, const uint32_t events);
+
+    /**
+     * @brief Stops watching the given descriptor. Must be called before
+     *   the descriptor is closed.
+     *
+     * @param fd the descriptor to forget
+     * @return int - the error code
+     */
+    int remove(const int fd);
+
+    /**
+     * @brief Blocks until at least one descriptor is ready, or until the
+     *   timeout expires.
+     *
+     * @param ready filled with the ready descriptors
+     * @param timeout_ms the timeout in milliseconds, -1 to wait forever
+     * @return int - the number of ready descriptors, or -1 on error
+     */
+    int wait(std::vector<io_event> &ready, const int timeout_ms);
+};
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef __FORMAT_H_
+#define __FORMAT_H_
+
+#include <cstdint>
+#include <cstddef>
+#include "utils.h"
+
+// The longest line a message may be printed as, address, separators and all
+#define FORMAT_MAX_LINE (MAX_IP_LEN + 6 + MAX_TOPIC_LEN + 10 + \
+    MAX_CONTENT_LEN + 16)
+// The longest NDJSON line, where every byte of the topic and of the content
+// may need escaping
+#define NDJSON_MAX_LINE (MAX_IP_LEN + 6 * MAX_TOPIC_LEN + \
+    6 * MAX_CONTENT_LEN + 96)
+#define OUTPUT_BUFFER_LEN (64 * 1024)
+
+/**
+ * @brief How the subscriber prints messages: as text lines, as the legacy
+ *   frames themselves, or as one JSON object per line.
+ *
+ */
+enum output_mode {
+    OUTPUT_TEXT,
+    OUTPUT_BINARY,
+    OUTPUT_NDJSON
+};
+
+/**
+ * @brief The textual form of the last publisher address printed, kept
+ *   since consecutive messages usually come from the same publisher.
+ *
+ */
+struct address_cache {
+    bool valid;
+    uint32_t ip;
+    uint16_t port;
+    char text[MAX_IP_LEN + 7];
+    size_t len;
+
+    // Where the port starts in the text, after the ':'
+    size_t port_pos;
+};
+
+/**
+ * @brief Writes an unsigned integer in decimal, as "%u" would.
+ *
+ * @param value the integer
+ * @param out where to write, at least 10 bytes long
+ * @return size_t - how many bytes were written
+ */
+size_t format_u32(uint32_t value, char *out);
+
+/**
+ * @brief Writes a non-negative float with a fixed number of decimals, as
+ *   "%.*f" would: the exact value of the float, rounded half to even.
+ *
+ * @param value the float
+ * @param decimals the number of decimals, at most 9
+ * @param out where to write, at least 32 bytes long
+ * @return size_t - how many bytes were written
+ */
+size_t format_fixed(const float value, const int decimals, char *out);
+
+/**
+ * @brief Writes a message the way the subscriber prints it, byte for byte
+ *   the same as printing it with printf().
+ *
+ * @param msg the message
+ * @param content_len how many bytes of content the message has
+ * @param with_address whether to print the publisher address
+ * @param cache the text of the last address printed
+ * @param out where to write, at least FORMAT_MAX_LINE bytes long
+ * @return size_t - how many bytes were written
+ */
+size_t format_message(const server_to_client_msg &msg,
+    const size_t content_len, const bool with_address, address_cache &cache,
+    char *out);
+
+/**
+ * @brief Writes a message as a JSON object on its own line, with its value
+ *   as a number, or as a string for STRING messages, and null for the type
+ *   and value of an unknown data type. Bytes which aren't ASCII are copied
+ *   as they are.
+ *
+ * @param msg the message
+ * @param content_len how many bytes of content the message has
+ * @param with_address whether to include the publisher address
+ * @param cache the text of the last address written
+ * @param out where to write, at least NDJSON_MAX_LINE bytes long
+ * @return size_t - how many bytes were written
+ */
+size_t format_message_ndjson(const server_to_client_msg &msg,
+    const size_t content_len, const bool with_address, address_cache &cache,
+    char *out);
+
+/**
+ * @brief Writes a message as a legacy frame: the 2-byte length, counting
+ *   itself, followed by the rest of server_to_client_msg, up to the end of
+ *   its content.
+ *
+ * @param msg the message
+ * @param content_len how many bytes of content the message has
+ * @param out where to write, at least sizeof(server_to_client_msg) long
+ * @return size_t - how many bytes were written
+ */
+size_t format_message_binary(const server_to_client_msg &msg,
+    const size_t content_len, char *out);
+
+/**
+ * @brief Buffer of lines waiting to be written to a descriptor, written
+ *   at once when it's full or when it's flushed.
+ *
+ */
+class OutputBuffer {
+    int fd;
+    char *buffer;
+    size_t used;
+
+public:
+    explicit OutputBuffer(const int fd);
+    ~OutputBuffer();
+
+    OutputBuffer(const OutputBuffer &) = delete;
+    OutputBuffer &operator=(const OutputBuffer &) = delete;
+
+    /**
+     * @brief Makes room for a number of bytes, flushing if needed.
+     *
+     * @param len the number of bytes, at most OUTPUT_BUFFER_LEN
+     * @return char* - where to write them, or NULL if the flush failed
+     */
+    char *reserve(const size_t len);
+
+    /**
+     * @brief Keeps the bytes written where reserve() pointed.
+     *
+     * @param len how many bytes were written
+     */
+    void commit(const size_t len);
+
+    /**
+     * @brief Writes everything buffered, waiting for the descriptor to
+     *   become writable if it's non-blocking and full. The bytes which
+     *   couldn't be written are dropped on errors.
+     *
+     * @return int - the error code
+     */
+    int flush();
+};
+
+#endif
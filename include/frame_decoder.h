@@ -0,0 +1,111 @@
+#ifndef __FRAME_DECODER_H_
+#define __FRAME_DECODER_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <sys/types.h>
+
+/**
+ * @brief A complete frame, pointing into the decoder's buffer. It stays
+ *   valid until more bytes are given to the decoder.
+ *
+ */
+struct frame_view {
+    const char *data;
+    uint16_t len;
+};
+
+/**
+ * @brief Per-connection streaming decoder of length-prefixed frames. Bytes
+ *   can be given to it in chunks of any size, and complete frames are
+ *   yielded as views into its buffer, without being copied. The unread bytes
+ *   are moved back to the front of the buffer only when its tail is too
+ *   short for a whole frame, so a frame is always contiguous. Frames start
+ *   with a 2-byte length which counts itself, or, once switched to the
+ *   compact protocol, with a varint length which only counts the body.
+ *
+ */
+class FrameDecoder {
+    char *buffer;
+    size_t capacity;
+    size_t max_frame;
+    bool varint_lengths;
+
+    // The unread bytes are [start, end)
+    size_t start;
+    size_t end;
+
+    /**
+     * @brief Makes sure at least a whole frame fits after the unread bytes.
+     *
+     */
+    void make_room();
+
+    /**
+     * @brief Yields the next complete frame, prefixed by a varint length.
+     *
+     * @param frame the frame's body
+     * @return int - 1 if a frame was yielded, 0 if more bytes are needed,
+     *   -1 if the stream is malformed
+     */
+    int next_varint(frame_view &frame);
+
+public:
+    /**
+     * @brief Creates a decoder.
+     *
+     * @param capacity the size of the buffer, at least twice max_frame
+     * @param max_frame the length of the longest accepted frame
+     */
+    FrameDecoder(const size_t capacity, const size_t max_frame);
+    ~FrameDecoder();
+
+    FrameDecoder(const FrameDecoder &) = delete;
+    FrameDecoder &operator=(const FrameDecoder &) = delete;
+
+    /**
+     * @brief Copies a chunk of the stream into the decoder.
+     *
+     * @param data the chunk
+     * @param len the length of the chunk
+     * @return size_t - how many bytes were taken, less than len when the
+     *   buffer is full and frames must be read first
+     */
+    size_t feed(const char *data, const size_t len);
+
+    /**
+     * @brief Receives the next chunk of the stream straight from a socket,
+     *   with a single recv() call.
+     *
+     * @param fd the socket
+     * @return ssize_t - the result of recv()
+     */
+    ssize_t recv_from(const int fd);
+
+    /**
+     * @brief Yields the next complete frame.
+     *
+     * @param frame the frame
+     * @return int - 1 if a frame was yielded, 0 if more bytes are needed,
+     *   -1 if the stream is malformed
+     */
+    int next(frame_view &frame);
+
+    /**
+     * @brief Switches to varint length prefixes, from the next frame on.
+     *   The yielded frames are then the bodies, without their prefix.
+     *
+     * @param max_body the length of the longest accepted body, at most
+     *   half the buffer's size
+     */
+    void use_varint_lengths(const size_t max_body);
+
+    /**
+     * @brief Returns how many bytes are waiting to be decoded.
+     *
+     * @return size_t - the number of bytes
+     */
+    size_t buffered() const;
+};
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef __HISTOGRAM_H_
+#define __HISTOGRAM_H_
+
+#include <cstdint>
+#include <cstddef>
+
+// Values below 2^HISTOGRAM_SUB_BITS get a bucket each, larger ones share
+// buckets of the same relative width (under 1%), up to 2^HISTOGRAM_MAX_BITS
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS \
+    ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+/**
+ * @brief Returns the bucket a value is counted in.
+ *
+ * @param value the value, clamped to the largest value kept
+ * @return size_t - the bucket
+ */
+size_t histogram_bucket(uint64_t value);
+
+/**
+ * @brief Returns the value a bucket stands for, the middle of the values
+ *   it counts.
+ *
+ * @param bucket the bucket
+ * @return uint64_t - the value
+ */
+uint64_t histogram_value(const size_t bucket);
+
+/**
+ * @brief Log-linear histogram of values, in the style of HdrHistogram: the
+ *   buckets of each power of two are split in equal parts, so percentiles
+ *   are kept with the same relative precision whatever their magnitude.
+ *   Recording a value is a couple of shifts and an increment.
+ *
+ */
+class Histogram {
+    uint64_t *counts;
+    uint64_t total;
+    uint64_t min_value;
+    uint64_t max_value;
+    uint64_t sum;
+
+public:
+    Histogram();
+    ~Histogram();
+
+    Histogram(const Histogram &) = delete;
+    Histogram &operator=(const Histogram &) = delete;
+
+    /**
+     * @brief Counts a value.
+     *
+     * @param value the value
+     */
+    void record(const uint64_t value) {
+        ++counts[histogram_bucket(value)];
+        ++total;
+        sum += value;
+
+        if (value < min_value) {
+            min_value = value;
+        }
+
+        if (value > max_value) {
+            max_value = value;
+        }
+    }
+
+    /**
+     * @brief Adds the values counted by another histogram.
+     *
+     * @param other the other histogram
+     */
+    void merge(const Histogram &other);
+
+    /**
+     * @brief Returns the value below which a share of the values fall.
+     *
+     * @param percentile the share, from 0 to 100
+     * @return uint64_t - the value, 0 if nothing was counted
+     */
+    uint64_t percentile(const double percentile) const;
+
+    uint64_t count() const {
+        return total;
+    }
+
+    uint64_t min() const {
+        return total == 0 ? 0 : min_value;
+    }
+
+    uint64_t max() const {
+        return max_value;
+    }
+
+    double mean() const {
+        return total == 0 ? 0.0 : (double)sum / total;
+    }
+};
+
+#endif
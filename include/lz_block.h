@@ -0,0 +1,51 @@
+#ifndef __LZ_BLOCK_H_
+#define __LZ_BLOCK_H_
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Small LZ77 block compressor, laid out like an LZ4 block: a sequence of
+ * (token, literal length bytes, literals, 2-byte offset, match length bytes)
+ * where the token holds 4 bits of literal length and 4 bits of match length,
+ * and longer lengths continue in bytes of 255. The last sequence only holds
+ * literals. Matches are found through a single hash table of 4-byte prefixes,
+ * which trades ratio for speed, as batches are compressed on the send path.
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+/**
+ * @brief Returns how large a compressed block may get.
+ *
+ * @param len the length of the data
+ * @return size_t - the largest length of the compressed block
+ */
+size_t lz_compress_bound(const size_t len);
+
+/**
+ * @brief Compresses a block.
+ *
+ * @param src the data
+ * @param len the length of the data
+ * @param dst where to write the block, at least lz_compress_bound(len) bytes
+ * @return size_t - the length of the block
+ */
+size_t lz_compress(const char *src, const size_t len, char *dst);
+
+/**
+ * @brief Decompresses a block, never reading or writing out of bounds,
+ *   whatever the block holds.
+ *
+ * @param src the block
+ * @param len the length of the block
+ * @param dst where to write the data
+ * @param capacity how many bytes dst holds
+ * @return int - the length of the data, or -1 if the block is malformed
+ */
+int lz_decompress(const char *src, const size_t len, char *dst,
+    const size_t capacity);
+
+#endif
@@ -0,0 +1,223 @@
+#ifndef __MESSAGE_LOG_H_
+#define __MESSAGE_LOG_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <deque>
+
+// Each segment file is preallocated to its full size and mapped at once
+#define LOG_SEGMENT_SIZE (64 * 1024 * 1024)
+#define LOG_RECORD_ALIGN 8
+#define LOG_SEGMENT_SUFFIX ".log"
+
+/**
+ * @brief Header of a record in a segment file, followed by the record's
+ *   data, and padded up to LOG_RECORD_ALIGN bytes. A header whose length
+ *   is 0 marks the end of the segment.
+ *
+ */
+struct log_record_header {
+    uint64_t seq;
+    int64_t time_ms;
+    uint32_t len;
+    uint32_t checksum;
+};
+
+/**
+ * @brief A record read from the log, pointing into the segment's mapping.
+ *   It stays valid until the segment is removed by retention.
+ *
+ */
+struct log_entry {
+    uint64_t seq;
+    int64_t time_ms;
+    const char *data;
+    uint32_t len;
+};
+
+/**
+ * @brief Where a reader of the log is: the sequence number of the next
+ *   record to read, and, once known, where that record is.
+ *
+ */
+struct log_position {
+    uint64_t seq;
+    uint64_t segment_seq;
+    size_t offset;
+};
+
+/**
+ * @brief Counters of a message log.
+ *
+ */
+struct log_counters {
+    uint64_t appended;
+    uint64_t appended_bytes;
+    uint64_t segments_removed;
+    uint64_t recovered;
+};
+
+/**
+ * @brief A segment file of the log.
+ *
+ */
+struct log_segment {
+    uint64_t first_seq;
+    uint64_t last_seq;
+    int64_t last_time_ms;
+    int fd;
+    char *map;
+    size_t size;
+    std::string path;
+};
+
+/**
+ * @brief Append-only log of messages on disk, split into segment files
+ *   named after the sequence number of their first record. Records are
+ *   appended with pwrite() and read through a shared read-only mapping of
+ *   each segment, so reading never copies. Whole segments are removed once
+ *   they are older or larger than the retention limits. An existing log is
+ *   recovered when it's opened, dropping a torn record at its end.
+ *
+ */
+class MessageLog {
+    std::string dir;
+    size_t retention_bytes;
+    int64_t retention_ms;
+
+    std::deque<log_segment> segments;
+    uint64_t next_seq;
+    size_t total_bytes;
+    log_counters stats;
+
+    /**
+     * @brief Opens (creating it if needed) and maps a segment file.
+     *
+     * @param first_seq the sequence number of its first record
+     * @param segment the opened segment
+     * @return int - the error code
+     */
+    int open_segment(const uint64_t first_seq, log_segment &segment);
+
+    /**
+     * @brief Finds where the valid records of a recovered segment end.
+     *
+     * @param segment the segment
+     * @return int - how many records are valid
+     */
+    int recover_segment(log_segment &segment);
+
+    /**
+     * @brief Starts a new segment, at the next sequence number.
+     *
+     * @return int - the error code
+     */
+    int roll();
+
+    /**
+     * @brief Unmaps, closes and deletes the oldest segment.
+     *
+     */
+    void remove_oldest();
+
+    /**
+     * @brief Finds the segment holding a sequence number.
+     *
+     * @param seq the sequence number
+     * @return log_segment* - the segment, or NULL if it was removed
+     */
+    log_segment *find_segment(const uint64_t seq);
+
+public:
+    MessageLog();
+    ~MessageLog();
+
+    MessageLog(const MessageLog &) = delete;
+    MessageLog &operator=(const MessageLog &) = delete;
+
+    /**
+     * @brief Opens the log in a directory, recovering the segments already
+     *   in it.
+     *
+     * @param path the directory, created if it's missing
+     * @param max_bytes how many bytes the segments may hold in total
+     * @param max_age_ms how old the segments may be, 0 for no limit
+     * @return int - the error code
+     */
+    int open(const std::string &path, const size_t max_bytes,
+        const int64_t max_age_ms);
+
+    /**
+     * @brief Appends a record.
+     *
+     * @param data the record's data
+     * @param len the length of the data
+     * @param seq the record's sequence number
+     * @return int - the error code
+     */
+    int append(const char *data, const uint32_t len, uint64_t &seq);
+
+    /**
+     * @brief Points a position at a sequence number, or at the oldest
+     *   record if it was already removed.
+     *
+     * @param pos the position
+     * @param seq the sequence number
+     */
+    void seek(log_position &pos, const uint64_t seq) const;
+
+    /**
+     * @brief Reads the record at a position, then moves past it.
+     *
+     * @param pos the position
+     * @param entry the record
+     * @return int - 1 if a record was read, 0 at the end of the log
+     */
+    int next(log_position &pos, log_entry &entry);
+
+    /**
+     * @brief Removes the old segments which exceed the retention limits,
+     *   or which only hold records before a sequence number.
+     *
+     * @param needed_seq the oldest sequence number still needed
+     */
+    void trim(const uint64_t needed_seq);
+
+    /**
+     * @brief Returns the sequence number of the oldest record kept.
+     *
+     * @return uint64_t - the sequence number
+     */
+    uint64_t first_seq() const;
+
+    /**
+     * @brief Returns the sequence number the next record will get.
+     *
+     * @return uint64_t - the sequence number
+     */
+    uint64_t end_seq() const;
+
+    /**
+     * @brief Returns how many bytes of records the log keeps.
+     *
+     * @return size_t - the number of bytes
+     */
+    size_t bytes() const;
+
+    /**
+     * @brief Returns how many segments the log has.
+     *
+     * @return size_t - the number of segments
+     */
+    size_t segment_count() const;
+
+    /**
+     * @brief Returns the log's counters.
+     *
+     * @return const log_counters& - the counters
+     */
+    const log_counters &counters() const;
+};
+
+#endif
@@ -0,0 +1,247 @@
+#ifndef __METRICS_H_
+#define __METRICS_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <thread>
+#include "histogram.h"
+
+/**
+ * @brief A metric written by a single thread and read by any. Updates are
+ *   a relaxed load and store, which compile to plain moves, so they cost as
+ *   much as updating an ordinary variable, while a reader never sees a torn
+ *   value.
+ *
+ * @tparam T the type of the value
+ */
+template <typename T>
+class Metric {
+    std::atomic<T> current;
+
+public:
+    Metric() : current(0) {}
+
+    Metric(const Metric &) = delete;
+    Metric &operator=(const Metric &) = delete;
+
+    T value() const {
+        return current.load(std::memory_order_relaxed);
+    }
+
+    operator T() const {
+        return value();
+    }
+
+    Metric &operator=(const T value) {
+        current.store(value, std::memory_order_relaxed);
+        return *this;
+    }
+
+    Metric &operator+=(const T delta) {
+        return *this = value() + delta;
+    }
+
+    Metric &operator-=(const T delta) {
+        return *this = value() - delta;
+    }
+
+    Metric &operator++() {
+        return *this += 1;
+    }
+
+    Metric &operator--() {
+        return *this -= 1;
+    }
+
+    void operator++(int) {
+        *this += 1;
+    }
+
+    void operator--(int) {
+        *this -= 1;
+    }
+};
+
+// Counters only go up, gauges go either way
+typedef Metric<uint64_t> Counter;
+typedef Metric<int64_t> Gauge;
+
+/**
+ * @brief Histogram written by a single thread and read by any, with the
+ *   buckets of Histogram (histogram.h). Recording a value is a couple of
+ *   shifts and three relaxed increments.
+ *
+ */
+class MetricHistogram {
+    std::atomic<uint64_t> *counts;
+    Counter total;
+    Counter sum;
+
+public:
+    MetricHistogram();
+    ~MetricHistogram();
+
+    MetricHistogram(const MetricHistogram &) = delete;
+    MetricHistogram &operator=(const MetricHistogram &) = delete;
+
+    /**
+     * @brief Counts a value.
+     *
+     * @param value the value
+     */
+    void record(const uint64_t value) {
+        std::atomic<uint64_t> &bucket = counts[histogram_bucket(value)];
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+        ++total;
+        sum += value;
+    }
+
+    /**
+     * @brief Returns how many values fall in a bucket.
+     *
+     * @param bucket the bucket
+     * @return uint64_t - the count
+     */
+    uint64_t bucket_count(const size_t bucket) const {
+        return counts[bucket].load(std::memory_order_relaxed);
+    }
+
+    uint64_t count() const {
+        return total;
+    }
+
+    uint64_t values_sum() const {
+        return sum;
+    }
+};
+
+enum metric_type {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM
+};
+
+/**
+ * @brief A metric of a family, told apart from the others by its labels.
+ *
+ */
+struct metric_series {
+    // The labels, as Prometheus writes them, e.g. shard="0"
+    std::string labels;
+    const void *metric;
+};
+
+/**
+ * @brief Metrics sharing a name, a help text and a type.
+ *
+ */
+struct metric_family {
+    std::string name;
+    std::string help;
+    metric_type type;
+
+    // What histogram values are multiplied by when exposed, e.g. 1e-9 to
+    // expose nanoseconds as seconds
+    double scale;
+
+    std::vector<metric_series> series;
+};
+
+/**
+ * @brief Registry of the metrics, which renders them in the Prometheus text
+ *   format. The metrics are added before the threads updating them start,
+ *   and are only read afterwards, so rendering takes no lock.
+ *
+ */
+class MetricsRegistry {
+    std::vector<metric_family> families;
+
+    /**
+     * @brief Adds a metric to its family, creating the family if needed.
+     *
+     * @param name the family's name
+     * @param help what the family measures
+     * @param type the family's type
+     * @param scale what histogram values are multiplied by when exposed
+     * @param labels the metric's labels
+     * @param metric the metric
+     */
+    void add(const char *name, const char *help, const metric_type type,
+        const double scale, const std::string &labels, const void *metric);
+
+public:
+    void add_counter(const char *name, const char *help,
+            const std::string &labels, const Counter &counter) {
+        add(name, help, METRIC_COUNTER, 1, labels, &counter);
+    }
+
+    void add_gauge(const char *name, const char *help,
+            const std::string &labels, const Gauge &gauge) {
+        add(name, help, METRIC_GAUGE, 1, labels, &gauge);
+    }
+
+    void add_histogram(const char *name, const char *help,
+            const std::string &labels, const MetricHistogram &histogram,
+            const double scale) {
+        add(name, help, METRIC_HISTOGRAM, scale, labels, &histogram);
+    }
+
+    /**
+     * @brief Renders every metric in the Prometheus text format.
+     *
+     * @param out where to append the text
+     */
+    void render(std::string &out) const;
+};
+
+/**
+ * @brief Serves a registry's metrics over HTTP, on its own thread, so that
+ *   a scrape never holds up the threads updating them.
+ *
+ */
+class MetricsServer {
+    const MetricsRegistry &registry;
+    int listen_fd;
+    int stop_fd;
+    std::thread thread;
+
+    /**
+     * @brief Answers the connections until the server is stopped.
+     *
+     */
+    void run();
+
+    /**
+     * @brief Reads a request from a connection and answers it.
+     *
+     * @param fd the connection
+     */
+    void answer(const int fd);
+
+public:
+    explicit MetricsServer(const MetricsRegistry &registry);
+    ~MetricsServer();
+
+    MetricsServer(const MetricsServer &) = delete;
+    MetricsServer &operator=(const MetricsServer &) = delete;
+
+    /**
+     * @brief Listens on a local port and starts answering.
+     *
+     * @param port the port
+     * @return int - the error code
+     */
+    int start(const uint16_t port);
+
+    /**
+     * @brief Stops answering and closes the port.
+     *
+     */
+    void stop();
+};
+
+#endif
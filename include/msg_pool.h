@@ -0,0 +1,213 @@
+#ifndef __MSG_POOL_H_
+#define __MSG_POOL_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <utility>
+#include "utils.h"
+
+// Buffer sizes go from 64 bytes (an INT message) up to 2048 bytes
+#define MSG_POOL_MIN_SHIFT 6
+#define MSG_POOL_CLASSES 6
+#define MSG_POOL_SLAB_SIZE (64 * 1024)
+
+class MsgPool;
+
+/**
+ * @brief Header of a pooled message buffer. The framed message follows the
+ *   header, in a block as large as the buffer's size class.
+ *
+ */
+struct msg_buf {
+    std::atomic<uint32_t> refs;
+    uint8_t size_class;
+
+    // Whether the buffer carries a topic announcement of the compact
+    // protocol, rather than a published message
+    bool announcement;
+    uint16_t len;
+    MsgPool *owner;
+    msg_buf *next_free;
+
+    // When the message was received (monotonic_ns()), 0 if it wasn't
+    // received live, e.g. when it was read back from the log
+    int64_t received_ns;
+} __attribute__((aligned(16)));
+
+/**
+ * @brief Counters of a message pool.
+ *
+ */
+struct pool_counters {
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t slabs;
+    uint64_t slab_bytes;
+};
+
+/**
+ * @brief Slab allocator of message buffers. Each thread has its own pool,
+ *   with a free list per size class, and only allocates a new slab when the
+ *   free list of a size class runs out, so no memory is allocated in steady
+ *   state. A buffer may be released by any thread: buffers released by
+ *   other threads are pushed on a lock-free stack of the pool they came
+ *   from, which the owning thread takes over whenever a free list runs out.
+ *
+ */
+class MsgPool {
+    msg_buf *free_lists[MSG_POOL_CLASSES];
+    pool_counters stats;
+
+    // Buffers released by other threads, whatever their size class
+    std::atomic<msg_buf *> remote_frees;
+
+    /**
+     * @brief Moves the buffers released by other threads to the free lists.
+     *
+     * @return int - how many buffers were reclaimed
+     */
+    int reclaim_remote_frees();
+
+    /**
+     * @brief Carves a new slab into buffers of the given size class.
+     *
+     * @param size_class the size class
+     * @return int - the error code
+     */
+    int grow(const int size_class);
+
+public:
+    MsgPool();
+
+    /**
+     * @brief Returns the calling thread's pool. Pools live until the process
+     *   exits, as their buffers may outlive the threads.
+     *
+     * @return MsgPool& - the pool
+     */
+    static MsgPool &local();
+
+    /**
+     * @brief Allocates a buffer holding at least len bytes, with a single
+     *   reference.
+     *
+     * @param len the length of the message
+     * @return msg_buf* - the buffer, or NULL if the message is too long
+     */
+    msg_buf *alloc(const size_t len);
+
+    /**
+     * @brief Returns a buffer to the pool.
+     *
+     * @param buf the buffer
+     */
+    void free(msg_buf *buf);
+
+    /**
+     * @brief Returns the pool's counters.
+     *
+     * @return const pool_counters& - the counters
+     */
+    const pool_counters &counters() const;
+};
+
+/**
+ * @brief Intrusively reference counted handle to a pooled message buffer.
+ *   Copying the handle only bumps the buffer's reference count.
+ *
+ */
+class MsgRef {
+    msg_buf *buf;
+
+public:
+    MsgRef() : buf(NULL) {}
+
+    // Takes over the reference the buffer was allocated with
+    explicit MsgRef(msg_buf *buf) : buf(buf) {}
+
+    MsgRef(const MsgRef &other) : buf(other.buf) {
+        if (buf) {
+            buf->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    MsgRef(MsgRef &&other) : buf(other.buf) {
+        other.buf = NULL;
+    }
+
+    ~MsgRef() {
+        reset();
+    }
+
+    MsgRef &operator=(const MsgRef &other) {
+        MsgRef tmp(other);
+        std::swap(buf, tmp.buf);
+        return *this;
+    }
+
+    MsgRef &operator=(MsgRef &&other) {
+        std::swap(buf, other.buf);
+        return *this;
+    }
+
+    /**
+     * @brief Drops the reference, returning the buffer to the pool if it
+     *   was the last one.
+     *
+     */
+    void reset() {
+        if (buf && buf->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            MsgPool::local().free(buf);
+        }
+
+        buf = NULL;
+    }
+
+    /**
+     * @brief Gives up the reference without dropping it, so it can be
+     *   carried across threads as a raw pointer and adopted again with the
+     *   explicit constructor.
+     *
+     * @return msg_buf* - the buffer
+     */
+    msg_buf *release() {
+        msg_buf *res = buf;
+        buf = NULL;
+        return res;
+    }
+
+    explicit operator bool() const {
+        return buf != NULL;
+    }
+
+    char *data() const {
+        return (char *)(buf + 1);
+    }
+
+    uint16_t len() const {
+        return buf->len;
+    }
+
+    server_to_client_msg *msg() const {
+        return (server_to_client_msg *)data();
+    }
+
+    int64_t received_ns() const {
+        return buf->received_ns;
+    }
+
+    void set_received_ns(const int64_t ns) const {
+        buf->received_ns = ns;
+    }
+
+    bool is_announcement() const {
+        return buf->announcement;
+    }
+
+    void set_announcement() const {
+        buf->announcement = true;
+    }
+};
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef __PROTOCOL_V2_H_
+#define __PROTOCOL_V2_H_
+
+#include <cstdint>
+#include <cstddef>
+#include "utils.h"
+#include "lz_block.h"
+
+/*
+ * Compact subscriber protocol, negotiated during the ID handshake. A client
+ * asks for it by setting the version (and the flags it wants) after its ID.
+ * The server answers with an ack, framed the legacy way, and every frame it
+ * sends afterwards is:
+ *
+ *   varint body_len | varint topic_ref | data_type | [ip port] | content
+ *
+ * where the publisher address is left out when V2_NO_ADDRESS was accepted.
+ * A topic is announced once per connection, before its first message, by a
+ * frame whose topic_ref is 0:
+ *
+ *   varint body_len | 0 | varint topic_ref | topic name
+ *
+ * With V2_BATCH, every frame after the ack is instead a batch of the frames
+ * above, packed back to back:
+ *
+ *   varint batch_len | kind | [varint frames_len] | frames
+ *
+ * where the frames are compressed (see lz_block.h) when the kind is
+ * V2_BATCH_COMPRESSED, and as they are otherwise.
+ *
+ * Commands keep the 2-byte length, and are made of an opcode, the SF flag
+ * and the unpadded topic. Clients which don't ask for the protocol keep
+ * getting the legacy frames.
+ */
+
+#define PROTOCOL_V1 1
+#define PROTOCOL_V2 2
+
+#define V2_NO_ADDRESS 0x01
+#define V2_BATCH 0x02
+#define V2_COMPRESS 0x04
+#define V2_KNOWN_FLAGS (V2_NO_ADDRESS | V2_BATCH | V2_COMPRESS)
+
+#define V2_BATCH_PLAIN 0
+#define V2_BATCH_COMPRESSED 1
+
+#define V2_ACK_MAGIC 0xB2
+#define V2_ANNOUNCE_REF 0
+#define V2_SUBSCRIBE 1
+#define V2_UNSUBSCRIBE 2
+
+#define VARINT_MAX_LEN 5
+#define V2_MAX_HEADER_LEN (2 * VARINT_MAX_LEN + 1 + 6)
+
+/**
+ * @brief The server's answer to a client asking for a protocol version.
+ *
+ */
+struct v2_ack {
+    uint16_t len;
+    uint8_t magic;
+    uint8_t version;
+    uint8_t flags;
+} __attribute__((packed));
+
+/**
+ * @brief A client -> server command in the compact protocol.
+ *
+ */
+struct v2_command {
+    uint16_t len;
+    uint8_t opcode;
+    uint8_t sf;
+    char topic[MAX_TOPIC_LEN];
+} __attribute__((packed));
+
+/**
+ * @brief A frame laid out for writing: an encoded header, followed by bytes
+ *   taken as they are from the message buffer.
+ *
+ */
+struct wire_frame {
+    char header[V2_MAX_HEADER_LEN];
+    size_t header_len;
+    const char *tail;
+    size_t tail_len;
+};
+
+/**
+ * @brief A decoded compact frame, pointing into the frame's body.
+ *
+ */
+struct v2_message {
+    // Whether the frame announces a topic, rather than carrying a message
+    bool announce;
+    uint32_t topic_ref;
+
+    // The announced topic
+    const char *topic;
+    size_t topic_len;
+
+    uint8_t data_type;
+    uint32_t ip;
+    uint16_t port;
+    const char *content;
+    size_t content_len;
+};
+
+/**
+ * @brief Writes an unsigned LEB128 varint.
+ *
+ * @param value the value
+ * @param out where to write it, at least VARINT_MAX_LEN bytes long
+ * @return size_t - how many bytes were written
+ */
+size_t put_varint(uint32_t value, char *out);
+
+/**
+ * @brief Reads an unsigned LEB128 varint.
+ *
+ * @param data the bytes
+ * @param len how many bytes are available
+ * @param value the value
+ * @return int - how many bytes were read, 0 if more bytes are needed,
+ *   -1 if the varint is malformed
+ */
+int get_varint(const char *data, const size_t len, uint32_t &value);
+
+/**
+ * @brief Lays out a legacy framed message as a compact frame. The content
+ *   is not copied, it's the frame's tail.
+ *
+ * @param msg the legacy framed message
+ * @param len the length of the legacy frame
+ * @param topic_ref the reference of the message's topic
+ * @param with_address whether to include the publisher address
+ * @param frame the compact frame
+ */
+void encode_v2_message(const server_to_client_msg *msg, const size_t len,
+    const uint32_t topic_ref, const bool with_address, wire_frame &frame);
+
+/**
+ * @brief Lays out the announcement of a topic's reference.
+ *
+ * @param topic_ref the reference
+ * @param topic the MAX_TOPIC_LEN zero padded bytes of the topic
+ * @param frame the compact frame
+ */
+void encode_v2_announce(const uint32_t topic_ref, const char *topic,
+    wire_frame &frame);
+
+/**
+ * @brief Returns how long a batch may get on the wire.
+ *
+ * @param frames_len the length of the frames it holds
+ * @return size_t - the largest length of the batch
+ */
+size_t v2_batch_bound(const size_t frames_len);
+
+/**
+ * @brief Packs frames into a batch, compressing them if asked to and if it
+ *   makes them shorter. The batch is written at the end of the room left
+ *   for its header, so it may start after the beginning of the buffer.
+ *
+ * @param frames the frames, back to back
+ * @param len the length of the frames
+ * @param compress whether to try compressing them
+ * @param out where to write the batch, at least v2_batch_bound(len) long
+ * @param start where in out the batch starts
+ * @return size_t - the length of the batch
+ */
+size_t pack_v2_batch(const char *frames, const size_t len,
+    const bool compress, char *out, size_t &start);
+
+/**
+ * @brief Unpacks the body of a batch.
+ *
+ * @param body the body, without its length
+ * @param len the length of the body
+ * @param scratch where to decompress the frames, MAX_BATCH_LEN bytes long
+ * @param frames the frames, back to back
+ * @param frames_len the length of the frames
+ * @return int - the error code
+ */
+int unpack_v2_batch(const char *body, const size_t len, char *scratch,
+    const char *&frames, size_t &frames_len);
+
+/**
+ * @brief Decodes the body of a compact frame.
+ *
+ * @param body the body, without its length
+ * @param len the length of the body
+ * @param with_address whether the publisher address was included
+ * @param msg the decoded frame
+ * @return int - the error code
+ */
+int decode_v2_frame(const char *body, const size_t len,
+    const bool with_address, v2_message &msg);
+
+#endif
@@ -0,0 +1,157 @@
+#ifndef __SPSC_QUEUE_H_
+#define __SPSC_QUEUE_H_
+
+#include <cstddef>
+#include <atomic>
+
+#define CACHE_LINE 64
+
+/**
+ * @brief Bounded lock-free queue with a single producer thread and a single
+ *   consumer thread. Each side keeps a cached copy of the other side's index,
+ *   so the shared indices are only read when the cached one says the queue
+ *   looks full / empty.
+ *
+ * @tparam T the type of the items, copied in and out of the queue
+ */
+template <typename T>
+class SpscQueue {
+    T *slots;
+    size_t mask;
+
+    // Written by the consumer
+    alignas(CACHE_LINE) std::atomic<size_t> head;
+    size_t cached_tail;
+
+    // Written by the producer
+    alignas(CACHE_LINE) std::atomic<size_t> tail;
+    size_t cached_head;
+
+public:
+    /**
+     * @brief Creates a queue.
+     *
+     * @param capacity the maximum number of items, a power of two
+     */
+    explicit SpscQueue(const size_t capacity)
+            : slots(new T[capacity]), mask(capacity - 1), head(0),
+              cached_tail(0), tail(0), cached_head(0) {}
+
+    ~SpscQueue() {
+        delete[] slots;
+    }
+
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    /**
+     * @brief Adds an item at the back of the queue. Only called by the
+     *   producer.
+     *
+     * @param item the item
+     * @return true, if the item was added (the queue wasn't full)
+     */
+    bool push(const T &item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - cached_head > mask) {
+            cached_head = head.load(std::memory_order_acquire);
+            if (t - cached_head > mask) {
+                return false;
+            }
+        }
+
+        slots[t & mask] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Removes the item at the front of the queue. Only called by the
+     *   consumer.
+     *
+     * @param item where to copy the item
+     * @return true, if an item was removed (the queue wasn't empty)
+     */
+    bool pop(T &item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == cached_tail) {
+            cached_tail = tail.load(std::memory_order_acquire);
+            if (h == cached_tail) {
+                return false;
+            }
+        }
+
+        item = slots[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Returns the slot at the back of the queue, to be filled in
+     *   place and then added with publish(). Only called by the producer.
+     *
+     * @return T* - the slot, or NULL if the queue is full
+     */
+    T *claim() {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - cached_head > mask) {
+            cached_head = head.load(std::memory_order_acquire);
+            if (t - cached_head > mask) {
+                return NULL;
+            }
+        }
+
+        return &slots[t & mask];
+    }
+
+    /**
+     * @brief Adds the slot returned by claim() to the queue. Only called by
+     *   the producer.
+     *
+     */
+    void publish() {
+        tail.store(tail.load(std::memory_order_relaxed) + 1,
+            std::memory_order_release);
+    }
+
+    /**
+     * @brief Returns the item at the front of the queue, to be read in place
+     *   and then removed with release(). Only called by the consumer.
+     *
+     * @return T* - the item, or NULL if the queue is empty
+     */
+    T *front() {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == cached_tail) {
+            cached_tail = tail.load(std::memory_order_acquire);
+            if (h == cached_tail) {
+                return NULL;
+            }
+        }
+
+        return &slots[h & mask];
+    }
+
+    /**
+     * @brief Removes the item returned by front(). Only called by the
+     *   consumer.
+     *
+     */
+    void release() {
+        head.store(head.load(std::memory_order_relaxed) + 1,
+            std::memory_order_release);
+    }
+
+    /**
+     * @brief Returns how many items are in the queue. Exact only when
+     *   called by one of the two sides while the other one is idle.
+     *
+     * @return size_t - the number of items
+     */
+    size_t size() const {
+        return tail.load(std::memory_order_acquire) -
+            head.load(std::memory_order_acquire);
+    }
+};
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef __TOPIC_TABLE_H_
+#define __TOPIC_TABLE_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <string_view>
+#include "defines.h"
+
+/**
+ * @brief A topic name, padded with zeros up to the maximum topic length,
+ *   the same way topics are laid out in the framed messages.
+ *
+ */
+struct topic_key {
+    char name[MAX_TOPIC_LEN];
+};
+
+/**
+ * @brief Pads a topic name into a key, truncating it if it's too long.
+ *
+ * @param name the topic name
+ * @return topic_key - the key
+ */
+topic_key make_topic_key(const std::string_view name);
+
+/**
+ * @brief Hashes a zero padded topic, a whole word at a time.
+ *
+ * @param name the MAX_TOPIC_LEN bytes of the topic
+ * @return uint64_t - the hash
+ */
+uint64_t hash_topic(const char *name);
+
+/**
+ * @brief Interning table, mapping each topic to a dense integer ID, in the
+ *   order the topics were added. Topics are compared and hashed as their
+ *   fixed-size zero padded bytes, so a framed message's topic can be looked
+ *   up in place. IDs are never reused, so data indexed by them stays valid.
+ *
+ */
+class TopicTable {
+    // Open addressing slots, holding IDs, or -1 when empty
+    std::vector<int> slots;
+
+    // The key and hash of each ID
+    std::vector<topic_key> keys;
+    std::vector<uint64_t> hashes;
+
+    /**
+     * @brief Finds the slot of a topic, or the empty slot it would take.
+     *
+     * @param name the zero padded topic
+     * @param hash the topic's hash
+     * @return size_t - the slot
+     */
+    size_t find_slot(const char *name, const uint64_t hash) const;
+
+    /**
+     * @brief Doubles the number of slots.
+     *
+     */
+    void grow();
+
+public:
+    TopicTable();
+
+    /**
+     * @brief Finds a topic's ID.
+     *
+     * @param name the MAX_TOPIC_LEN zero padded bytes of the topic
+     * @return int - the ID, or -1 if the topic wasn't added
+     */
+    int lookup(const char *name) const;
+
+    /**
+     * @brief Finds a topic's ID, adding the topic if it's missing.
+     *
+     * @param name the MAX_TOPIC_LEN zero padded bytes of the topic
+     * @return int - the ID
+     */
+    int intern(const char *name);
+
+    /**
+     * @brief Returns the topic of an ID.
+     *
+     * @param id the ID
+     * @return const char* - the MAX_TOPIC_LEN zero padded bytes of the topic
+     */
+    const char *name(const int id) const;
+
+    /**
+     * @brief Returns how many topics were added.
+     *
+     * @return size_t - the number of topics, one more than the largest ID
+     */
+    size_t size() const;
+};
+
+#endif
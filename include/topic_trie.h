@@ -0,0 +1,315 @@
+#ifndef __TOPIC_TRIE_H_
+#define __TOPIC_TRIE_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#define TOPIC_SEPARATOR '/'
+#define TOPIC_ANY_ONE "+"
+#define TOPIC_ANY_MANY "*"
+
+// Topics are at most 50 characters long, so they have at most 26 segments
+#define TOPIC_MAX_SEGMENTS 32
+
+/**
+ * @brief Map from topic patterns to values, stored as a trie with one level
+ *   per '/'-separated segment of the pattern. A pattern may contain
+ *   wildcard segments: "+" matches exactly one segment, and "*" matches one
+ *   or more segments. Matching a topic walks the trie one segment at a
+ *   time, so it costs time proportional to the depth of the topic (and the
+ *   number of wildcards on the way), not to the number of patterns.
+ *
+ * @tparam V the type of the values, default constructed on insertion
+ */
+template <typename V>
+class TopicTrie {
+    struct node {
+        // The segment leading to the node, which the parent's key points to
+        std::string segment;
+        node *parent;
+
+        // The children, by segment, apart from the wildcards
+        std::unordered_map<std::string_view, node *> children;
+        node *any_one;
+        node *any_many;
+
+        bool has_value;
+        V value;
+
+        // The last match which visited the value
+        uint64_t visited;
+
+        node(const std::string_view segment, node *parent)
+                : segment(segment), parent(parent), any_one(NULL),
+                  any_many(NULL), has_value(false), value(), visited(0) {}
+    };
+
+    node root;
+    size_t count;
+    uint64_t match_epoch;
+
+    /**
+     * @brief Returns the next segment of a topic, moving past it.
+     *
+     * @param topic the topic
+     * @param pos where the segment starts, updated to where the next starts
+     * @return std::string_view - the segment
+     */
+    static std::string_view next_segment(const std::string_view topic,
+            size_t &pos) {
+        size_t end = topic.find(TOPIC_SEPARATOR, pos);
+        if (end == std::string_view::npos) {
+            end = topic.size();
+        }
+
+        std::string_view segment = topic.substr(pos, end - pos);
+        pos = end + 1;
+        return segment;
+    }
+
+    /**
+     * @brief Finds the child of a node for a segment.
+     *
+     * @param parent the node
+     * @param segment the segment
+     * @param create whether to create the child if it's missing
+     * @return node* - the child, or NULL if it's missing
+     */
+    static node *child(node *parent, const std::string_view segment,
+            const bool create) {
+        node **slot;
+        if (segment == TOPIC_ANY_ONE) {
+            slot = &parent->any_one;
+        } else if (segment == TOPIC_ANY_MANY) {
+            slot = &parent->any_many;
+        } else {
+            auto it = parent->children.find(segment);
+            if (it != parent->children.end()) {
+                return it->second;
+            }
+
+            if (!create) {
+                return NULL;
+            }
+
+            node *new_node = new node(segment, parent);
+            parent->children[new_node->segment] = new_node;
+            return new_node;
+        }
+
+        if (!*slot && create) {
+            *slot = new node(segment, parent);
+        }
+
+        return *slot;
+    }
+
+    /**
+     * @brief Finds the node of a pattern.
+     *
+     * @param pattern the pattern
+     * @param create whether to create the missing nodes
+     * @return node* - the node, or NULL if it's missing
+     */
+    node *walk(const std::string_view pattern, const bool create) {
+        node *current = &root;
+        size_t pos = 0;
+        while (current && pos <= pattern.size()) {
+            current = child(current, next_segment(pattern, pos), create);
+        }
+
+        return current;
+    }
+
+    /**
+     * @brief Visits the values of the patterns under a node which match the
+     *   rest of a topic.
+     *
+     * @param current the node
+     * @param segments the topic's segments
+     * @param n the number of segments
+     * @param i the first segment left to match
+     * @param visit called for each value
+     */
+    template <typename F>
+    void match_from(node *current, const std::string_view *segments,
+            const size_t n, const size_t i, F &visit) {
+        if (i == n) {
+            // A value reachable on several paths is only visited once
+            if (current->has_value && current->visited != match_epoch) {
+                current->visited = match_epoch;
+                visit(current->value);
+            }
+
+            return;
+        }
+
+        if (!current->children.empty()) {
+            auto it = current->children.find(segments[i]);
+            if (it != current->children.end()) {
+                match_from(it->second, segments, n, i + 1, visit);
+            }
+        }
+
+        if (current->any_one) {
+            match_from(current->any_one, segments, n, i + 1, visit);
+        }
+
+        if (current->any_many) {
+            for (size_t j = i + 1; j <= n; ++j) {
+                match_from(current->any_many, segments, n, j, visit);
+            }
+        }
+    }
+
+    /**
+     * @brief Frees the nodes under a node.
+     *
+     * @param current the node
+     */
+    static void free_children(node *current) {
+        for (auto &child_entry : current->children) {
+            free_children(child_entry.second);
+            delete child_entry.second;
+        }
+
+        node *wildcards[] = {current->any_one, current->any_many};
+        for (node *wildcard : wildcards) {
+            if (wildcard) {
+                free_children(wildcard);
+                delete wildcard;
+            }
+        }
+    }
+
+public:
+    TopicTrie() : root("", NULL), count(0), match_epoch(0) {}
+
+    ~TopicTrie() {
+        free_children(&root);
+    }
+
+    TopicTrie(const TopicTrie &) = delete;
+    TopicTrie &operator=(const TopicTrie &) = delete;
+
+    /**
+     * @brief Checks whether a topic contains wildcard segments.
+     *
+     * @param topic the topic
+     * @return true, if it's a pattern matching several topics
+     */
+    static bool is_pattern(const std::string_view topic) {
+        size_t pos = 0;
+        while (pos <= topic.size()) {
+            std::string_view segment = next_segment(topic, pos);
+            if (segment == TOPIC_ANY_ONE || segment == TOPIC_ANY_MANY) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * @brief Finds the value of a pattern, adding it if it's missing.
+     *
+     * @param pattern the pattern
+     * @return V& - the value
+     */
+    V &insert(const std::string_view pattern) {
+        node *found = walk(pattern, true);
+        if (!found->has_value) {
+            found->has_value = true;
+            ++count;
+        }
+
+        return found->value;
+    }
+
+    /**
+     * @brief Finds the value of a pattern, wildcards being compared as they
+     *   are rather than matched.
+     *
+     * @param pattern the pattern
+     * @return V* - the value, or NULL if the pattern is missing
+     */
+    V *find(const std::string_view pattern) {
+        node *found = walk(pattern, false);
+        if (!found || !found->has_value) {
+            return NULL;
+        }
+
+        return &found->value;
+    }
+
+    /**
+     * @brief Removes a pattern, along with the nodes left without any
+     *   purpose.
+     *
+     * @param pattern the pattern
+     * @return true, if the pattern was found
+     */
+    bool erase(const std::string_view pattern) {
+        node *current = walk(pattern, false);
+        if (!current || !current->has_value) {
+            return false;
+        }
+
+        current->has_value = false;
+        current->value = V();
+        --count;
+
+        // Remove the nodes which neither hold a value nor lead to one
+        while (current != &root && !current->has_value &&
+                current->children.empty() && !current->any_one &&
+                !current->any_many) {
+            node *parent = current->parent;
+            if (parent->any_one == current) {
+                parent->any_one = NULL;
+            } else if (parent->any_many == current) {
+                parent->any_many = NULL;
+            } else {
+                parent->children.erase(current->segment);
+            }
+
+            delete current;
+            current = parent;
+        }
+
+        return true;
+    }
+
+    /**
+     * @brief Visits the value of every pattern which matches a topic, once.
+     *
+     * @param topic the topic, without wildcards
+     * @param visit called with a reference to each value
+     */
+    template <typename F>
+    void match(const std::string_view topic, F &&visit) {
+        // Split the topic into its segments
+        std::string_view segments[TOPIC_MAX_SEGMENTS];
+        size_t n = 0;
+        size_t pos = 0;
+        while (pos <= topic.size() && n < TOPIC_MAX_SEGMENTS) {
+            segments[n++] = next_segment(topic, pos);
+        }
+
+        ++match_epoch;
+        match_from(&root, segments, n, 0, visit);
+    }
+
+    /**
+     * @brief Returns how many patterns have a value.
+     *
+     * @return size_t - the number of patterns
+     */
+    size_t size() const {
+        return count;
+    }
+};
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <ctime>
+#endif
+
+// How many events each thread keeps, the oldest being overwritten
+#define TRACE_RING_EVENTS (1 << 16)
+#define TRACE_MAX_THREADS 128
+#define TRACE_THREAD_NAME_LEN 32
+
+/**
+ * @brief Returns the time, in ticks of the cheapest clock there is: the
+ *   time stamp counter on x86, converted to nanoseconds only when the
+ *   events are dumped.
+ *
+ * @return uint64_t - the ticks
+ */
+static inline uint64_t trace_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+enum trace_event_type {
+    TRACE_SPAN,
+    TRACE_COUNTER_VALUE
+};
+
+/**
+ * @brief A recorded event: a span of time, or the value of a counter at
+ *   some point in time.
+ *
+ */
+struct trace_event {
+    // A string literal, so only the pointer is kept
+    const char *name;
+    uint64_t start;
+
+    // When the span ended, or the counter's value
+    uint64_t end_or_value;
+    trace_event_type type;
+};
+
+/**
+ * @brief Ring of the events recorded by one thread. Only its thread writes
+ *   to it, while a dump may read it from any thread: the events are written
+ *   before the head is published, and those the thread may have
+ *   overwritten while they were being read are left out of the dump.
+ *
+ */
+class TraceRing {
+    trace_event *events;
+    std::atomic<uint64_t> head;
+    char thread_name[TRACE_THREAD_NAME_LEN];
+
+public:
+    TraceRing();
+
+    TraceRing(const TraceRing &) = delete;
+    TraceRing &operator=(const TraceRing &) = delete;
+
+    /**
+     * @brief Returns the calling thread's ring. Rings live until the
+     *   process exits, so the events of finished threads are dumped too.
+     *
+     * @return TraceRing& - the ring
+     */
+    static TraceRing &local();
+
+    void record(const char *name, const uint64_t start,
+            const uint64_t end_or_value, const trace_event_type type) {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        trace_event &event = events[h & (TRACE_RING_EVENTS - 1)];
+        event.name = name;
+        event.start = start;
+        event.end_or_value = end_or_value;
+        event.type = type;
+        head.store(h + 1, std::memory_order_release);
+    }
+
+    /**
+     * @brief Names the thread in the dumps.
+     *
+     * @param name the name
+     */
+    void set_thread_name(const char *name);
+
+    const char *get_thread_name() const {
+        return thread_name;
+    }
+
+    /**
+     * @brief Copies the events which are in the ring.
+     *
+     * @param out where to copy them, at least TRACE_RING_EVENTS long
+     * @return size_t - how many events were copied, oldest first
+     */
+    size_t snapshot(trace_event *out) const;
+};
+
+/**
+ * @brief Records the span of time its scope takes.
+ *
+ */
+class TraceScope {
+    const char *name;
+    uint64_t start;
+
+public:
+    explicit TraceScope(const char *name)
+        : name(name), start(trace_ticks()) {}
+
+    ~TraceScope() {
+        TraceRing::local().record(name, start, trace_ticks(), TRACE_SPAN);
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+};
+
+/**
+ * @brief Writes every thread's events to a file, as a Chrome trace (which
+ *   Perfetto opens too).
+ *
+ * @param path the file, or NULL for trace-<pid>.json
+ * @return int - the error code
+ */
+int trace_dump(const char *path);
+
+// Tracing is compiled in with -DTRACE ("make TRACE=1"). Otherwise, the
+// macros compile to nothing, and their arguments aren't evaluated
+#ifdef TRACE
+#define TRACE_ENABLED true
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) \
+    TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_COUNTER(name, value) \
+    TraceRing::local().record(name, trace_ticks(), value, \
+        TRACE_COUNTER_VALUE)
+#define TRACE_THREAD(name) TraceRing::local().set_thread_name(name)
+#else
+#define TRACE_ENABLED false
+#define TRACE_SCOPE(name) ((void)0)
+#define TRACE_COUNTER(name, value) ((void)0)
+#define TRACE_THREAD(name) ((void)0)
+#endif
+
+#endif
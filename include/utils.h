@@ -6,6 +6,7 @@
 #include <cstdlib>
 #include <unistd.h>
 #include <vector>
+#include <netinet/in.h>
 #include "defines.h"
 
 /**
@@ -60,6 +61,11 @@ struct client_to_server_msg {
     union {
         struct {
             char id[MAX_ID_LEN + 1];
+
+            // The protocol version and flags the client asks for, zero
+            // for the clients which predate them
+            uint8_t version;
+            uint8_t flags;
         } __attribute__((packed)) client_id;
 
         struct {
@@ -85,14 +91,67 @@ struct client_to_server_msg {
 bool is_number(const char *str, const int len);
 
 /**
- * @brief Receives messages from the given socket, be they concatenated
- *   or truncated, until no more messages are received.
+ * @brief Computes the length of a received datagram's content, once framed
+ *   for the TCP clients.
+ * 
+ * @param received the datagram
+ * @param received_len the length of the datagram
+ * @return int - the length of the content, or -1 if the data type is
+ *   unknown
+ */
+int framed_content_len(const udp_to_server_msg &received,
+    const int received_len);
+
+/**
+ * @brief Frames a received datagram for the TCP clients.
+ * 
+ * @param msg where to write the framed message, at least
+ *   UDP_HDR_LEN + content_len bytes long
+ * @param received the datagram
+ * @param received_len the length of the datagram
+ * @param content_len the length of the framed content
+ * @param client_address the address of the UDP client
+ */
+void frame_datagram(server_to_client_msg *msg,
+    const udp_to_server_msg &received, const int received_len,
+    const int content_len, const sockaddr_in &client_address);
+
+/**
+ * @brief Puts the given descriptor in non-blocking mode.
+ * 
+ * @param fd the descriptor
+ * @return int - the error code
+ */
+int set_non_blocking(const int fd);
+
+/**
+ * @brief Raises the soft limit of open descriptors up to the hard limit.
  * 
- * @param tcp_socket the socket to receive the messages from
- * @param messages a vector of char arrays, storing dynamically allocated
- *   messages received from the socket
  * @return int - the error code
  */
-int recv_messages(const int tcp_socket, std::vector<char *> &messages);
+int raise_fd_limit();
+
+/**
+ * @brief Returns the time of a clock which never goes back.
+ * 
+ * @return int64_t - the time, in milliseconds
+ */
+int64_t monotonic_ms();
+
+/**
+ * @brief Returns the time of the same clock as monotonic_ms(), more
+ *   precisely.
+ * 
+ * @return int64_t - the time, in microseconds
+ */
+int64_t monotonic_us();
+
+/**
+ * @brief Returns the time of the same clock as monotonic_ms(), as precisely
+ *   as it's kept.
+ * 
+ * @return int64_t - the time, in nanoseconds
+ */
+int64_t monotonic_ns();
 
 #endif
@@ -0,0 +1,218 @@
+#include <cstring>
+#include <algorithm>
+#include "include/lz_block.h"
+
+// The last bytes are always literals, and no match starts too close to the
+// end, so the compressor never reads past the data
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+#define LZ_RUN_MASK 15
+#define LZ_HASH_MUL 2654435761u
+
+/**
+ * @brief Reads 4 bytes, whatever their alignment.
+ *
+ * @param p the bytes
+ * @return uint32_t - the bytes, as a word
+ */
+static uint32_t read32(const char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/**
+ * @brief Hashes 4 bytes into a slot of the match table.
+ *
+ * @param value the bytes, as a word
+ * @return uint32_t - the slot
+ */
+static uint32_t hash4(const uint32_t value) {
+    return (value * LZ_HASH_MUL) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * @brief Writes the part of a length which doesn't fit in its token.
+ *
+ * @param out where to write
+ * @param len what's left of the length
+ * @return char* - where the next byte goes
+ */
+static char *put_length(char *out, size_t len) {
+    while (len >= 255) {
+        *out++ = (char)255;
+        len -= 255;
+    }
+
+    *out++ = (char)len;
+    return out;
+}
+
+/**
+ * @brief Reads the part of a length which didn't fit in its token.
+ *
+ * @param src the block
+ * @param len the length of the block
+ * @param pos where the length continues, moved past it
+ * @param value the length, added to
+ * @return int - the error code
+ */
+static int get_length(const char *src, const size_t len, size_t &pos,
+        size_t &value) {
+    uint8_t byte;
+    do {
+        if (pos >= len) {
+            return -1;
+        }
+
+        byte = src[pos++];
+        value += byte;
+    } while (byte == 255);
+
+    return 0;
+}
+
+/**
+ * @brief Writes a sequence: its literals, followed by a match, or by
+ *   nothing for the last sequence.
+ *
+ * @param out where to write
+ * @param literals the literals
+ * @param literal_len how many literals there are
+ * @param offset how far back the match is, 0 for the last sequence
+ * @param match_len the length of the match
+ * @return char* - where the next sequence goes
+ */
+static char *put_sequence(char *out, const char *literals,
+        const size_t literal_len, const size_t offset,
+        const size_t match_len) {
+    size_t match_extra = offset == 0 ? 0 : match_len - LZ_MIN_MATCH;
+
+    char *token = out++;
+    *token = (char)((std::min(literal_len, (size_t)LZ_RUN_MASK) << 4) |
+        std::min(match_extra, (size_t)LZ_RUN_MASK));
+
+    if (literal_len >= LZ_RUN_MASK) {
+        out = put_length(out, literal_len - LZ_RUN_MASK);
+    }
+
+    memcpy(out, literals, literal_len);
+    out += literal_len;
+
+    if (offset == 0) {
+        return out;
+    }
+
+    out[0] = (char)(offset & 0xff);
+    out[1] = (char)(offset >> 8);
+    out += 2;
+
+    if (match_extra >= LZ_RUN_MASK) {
+        out = put_length(out, match_extra - LZ_RUN_MASK);
+    }
+
+    return out;
+}
+
+size_t lz_compress_bound(const size_t len) {
+    return len + len / 255 + 16;
+}
+
+size_t lz_compress(const char *src, const size_t len, char *dst) {
+    // The last position each 4-byte prefix was seen at
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    char *out = dst;
+    size_t anchor = 0;
+    size_t pos = 0;
+
+    while (len >= LZ_MATCH_LIMIT && pos <= len - LZ_MATCH_LIMIT) {
+        uint32_t prefix = read32(src + pos);
+        uint32_t slot = hash4(prefix);
+        size_t candidate = table[slot];
+        table[slot] = pos;
+
+        // Check whether the slot points at the same bytes, close enough
+        if (candidate >= pos || pos - candidate > LZ_MAX_OFFSET ||
+                read32(src + candidate) != prefix) {
+            ++pos;
+            continue;
+        }
+
+        // Extend the match, leaving the last bytes as literals
+        size_t match_len = LZ_MIN_MATCH;
+        while (pos + match_len < len - LZ_LAST_LITERALS &&
+                src[candidate + match_len] == src[pos + match_len]) {
+            ++match_len;
+        }
+
+        out = put_sequence(out, src + anchor, pos - anchor, pos - candidate,
+            match_len);
+
+        pos += match_len;
+        anchor = pos;
+    }
+
+    // Whatever wasn't matched ends the block
+    out = put_sequence(out, src + anchor, len - anchor, 0, 0);
+    return out - dst;
+}
+
+int lz_decompress(const char *src, const size_t len, char *dst,
+        const size_t capacity) {
+    size_t in = 0;
+    size_t out = 0;
+
+    while (in < len) {
+        uint8_t token = src[in++];
+
+        // Copy the literals
+        size_t literal_len = token >> 4;
+        if (literal_len == LZ_RUN_MASK &&
+                get_length(src, len, in, literal_len) < 0) {
+            return -1;
+        }
+
+        if (literal_len > len - in || literal_len > capacity - out) {
+            return -1;
+        }
+
+        memcpy(dst + out, src + in, literal_len);
+        in += literal_len;
+        out += literal_len;
+
+        // The last sequence has no match
+        if (in == len) {
+            break;
+        }
+
+        // Copy the match, a byte at a time, as it may overlap itself
+        if (len - in < 2) {
+            return -1;
+        }
+
+        size_t offset = (uint8_t)src[in] | ((uint8_t)src[in + 1] << 8);
+        in += 2;
+
+        size_t match_len = token & LZ_RUN_MASK;
+        if (match_len == LZ_RUN_MASK &&
+                get_length(src, len, in, match_len) < 0) {
+            return -1;
+        }
+
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out || match_len > capacity - out) {
+            return -1;
+        }
+
+        for (size_t i = 0; i < match_len; ++i) {
+            dst[out + i] = dst[out - offset + i];
+        }
+
+        out += match_len;
+    }
+
+    return out;
+}
@@ -0,0 +1,410 @@
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <algorithm>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "include/message_log.h"
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+/**
+ * @brief Computes how many bytes a record takes in a segment.
+ *
+ * @param len the length of the record's data
+ * @return size_t - the size of the record
+ */
+static size_t record_size(const uint32_t len) {
+    size_t size = sizeof(log_record_header) + len;
+    return (size + LOG_RECORD_ALIGN - 1) & ~(size_t)(LOG_RECORD_ALIGN - 1);
+}
+
+/**
+ * @brief Computes a record's checksum, covering its sequence number and
+ *   its data.
+ *
+ * @param seq the sequence number
+ * @param data the data
+ * @param len the length of the data
+ * @return uint32_t - the checksum
+ */
+static uint32_t record_checksum(const uint64_t seq, const char *data,
+        const uint32_t len) {
+    uint32_t hash = FNV_OFFSET;
+    for (size_t i = 0; i < sizeof(seq); ++i) {
+        hash = (hash ^ ((seq >> (8 * i)) & 0xff)) * FNV_PRIME;
+    }
+
+    for (uint32_t i = 0; i < len; ++i) {
+        hash = (hash ^ (uint8_t)data[i]) * FNV_PRIME;
+    }
+
+    return hash;
+}
+
+/**
+ * @brief Returns the wall clock time, which is kept across restarts.
+ *
+ * @return int64_t - the time, in milliseconds
+ */
+static int64_t now_ms() {
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+MessageLog::MessageLog()
+        : retention_bytes(0), retention_ms(0), next_seq(1), total_bytes(0) {
+    memset(&stats, 0, sizeof(stats));
+}
+
+MessageLog::~MessageLog() {
+    for (auto &segment : segments) {
+        munmap(segment.map, LOG_SEGMENT_SIZE);
+        close(segment.fd);
+    }
+}
+
+int MessageLog::open_segment(const uint64_t first_seq,
+        log_segment &segment) {
+    char name[32];
+    snprintf(name, sizeof(name), "%020lu" LOG_SEGMENT_SUFFIX, first_seq);
+
+    segment.first_seq = first_seq;
+    segment.last_seq = first_seq - 1;
+    segment.last_time_ms = 0;
+    segment.size = 0;
+    segment.path = dir + "/" + name;
+
+    segment.fd = ::open(segment.path.c_str(),
+        O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (segment.fd < 0) {
+        fprintf(stderr, "Error opening log segment %s.\n",
+            segment.path.c_str());
+        return -1;
+    }
+
+    // Preallocate the whole segment, so the mapping is always backed
+    struct stat st;
+    if (fstat(segment.fd, &st) < 0 || (st.st_size < LOG_SEGMENT_SIZE &&
+            ftruncate(segment.fd, LOG_SEGMENT_SIZE) < 0)) {
+        fprintf(stderr, "Error sizing log segment %s.\n",
+            segment.path.c_str());
+        close(segment.fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, LOG_SEGMENT_SIZE, PROT_READ, MAP_SHARED,
+        segment.fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error mapping log segment %s.\n",
+            segment.path.c_str());
+        close(segment.fd);
+        return -1;
+    }
+
+    segment.map = (char *)map;
+    return 0;
+}
+
+int MessageLog::recover_segment(log_segment &segment) {
+    int count = 0;
+    uint64_t expected = segment.first_seq;
+
+    // Go through the records until one is missing or torn
+    while (segment.size + sizeof(log_record_header) <= LOG_SEGMENT_SIZE) {
+        log_record_header header;
+        memcpy(&header, segment.map + segment.size, sizeof(header));
+
+        size_t size = record_size(header.len);
+        if (header.len == 0 || header.seq != expected ||
+                segment.size + size > LOG_SEGMENT_SIZE ||
+                header.checksum != record_checksum(header.seq,
+                    segment.map + segment.size + sizeof(header),
+                    header.len)) {
+            break;
+        }
+
+        segment.last_seq = header.seq;
+        segment.last_time_ms = header.time_ms;
+        segment.size += size;
+
+        ++expected;
+        ++count;
+    }
+
+    // Clear whatever follows, so a torn record is never mistaken for a
+    // valid one later
+    if (segment.size + sizeof(log_record_header) <= LOG_SEGMENT_SIZE) {
+        log_record_header end;
+        memset(&end, 0, sizeof(end));
+        if (pwrite(segment.fd, &end, sizeof(end), segment.size) < 0) {
+            fprintf(stderr, "Error clearing the end of log segment %s.\n",
+                segment.path.c_str());
+        }
+    }
+
+    return count;
+}
+
+int MessageLog::open(const std::string &path, const size_t max_bytes,
+        const int64_t max_age_ms) {
+    dir = path;
+    retention_bytes = max_bytes;
+    retention_ms = max_age_ms;
+
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Error creating log directory %s.\n", dir.c_str());
+        return -1;
+    }
+
+    // Find the existing segments, named after their first record
+    DIR *dir_stream = opendir(dir.c_str());
+    if (!dir_stream) {
+        fprintf(stderr, "Error opening log directory %s.\n", dir.c_str());
+        return -1;
+    }
+
+    std::vector<uint64_t> first_seqs;
+    dirent *dir_entry;
+    while ((dir_entry = readdir(dir_stream)) != NULL) {
+        const char *suffix = strstr(dir_entry->d_name, LOG_SEGMENT_SUFFIX);
+        if (suffix && strcmp(suffix, LOG_SEGMENT_SUFFIX) == 0) {
+            uint64_t first_seq = strtoull(dir_entry->d_name, NULL, 10);
+            if (first_seq > 0) {
+                first_seqs.push_back(first_seq);
+            }
+        }
+    }
+
+    closedir(dir_stream);
+    std::sort(first_seqs.begin(), first_seqs.end());
+
+    // Recover them in order, dropping the ones left without any record
+    for (uint64_t first_seq : first_seqs) {
+        log_segment segment;
+        if (open_segment(first_seq, segment) < 0) {
+            return -1;
+        }
+
+        int count = recover_segment(segment);
+        if (count == 0) {
+            munmap(segment.map, LOG_SEGMENT_SIZE);
+            close(segment.fd);
+            unlink(segment.path.c_str());
+            continue;
+        }
+
+        stats.recovered += count;
+        total_bytes += segment.size;
+        next_seq = segment.last_seq + 1;
+        segments.push_back(segment);
+    }
+
+    // Start a fresh segment to append to
+    return roll();
+}
+
+int MessageLog::roll() {
+    log_segment segment;
+    if (open_segment(next_seq, segment) < 0) {
+        return -1;
+    }
+
+    segments.push_back(segment);
+    return 0;
+}
+
+void MessageLog::remove_oldest() {
+    log_segment &oldest = segments.front();
+
+    munmap(oldest.map, LOG_SEGMENT_SIZE);
+    close(oldest.fd);
+    unlink(oldest.path.c_str());
+
+    total_bytes -= oldest.size;
+    stats.segments_removed++;
+    segments.pop_front();
+}
+
+int MessageLog::append(const char *data, const uint32_t len,
+        uint64_t &seq) {
+    size_t size = record_size(len);
+    if (size > LOG_SEGMENT_SIZE) {
+        return -1;
+    }
+
+    // Start a new segment if the record doesn't fit, then let retention
+    // remove the old ones
+    if (segments.back().size + size > LOG_SEGMENT_SIZE) {
+        if (roll() < 0) {
+            return -1;
+        }
+
+        trim(0);
+    }
+
+    log_segment &segment = segments.back();
+
+    log_record_header header;
+    header.seq = next_seq;
+    header.time_ms = now_ms();
+    header.len = len;
+    header.checksum = record_checksum(header.seq, data, len);
+
+    // Write the header, the data and the padding at once
+    static const char padding[LOG_RECORD_ALIGN] = {0};
+    iovec iov[3];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+    iov[2].iov_base = (void *)padding;
+    iov[2].iov_len = size - sizeof(header) - len;
+
+    ssize_t written = pwritev(segment.fd, iov, 3, segment.size);
+    if (written != (ssize_t)size) {
+        fprintf(stderr, "Error appending to log segment %s.\n",
+            segment.path.c_str());
+        return -1;
+    }
+
+    segment.size += size;
+    segment.last_seq = header.seq;
+    segment.last_time_ms = header.time_ms;
+    total_bytes += size;
+
+    stats.appended++;
+    stats.appended_bytes += len;
+
+    seq = next_seq++;
+    return 0;
+}
+
+log_segment *MessageLog::find_segment(const uint64_t seq) {
+    // Readers are usually close to the end, so search from there
+    for (auto it = segments.rbegin(); it != segments.rend(); ++it) {
+        if (it->first_seq <= seq) {
+            return &*it;
+        }
+    }
+
+    return NULL;
+}
+
+void MessageLog::seek(log_position &pos, const uint64_t seq) const {
+    pos.seq = std::max(seq, first_seq());
+    pos.segment_seq = 0;
+    pos.offset = 0;
+}
+
+int MessageLog::next(log_position &pos, log_entry &entry) {
+    if (pos.seq >= next_seq) {
+        return 0;
+    }
+
+    // Resume where the last read stopped, unless its segment was removed
+    log_segment *segment = NULL;
+    if (pos.segment_seq != 0) {
+        segment = find_segment(pos.segment_seq);
+        if (segment && segment->first_seq != pos.segment_seq) {
+            segment = NULL;
+        }
+    }
+
+    if (!segment) {
+        pos.seq = std::max(pos.seq, first_seq());
+        segment = find_segment(pos.seq);
+        if (!segment) {
+            return 0;
+        }
+
+        pos.segment_seq = segment->first_seq;
+        pos.offset = 0;
+    }
+
+    while (true) {
+        // Move on to the next segment once this one was read
+        if (pos.offset >= segment->size) {
+            log_segment *following = NULL;
+            for (size_t i = 0; i + 1 < segments.size(); ++i) {
+                if (&segments[i] == segment) {
+                    following = &segments[i + 1];
+                }
+            }
+
+            if (!following) {
+                return 0;
+            }
+
+            segment = following;
+
+            pos.segment_seq = segment->first_seq;
+            pos.offset = 0;
+            continue;
+        }
+
+        const log_record_header *header =
+            (const log_record_header *)(segment->map + pos.offset);
+        pos.offset += record_size(header->len);
+
+        // Skip the records before the wanted one
+        if (header->seq < pos.seq) {
+            continue;
+        }
+
+        entry.seq = header->seq;
+        entry.time_ms = header->time_ms;
+        entry.data = (const char *)(header + 1);
+        entry.len = header->len;
+
+        pos.seq = header->seq + 1;
+        return 1;
+    }
+}
+
+void MessageLog::trim(const uint64_t needed_seq) {
+    int64_t oldest_allowed = now_ms() - retention_ms;
+
+    // The segment being appended to is always kept
+    while (segments.size() > 1) {
+        const log_segment &oldest = segments.front();
+        bool too_large = total_bytes > retention_bytes;
+        bool too_old = retention_ms > 0 &&
+            oldest.last_time_ms < oldest_allowed;
+        bool not_needed = oldest.last_seq < needed_seq;
+
+        if (!too_large && !too_old && !not_needed) {
+            break;
+        }
+
+        remove_oldest();
+    }
+}
+
+uint64_t MessageLog::first_seq() const {
+    return segments.empty() ? next_seq : segments.front().first_seq;
+}
+
+uint64_t MessageLog::end_seq() const {
+    return next_seq;
+}
+
+size_t MessageLog::bytes() const {
+    return total_bytes;
+}
+
+size_t MessageLog::segment_count() const {
+    return segments.size();
+}
+
+const log_counters &MessageLog::counters() const {
+    return stats;
+}
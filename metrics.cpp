@@ -0,0 +1,284 @@
+#include <cstring>
+#include <cstdio>
+#include <cstdarg>
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "include/metrics.h"
+
+#define METRICS_REQUEST_LEN 4096
+#define METRICS_TIMEOUT_S 1
+
+MetricHistogram::MetricHistogram()
+        : counts(new std::atomic<uint64_t>[HISTOGRAM_BUCKETS]) {
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        counts[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+MetricHistogram::~MetricHistogram() {
+    delete[] counts;
+}
+
+void MetricsRegistry::add(const char *name, const char *help,
+        const metric_type type, const double scale, const std::string &labels,
+        const void *metric) {
+    for (metric_family &family : families) {
+        if (family.name == name) {
+            family.series.push_back({labels, metric});
+            return;
+        }
+    }
+
+    families.push_back({name, help, type, scale, {{labels, metric}}});
+}
+
+/**
+ * @brief Appends formatted text to a string.
+ *
+ * @param out the string
+ * @param format the format, as for printf()
+ */
+static void append(std::string &out, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void append(std::string &out, const char *format, ...) {
+    char line[256];
+
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (len > 0) {
+        out.append(line, std::min((size_t)len, sizeof(line) - 1));
+    }
+}
+
+/**
+ * @brief Renders a histogram's buckets, one at each power of two, counting
+ *   the values below it, then its sum and count.
+ *
+ * @param out where to append the text
+ * @param family the histogram's family
+ * @param series the histogram
+ */
+static void render_histogram(std::string &out, const metric_family &family,
+        const metric_series &series) {
+    const MetricHistogram *histogram =
+        (const MetricHistogram *)series.metric;
+    const char *separator = series.labels.empty() ? "" : ",";
+
+    // The count is summed from the buckets read, so that it matches them
+    // even while values are being recorded
+    uint64_t seen = 0;
+    size_t bucket = 0;
+    for (int bits = 0; bits <= HISTOGRAM_MAX_BITS; ++bits) {
+        size_t bound = histogram_bucket(1ULL << bits);
+        if (bits == HISTOGRAM_MAX_BITS) {
+            bound = HISTOGRAM_BUCKETS;
+        }
+
+        for (; bucket < bound; ++bucket) {
+            seen += histogram->bucket_count(bucket);
+        }
+
+        append(out, "%s_bucket{%s%sle=\"%.9g\"} %lu\n", family.name.c_str(),
+            series.labels.c_str(), separator,
+            (double)(1ULL << bits) * family.scale, seen);
+    }
+
+    append(out, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", family.name.c_str(),
+        series.labels.c_str(), separator, seen);
+
+    const char *open = series.labels.empty() ? "" : "{";
+    const char *close = series.labels.empty() ? "" : "}";
+    append(out, "%s_sum%s%s%s %.9g\n", family.name.c_str(), open,
+        series.labels.c_str(), close,
+        (double)histogram->values_sum() * family.scale);
+    append(out, "%s_count%s%s%s %lu\n", family.name.c_str(), open,
+        series.labels.c_str(), close, seen);
+}
+
+void MetricsRegistry::render(std::string &out) const {
+    static const char *TYPE_NAMES[] = {"counter", "gauge", "histogram"};
+
+    for (const metric_family &family : families) {
+        append(out, "# HELP %s %s\n", family.name.c_str(),
+            family.help.c_str());
+        append(out, "# TYPE %s %s\n", family.name.c_str(),
+            TYPE_NAMES[family.type]);
+
+        for (const metric_series &series : family.series) {
+            if (family.type == METRIC_HISTOGRAM) {
+                render_histogram(out, family, series);
+                continue;
+            }
+
+            out += family.name;
+            if (!series.labels.empty()) {
+                out += "{" + series.labels + "}";
+            }
+
+            if (family.type == METRIC_COUNTER) {
+                append(out, " %lu\n",
+                    ((const Counter *)series.metric)->value());
+            } else {
+                append(out, " %ld\n",
+                    ((const Gauge *)series.metric)->value());
+            }
+        }
+    }
+}
+
+MetricsServer::MetricsServer(const MetricsRegistry &registry)
+        : registry(registry), listen_fd(-1), stop_fd(-1) {}
+
+MetricsServer::~MetricsServer() {
+    stop();
+}
+
+int MetricsServer::start(const uint16_t port) {
+    // Only answer on the loopback interface, as nothing is authenticated
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        fprintf(stderr, "Error creating the metrics socket.\n");
+        return -1;
+    }
+
+    int enable = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(listen_fd, (sockaddr *)&address, sizeof(address)) < 0 ||
+            listen(listen_fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "Error listening for metrics on port %hu.\n", port);
+        return -1;
+    }
+
+    // Create the wakeup which tells the thread to stop
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (stop_fd < 0) {
+        fprintf(stderr, "Error creating the metrics wakeup.\n");
+        return -1;
+    }
+
+    thread = std::thread(&MetricsServer::run, this);
+    return 0;
+}
+
+void MetricsServer::stop() {
+    if (thread.joinable()) {
+        uint64_t one = 1;
+        if (write(stop_fd, &one, sizeof(one)) < 0) {
+            fprintf(stderr, "Error stopping the metrics thread.\n");
+        }
+
+        thread.join();
+    }
+
+    if (listen_fd != -1) {
+        close(listen_fd);
+        listen_fd = -1;
+    }
+
+    if (stop_fd != -1) {
+        close(stop_fd);
+        stop_fd = -1;
+    }
+}
+
+void MetricsServer::run() {
+    pollfd fds[2];
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = stop_fd;
+    fds[1].events = POLLIN;
+
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            fprintf(stderr, "Error waiting for metrics requests.\n");
+            return;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            return;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                answer(fd);
+                close(fd);
+            }
+        }
+    }
+}
+
+void MetricsServer::answer(const int fd) {
+    // Don't let a stalled scraper hold the thread up
+    timeval timeout = {METRICS_TIMEOUT_S, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // Read the request up to the end of its headers
+    char request[METRICS_REQUEST_LEN + 1];
+    size_t len = 0;
+    while (len < METRICS_REQUEST_LEN) {
+        ssize_t n = recv(fd, request + len, METRICS_REQUEST_LEN - len, 0);
+        if (n <= 0) {
+            return;
+        }
+
+        len += n;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+            break;
+        }
+    }
+
+    request[len] = '\0';
+
+    std::string body;
+    const char *status = "200 OK";
+    if (strncmp(request, "GET /metrics ", 13) == 0 ||
+            strncmp(request, "GET / ", 6) == 0) {
+        registry.render(body);
+    } else {
+        status = "404 Not Found";
+        body = "Only GET /metrics is served.\n";
+    }
+
+    std::string response;
+    append(response, "HTTP/1.1 %s\r\nContent-Type: text/plain; "
+        "version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+        status, body.size());
+    response += body;
+
+    // Write the whole response, or give up on the scraper
+    size_t written = 0;
+    while (written < response.size()) {
+        ssize_t n = send(fd, response.data() + written,
+            response.size() - written, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return;
+        }
+
+        written += n;
+    }
+}
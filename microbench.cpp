@@ -0,0 +1,663 @@
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <new>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <random>
+#include <algorithm>
+#include <unistd.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include "include/utils.h"
+#include "include/frame_decoder.h"
+#include "include/protocol_v2.h"
+#include "include/format.h"
+#include "include/topic_table.h"
+#include "include/topic_trie.h"
+#include "include/msg_pool.h"
+#include "include/lz_block.h"
+#include "include/metrics.h"
+
+/*
+ * Microbenchmarks of the primitives on the message path, each run in
+ * isolation over the same realistic mix of messages. Each benchmark prints
+ * one JSON object per line, so runs can be compared between commits:
+ *
+ *   {"name":"...","ops":...,"ns_per_op":...,"allocs_per_op":...,
+ *    "bytes_per_op":...}
+ *
+ * where the allocations are the calls to operator new made while timing,
+ * and bytes_per_op is how many bytes of input one operation handles.
+ */
+
+#define MIX_MESSAGES 1024
+#define MIX_TOPICS 256
+#define FRAGMENT_MAX_CHUNK 150
+#define TABLE_TOPICS 10000
+#define DEFAULT_MIN_MS 200
+
+// Calls to operator new, and their bytes, since the program started
+static uint64_t allocations;
+static uint64_t allocated_bytes;
+
+// The replacements below aren't inlined, or the compiler sees free() meet
+// memory from operator new and warns about it
+__attribute__((noinline)) void *operator new(size_t size) {
+    ++allocations;
+    allocated_bytes += size;
+
+    void *ptr = malloc(size == 0 ? 1 : size);
+    if (ptr == NULL) {
+        throw std::bad_alloc();
+    }
+
+    return ptr;
+}
+
+__attribute__((noinline)) void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+__attribute__((noinline)) void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+__attribute__((noinline)) void operator delete[](void *ptr) noexcept {
+    free(ptr);
+}
+
+__attribute__((noinline))
+void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+
+__attribute__((noinline))
+void operator delete[](void *ptr, size_t) noexcept {
+    free(ptr);
+}
+
+// Keeps the results alive, so the timed work isn't optimized away
+static volatile uint64_t sink;
+
+static const char *filter = NULL;
+static int64_t min_ns = DEFAULT_MIN_MS * 1000000LL;
+
+/**
+ * @brief Times a benchmark and prints its result. The benchmark runs a
+ *   growing number of operations until a run lasts long enough.
+ *
+ * @param name the benchmark's name
+ * @param bytes_per_op how many bytes of input one operation handles
+ * @param run runs a number of operations
+ */
+template <typename F>
+static void measure(const char *name, const double bytes_per_op, F &&run) {
+    if (filter != NULL && strstr(name, filter) == NULL) {
+        return;
+    }
+
+    // Warm the caches, and whatever is allocated lazily, up
+    run(1000);
+
+    uint64_t ops = 1000;
+    while (true) {
+        uint64_t start_allocations = allocations;
+        int64_t start = monotonic_ns();
+        run(ops);
+        int64_t elapsed = monotonic_ns() - start;
+
+        if (elapsed >= min_ns) {
+            printf("{\"name\":\"%s\",\"ops\":%lu,\"ns_per_op\":%.2f,"
+                "\"allocs_per_op\":%.4f,\"bytes_per_op\":%.1f}\n", name, ops,
+                (double)elapsed / ops,
+                (double)(allocations - start_allocations) / ops,
+                bytes_per_op);
+            return;
+        }
+
+        // Aim a bit past the minimum time, from what this run took
+        uint64_t next = elapsed <= 0 ? ops * 10 :
+            (uint64_t)(ops * 1.2 * min_ns / elapsed);
+        ops = std::min(std::max(next, ops * 2), ops * 100);
+    }
+}
+
+/**
+ * @brief A realistic mix of datagrams: topics of a few levels, mostly
+ *   numbers, and strings of varying lengths.
+ *
+ */
+struct message_mix {
+    std::vector<udp_to_server_msg> datagrams;
+    std::vector<int> datagram_lens;
+
+    // The same messages, framed for the subscribers
+    std::vector<server_to_client_msg> framed;
+    std::vector<int> content_lens;
+
+    // The topics used, zero padded
+    std::vector<topic_key> topics;
+};
+
+/**
+ * @brief Builds the mix of messages.
+ *
+ * @param mix the mix
+ */
+static void build_mix(message_mix &mix) {
+    std::mt19937 random(42);
+
+    for (int i = 0; i < MIX_TOPICS; ++i) {
+        char name[MAX_TOPIC_LEN + 1];
+        snprintf(name, sizeof(name), "upb/precis/%d/%s", i / 4,
+            i % 4 == 0 ? "temperature" : i % 4 == 1 ? "humidity" :
+            i % 4 == 2 ? "pressure" : "status");
+        mix.topics.push_back(make_topic_key(name));
+    }
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_addr.s_addr = htonl(0x0a000001);
+    address.sin_port = htons(5000);
+
+    mix.datagrams.resize(MIX_MESSAGES);
+    mix.framed.resize(MIX_MESSAGES);
+    for (int i = 0; i < MIX_MESSAGES; ++i) {
+        udp_to_server_msg &datagram = mix.datagrams[i];
+        memset(&datagram, 0, sizeof(datagram));
+        memcpy(datagram.topic, mix.topics[random() % MIX_TOPICS].name,
+            MAX_TOPIC_LEN);
+
+        // 40% INT, 20% SHORT_REAL, 20% FLOAT, 20% STRING
+        int kind = random() % 10;
+        int content_len;
+        if (kind < 4) {
+            datagram.data_type = UDP_INT;
+            datagram.content[0] = random() % 2;
+            uint32_t value = htonl(random() % 100000);
+            memcpy(datagram.content + 1, &value, sizeof(value));
+            content_len = 5;
+        } else if (kind < 6) {
+            datagram.data_type = UDP_SHORT_REAL;
+            uint16_t value = htons(random() % 10000);
+            memcpy(datagram.content, &value, sizeof(value));
+            content_len = 2;
+        } else if (kind < 8) {
+            datagram.data_type = UDP_FLOAT;
+            datagram.content[0] = random() % 2;
+            uint32_t value = htonl(random());
+            memcpy(datagram.content + 1, &value, sizeof(value));
+            datagram.content[5] = random() % 8;
+            content_len = 6;
+        } else {
+            datagram.data_type = UDP_STRING;
+            content_len = 10 + random() % 190;
+            for (int j = 0; j < content_len; ++j) {
+                datagram.content[j] = 'a' + random() % 26;
+            }
+        }
+
+        int datagram_len = MAX_TOPIC_LEN + 1 + content_len;
+        mix.datagram_lens.push_back(datagram_len);
+
+        int framed_len = framed_content_len(datagram, datagram_len);
+        frame_datagram(&mix.framed[i], datagram, datagram_len, framed_len,
+            address);
+        mix.content_lens.push_back(framed_len);
+    }
+}
+
+/**
+ * @brief Framing of received datagrams, as the server does for each one:
+ *   the content length, a pooled buffer, and the copy into it.
+ *
+ */
+static void bench_ingest(const message_mix &mix) {
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+
+    double bytes = 0;
+    for (int len : mix.datagram_lens) {
+        bytes += len;
+    }
+
+    measure("ingest_frame_datagram", bytes / MIX_MESSAGES, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            const udp_to_server_msg &datagram =
+                mix.datagrams[i % MIX_MESSAGES];
+            int len = mix.datagram_lens[i % MIX_MESSAGES];
+
+            int content_len = framed_content_len(datagram, len);
+            MsgRef ref(MsgPool::local().alloc(UDP_HDR_LEN + content_len));
+            frame_datagram(ref.msg(), datagram, len, content_len, address);
+            sink = ref.msg()->len;
+        }
+    });
+}
+
+/**
+ * @brief Decoding of the legacy stream a subscriber receives, handed over
+ *   whole, then in small random chunks.
+ *
+ */
+static void bench_decode(const message_mix &mix) {
+    // Lay the frames out back to back, as on the wire
+    std::vector<char> stream;
+    for (int i = 0; i < MIX_MESSAGES; ++i) {
+        const char *frame = (const char *)&mix.framed[i];
+        stream.insert(stream.end(), frame, frame + UDP_HDR_LEN +
+            mix.content_lens[i]);
+    }
+
+    std::mt19937 random(7);
+    std::vector<size_t> chunks;
+    for (size_t pos = 0; pos < stream.size(); ) {
+        size_t chunk = std::min(stream.size() - pos,
+            (size_t)(1 + random() % FRAGMENT_MAX_CHUNK));
+        chunks.push_back(chunk);
+        pos += chunk;
+    }
+
+    double bytes = (double)stream.size() / MIX_MESSAGES;
+
+    // One operation is one frame. Each decoder keeps its place in the
+    // stream between runs, since a run can stop in the middle of a frame.
+    // Only the time is measured, test_frame_decoder checks the frames
+    auto decode = [&](FrameDecoder &decoder, size_t &pos, size_t &chunk,
+            uint64_t n, bool fragmented) {
+        uint64_t frames = 0;
+        frame_view frame;
+
+        while (frames < n) {
+            size_t len = stream.size() - pos;
+            if (fragmented) {
+                len = std::min(len, chunks[chunk]);
+                chunk = (chunk + 1) % chunks.size();
+            }
+
+            pos += decoder.feed(stream.data() + pos, len);
+
+            int ret;
+            while ((ret = decoder.next(frame)) == 1) {
+                sink = frame.len;
+                ++frames;
+            }
+
+            if (ret < 0) {
+                fprintf(stderr, "Malformed stream\n");
+                exit(-1);
+            }
+
+            if (pos == stream.size()) {
+                pos = 0;
+            }
+        }
+    };
+
+    FrameDecoder whole(CLIENT_DECODER_CAPACITY, sizeof(server_to_client_msg));
+    size_t whole_pos = 0;
+    size_t whole_chunk = 0;
+    measure("decode_legacy_whole", bytes, [&](uint64_t n) {
+        decode(whole, whole_pos, whole_chunk, n, false);
+    });
+
+    FrameDecoder fragmented(CLIENT_DECODER_CAPACITY,
+        sizeof(server_to_client_msg));
+    size_t fragmented_pos = 0;
+    size_t fragmented_chunk = 0;
+    measure("decode_legacy_fragmented", bytes, [&](uint64_t n) {
+        decode(fragmented, fragmented_pos, fragmented_chunk, n, true);
+    });
+}
+
+/**
+ * @brief Encoding and decoding of compact frames, and the compression of
+ *   batches of them.
+ *
+ */
+static void bench_protocol_v2(const message_mix &mix) {
+    // Encode every message once, as the frames a batch would hold
+    std::vector<char> frames;
+    for (int i = 0; i < MIX_MESSAGES; ++i) {
+        wire_frame frame;
+        encode_v2_message(&mix.framed[i], UDP_HDR_LEN + mix.content_lens[i],
+            1 + i % MIX_TOPICS, true, frame);
+        frames.insert(frames.end(), frame.header,
+            frame.header + frame.header_len);
+        frames.insert(frames.end(), frame.tail, frame.tail + frame.tail_len);
+    }
+
+    measure("encode_v2_message", (double)frames.size() / MIX_MESSAGES,
+            [&](uint64_t n) {
+        wire_frame frame;
+        for (uint64_t i = 0; i < n; ++i) {
+            int index = i % MIX_MESSAGES;
+            encode_v2_message(&mix.framed[index],
+                UDP_HDR_LEN + mix.content_lens[index], 1 + index % MIX_TOPICS,
+                true, frame);
+            sink = frame.header_len;
+        }
+    });
+
+    measure("decode_v2_frame", (double)frames.size() / MIX_MESSAGES,
+            [&](uint64_t n) {
+        size_t pos = 0;
+        for (uint64_t i = 0; i < n; ++i) {
+            if (pos == frames.size()) {
+                pos = 0;
+            }
+
+            uint32_t len;
+            int prefix = get_varint(frames.data() + pos, frames.size() - pos,
+                len);
+
+            v2_message msg;
+            decode_v2_frame(frames.data() + pos + prefix, len, true, msg);
+            sink = msg.content_len;
+            pos += prefix + len;
+        }
+    });
+
+    // Batches as large as the server's default
+    size_t batch_len = std::min(frames.size(), (size_t)DEFAULT_BATCH_BYTES);
+    std::vector<char> compressed(lz_compress_bound(batch_len));
+    std::vector<char> decompressed(batch_len);
+    size_t compressed_len = lz_compress(frames.data(), batch_len,
+        compressed.data());
+
+    measure("lz_compress_batch", batch_len, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            sink = lz_compress(frames.data(), batch_len, compressed.data());
+        }
+    });
+
+    measure("lz_decompress_batch", batch_len, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            sink = lz_decompress(compressed.data(), compressed_len,
+                decompressed.data(), batch_len);
+        }
+    });
+}
+
+/**
+ * @brief Formats a message the way the subscriber did with printf(), to
+ *   compare the formatting engine against.
+ *
+ * @param msg the message
+ * @param content_len how many bytes of content the message has
+ * @param out where to write
+ * @return size_t - how many bytes were written
+ */
+static size_t format_message_printf(const server_to_client_msg &msg,
+        const size_t content_len, char *out) {
+    char topic[MAX_TOPIC_LEN + 1];
+    memset(topic, 0, sizeof(topic));
+    memcpy(topic, msg.topic, MAX_TOPIC_LEN);
+
+    char content[MAX_CONTENT_LEN + 1];
+    memset(content, 0, sizeof(content));
+    const char *data_type = "";
+
+    switch (msg.data_type) {
+        case UDP_INT:
+            sprintf(content, msg.content.udp_int.sign ? "-%u" : "%u",
+                ntohl(msg.content.udp_int.data));
+            data_type = UDP_INT_STR;
+            break;
+
+        case UDP_SHORT_REAL:
+            sprintf(content, "%.2f",
+                (float)ntohs(msg.content.udp_short_real.data) / 100.0f);
+            data_type = UDP_SHORT_REAL_STR;
+            break;
+
+        case UDP_FLOAT: {
+            float power = 1.0f;
+            for (int i = 1; i <= msg.content.udp_float.pow_10; ++i) {
+                power *= 10.0f;
+            }
+
+            sprintf(content, msg.content.udp_float.sign ? "-%f" : "%f",
+                1.0f * ntohl(msg.content.udp_float.data) / power);
+            data_type = UDP_FLOAT_STR;
+            break;
+        }
+
+        case UDP_STRING:
+            strncpy(content, msg.content.udp_string,
+                std::min((size_t)MAX_CONTENT_LEN, content_len));
+            data_type = UDP_STRING_STR;
+            break;
+    }
+
+    return sprintf(out, "%s:%hu - %s - %s - %s\n",
+        inet_ntoa((in_addr){msg.ip}), ntohs(msg.port), topic, data_type,
+        content);
+}
+
+/**
+ * @brief The subscriber's output formats, against printf().
+ *
+ */
+static void bench_format(const message_mix &mix) {
+    std::vector<char> out(NDJSON_MAX_LINE);
+    address_cache cache;
+    cache.valid = false;
+
+    // The bytes per operation are the bytes written
+    double text_bytes = 0;
+    double ndjson_bytes = 0;
+    double binary_bytes = 0;
+    for (int i = 0; i < MIX_MESSAGES; ++i) {
+        text_bytes += format_message(mix.framed[i], mix.content_lens[i], true,
+            cache, out.data());
+        ndjson_bytes += format_message_ndjson(mix.framed[i],
+            mix.content_lens[i], true, cache, out.data());
+        binary_bytes += format_message_binary(mix.framed[i],
+            mix.content_lens[i], out.data());
+    }
+
+    measure("format_printf", text_bytes / MIX_MESSAGES, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            int index = i % MIX_MESSAGES;
+            sink = format_message_printf(mix.framed[index],
+                mix.content_lens[index], out.data());
+        }
+    });
+
+    measure("format_text", text_bytes / MIX_MESSAGES, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            int index = i % MIX_MESSAGES;
+            sink = format_message(mix.framed[index], mix.content_lens[index],
+                true, cache, out.data());
+        }
+    });
+
+    measure("format_ndjson", ndjson_bytes / MIX_MESSAGES, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            int index = i % MIX_MESSAGES;
+            sink = format_message_ndjson(mix.framed[index],
+                mix.content_lens[index], true, cache, out.data());
+        }
+    });
+
+    measure("format_binary", binary_bytes / MIX_MESSAGES, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            int index = i % MIX_MESSAGES;
+            sink = format_message_binary(mix.framed[index],
+                mix.content_lens[index], out.data());
+        }
+    });
+}
+
+/**
+ * @brief Topic lookups: the interning table the messages' topics are
+ *   looked up in, and the trie of subscriptions, filled with a million
+ *   patterns, wildcards included.
+ *
+ */
+static void bench_topics(const message_mix &mix) {
+    // The same topics, in the interning table and, as a baseline, in the
+    // map of names the server used to look them up in
+    TopicTable table;
+    std::unordered_map<std::string, int> map;
+    std::vector<topic_key> keys;
+    for (int i = 0; i < TABLE_TOPICS; ++i) {
+        char name[MAX_TOPIC_LEN + 1];
+        snprintf(name, sizeof(name), "upb/precis/%d/temperature", i);
+        keys.push_back(make_topic_key(name));
+        map[name] = table.intern(keys.back().name);
+    }
+
+    // As the server did, a string is built from the framed topic for each
+    // lookup
+    auto map_lookup = [&](const char *topic) {
+        auto found = map.find(std::string(topic,
+            strnlen(topic, MAX_TOPIC_LEN)));
+        return found == map.end() ? -1 : found->second;
+    };
+
+    measure("topic_map_lookup", MAX_TOPIC_LEN, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            sink = map_lookup(keys[(i * 7919) % TABLE_TOPICS].name);
+        }
+    });
+
+    measure("topic_map_lookup_framed", MAX_TOPIC_LEN, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            sink = map_lookup(mix.framed[i % MIX_MESSAGES].topic);
+        }
+    });
+
+    measure("topic_table_lookup", MAX_TOPIC_LEN, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            sink = table.lookup(keys[(i * 7919) % TABLE_TOPICS].name);
+        }
+    });
+
+    // The topics of the mix, only a quarter of which were added
+    measure("topic_table_lookup_framed", MAX_TOPIC_LEN, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            sink = table.lookup(mix.framed[i % MIX_MESSAGES].topic);
+        }
+    });
+
+    if (filter != NULL && strstr("topic_trie_match_1m", filter) == NULL) {
+        return;
+    }
+
+    // A million subscriptions: exact topics, with one in ten using a
+    // wildcard
+    TopicTrie<int> trie;
+    std::vector<std::string> topics;
+    for (int i = 0; i < 1000000; ++i) {
+        char name[MAX_TOPIC_LEN + 1];
+        int site = i % 1000;
+        int device = i / 1000;
+        if (i % 10 == 0) {
+            snprintf(name, sizeof(name), "site%d/+/m%d", site, device % 10);
+        } else if (i % 100 == 1) {
+            snprintf(name, sizeof(name), "site%d/dev%d/*", site, device);
+        } else {
+            snprintf(name, sizeof(name), "site%d/dev%d/m%d", site, device,
+                i % 10);
+            if (topics.size() < MIX_MESSAGES) {
+                topics.push_back(name);
+            }
+        }
+
+        ++trie.insert(name);
+    }
+
+    measure("topic_trie_match_1m", topics[0].size(), [&](uint64_t n) {
+        uint64_t matched = 0;
+        for (uint64_t i = 0; i < n; ++i) {
+            trie.match(topics[i % topics.size()], [&](int &value) {
+                matched += value;
+            });
+        }
+
+        sink = matched;
+    });
+}
+
+/**
+ * @brief The server's instrumentation: what updating a metric costs, and
+ *   reading the clock the latencies are timed with.
+ *
+ */
+static void bench_metrics() {
+    Counter counter;
+    measure("metrics_counter_add", 0, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            counter += i;
+        }
+
+        sink = counter;
+    });
+
+    // Values spread over the whole range, as latencies are
+    MetricHistogram histogram;
+    measure("metrics_histogram_record", 0, [&](uint64_t n) {
+        uint64_t value = 1;
+        for (uint64_t i = 0; i < n; ++i) {
+            histogram.record(value);
+            value = value * 6364136223846793005ULL + 1442695040888963407ULL;
+            value >>= 40;
+        }
+
+        sink = histogram.count();
+    });
+
+    measure("metrics_monotonic_ns", 0, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            sink = monotonic_ns();
+        }
+    });
+}
+
+int main(int argc, char **argv) {
+    // Keep the results in order with anything printed on stderr
+    setvbuf(stdout, NULL, _IONBF, BUFSIZ);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:m:")) != -1) {
+        switch (opt) {
+            case 'f':
+                filter = optarg;
+                break;
+
+            case 'm':
+                if (!is_number(optarg, strlen(optarg)) || atoi(optarg) < 1) {
+                    fprintf(stderr, MICROBENCH_USAGE, argv[0]);
+                    return -1;
+                }
+
+                min_ns = atoll(optarg) * 1000000;
+                break;
+
+            default:
+                fprintf(stderr, MICROBENCH_USAGE, argv[0]);
+                return -1;
+        }
+    }
+
+    if (optind != argc) {
+        fprintf(stderr, MICROBENCH_USAGE, argv[0]);
+        return -1;
+    }
+
+    message_mix mix;
+    build_mix(mix);
+
+    bench_ingest(mix);
+    bench_decode(mix);
+    bench_protocol_v2(mix);
+    bench_format(mix);
+    bench_topics(mix);
+    bench_metrics();
+
+    return 0;
+}
@@ -0,0 +1,135 @@
+#include <iostream>
+#include <cstring>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include "include/msg_pool.h"
+
+// Buffers may outlive the thread which allocated them, so the pools and
+// their slabs are only freed when the process exits
+static std::mutex slabs_mutex;
+static std::vector<std::unique_ptr<char[]>> slabs;
+static std::vector<std::unique_ptr<MsgPool>> pools;
+
+MsgPool::MsgPool() : remote_frees(NULL) {
+    memset(free_lists, 0, sizeof(free_lists));
+    memset(&stats, 0, sizeof(stats));
+}
+
+MsgPool &MsgPool::local() {
+    static thread_local MsgPool *pool = NULL;
+    if (!pool) {
+        pool = new MsgPool;
+
+        std::lock_guard<std::mutex> lock(slabs_mutex);
+        pools.emplace_back(pool);
+    }
+
+    return *pool;
+}
+
+int MsgPool::reclaim_remote_frees() {
+    // Take over the whole stack at once
+    msg_buf *buf = remote_frees.exchange(NULL, std::memory_order_acquire);
+
+    int count = 0;
+    while (buf) {
+        msg_buf *next = buf->next_free;
+        buf->next_free = free_lists[buf->size_class];
+        free_lists[buf->size_class] = buf;
+
+        buf = next;
+        ++count;
+    }
+
+    stats.frees += count;
+    return count;
+}
+
+int MsgPool::grow(const int size_class) {
+    size_t block_size = sizeof(msg_buf) +
+        ((size_t)1 << (MSG_POOL_MIN_SHIFT + size_class));
+    size_t block_count = MSG_POOL_SLAB_SIZE / block_size;
+
+    // Allocate the slab
+    char *slab = new (std::nothrow) char[block_count * block_size];
+    if (!slab) {
+        fprintf(stderr, "Couldn't allocate memory for a message slab.\n");
+        return -1;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(slabs_mutex);
+        slabs.emplace_back(slab);
+    }
+
+    stats.slabs++;
+    stats.slab_bytes += block_count * block_size;
+
+    // Add all of its blocks to the free list
+    for (size_t i = 0; i < block_count; ++i) {
+        msg_buf *buf = new (slab + i * block_size) msg_buf;
+        buf->size_class = size_class;
+        buf->owner = this;
+        buf->next_free = free_lists[size_class];
+        free_lists[size_class] = buf;
+    }
+
+    return 0;
+}
+
+msg_buf *MsgPool::alloc(const size_t len) {
+    // Find the smallest size class that fits the message
+    int size_class = 0;
+    while (size_class < MSG_POOL_CLASSES &&
+            ((size_t)1 << (MSG_POOL_MIN_SHIFT + size_class)) < len) {
+        ++size_class;
+    }
+
+    if (size_class == MSG_POOL_CLASSES) {
+        return NULL;
+    }
+
+    // Take a buffer from its free list, refilling it with the buffers
+    // released by other threads, or else with a new slab
+    if (!free_lists[size_class]) {
+        reclaim_remote_frees();
+    }
+
+    if (!free_lists[size_class] && grow(size_class) < 0) {
+        return NULL;
+    }
+
+    msg_buf *buf = free_lists[size_class];
+    free_lists[size_class] = buf->next_free;
+
+    buf->refs.store(1, std::memory_order_relaxed);
+    buf->len = len;
+    buf->announcement = false;
+    buf->received_ns = 0;
+    stats.allocs++;
+
+    return buf;
+}
+
+void MsgPool::free(msg_buf *buf) {
+    // Return the buffer to its own free list if it's one of ours
+    if (buf->owner == this) {
+        buf->next_free = free_lists[buf->size_class];
+        free_lists[buf->size_class] = buf;
+        stats.frees++;
+        return;
+    }
+
+    // Otherwise, push it on its pool's stack of remote frees
+    MsgPool *owner = buf->owner;
+    msg_buf *top = owner->remote_frees.load(std::memory_order_relaxed);
+    do {
+        buf->next_free = top;
+    } while (!owner->remote_frees.compare_exchange_weak(top, buf,
+        std::memory_order_release, std::memory_order_relaxed));
+}
+
+const pool_counters &MsgPool::counters() const {
+    return stats;
+}
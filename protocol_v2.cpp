@@ -0,0 +1,197 @@
+#include <cstring>
+#include "include/protocol_v2.h"
+
+size_t put_varint(uint32_t value, char *out) {
+    size_t n = 0;
+
+    // Seven bits at a time, the high bit telling whether more follow
+    while (value >= 0x80) {
+        out[n++] = (char)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+
+    out[n++] = (char)value;
+    return n;
+}
+
+int get_varint(const char *data, const size_t len, uint32_t &value) {
+    value = 0;
+
+    for (size_t i = 0; i < VARINT_MAX_LEN; ++i) {
+        if (i == len) {
+            return 0;
+        }
+
+        uint8_t byte = data[i];
+        value |= (uint32_t)(byte & 0x7f) << (7 * i);
+
+        if (!(byte & 0x80)) {
+            return i + 1;
+        }
+    }
+
+    return -1;
+}
+
+void encode_v2_message(const server_to_client_msg *msg, const size_t len,
+        const uint32_t topic_ref, const bool with_address,
+        wire_frame &frame) {
+    // Encode everything after the length first, it decides the length
+    char body[V2_MAX_HEADER_LEN];
+    size_t body_len = put_varint(topic_ref, body);
+    body[body_len++] = msg->data_type;
+
+    if (with_address) {
+        memcpy(body + body_len, &msg->ip, sizeof(msg->ip));
+        body_len += sizeof(msg->ip);
+        memcpy(body + body_len, &msg->port, sizeof(msg->port));
+        body_len += sizeof(msg->port);
+    }
+
+    // The content is the same as in the legacy frame
+    frame.tail = (const char *)msg + UDP_HDR_LEN;
+    frame.tail_len = len - UDP_HDR_LEN;
+
+    frame.header_len = put_varint(body_len + frame.tail_len, frame.header);
+    memcpy(frame.header + frame.header_len, body, body_len);
+    frame.header_len += body_len;
+}
+
+void encode_v2_announce(const uint32_t topic_ref, const char *topic,
+        wire_frame &frame) {
+    char body[VARINT_MAX_LEN + 1];
+    body[0] = V2_ANNOUNCE_REF;
+    size_t body_len = 1 + put_varint(topic_ref, body + 1);
+
+    frame.tail = topic;
+    frame.tail_len = strnlen(topic, MAX_TOPIC_LEN);
+
+    frame.header_len = put_varint(body_len + frame.tail_len, frame.header);
+    memcpy(frame.header + frame.header_len, body, body_len);
+    frame.header_len += body_len;
+}
+
+int decode_v2_frame(const char *body, const size_t len,
+        const bool with_address, v2_message &msg) {
+    uint32_t topic_ref;
+    int n = get_varint(body, len, topic_ref);
+    if (n <= 0) {
+        return -1;
+    }
+
+    size_t pos = n;
+
+    // An announcement carries a reference and the topic it stands for
+    if (topic_ref == V2_ANNOUNCE_REF) {
+        n = get_varint(body + pos, len - pos, msg.topic_ref);
+        if (n <= 0 || msg.topic_ref == V2_ANNOUNCE_REF ||
+                len - pos - n > MAX_TOPIC_LEN) {
+            return -1;
+        }
+
+        pos += n;
+
+        msg.announce = true;
+        msg.topic = body + pos;
+        msg.topic_len = len - pos;
+        return 0;
+    }
+
+    size_t header_len = 1 + (with_address ? 6 : 0);
+    if (len - pos < header_len || len - pos - header_len > MAX_CONTENT_LEN) {
+        return -1;
+    }
+
+    msg.announce = false;
+    msg.topic_ref = topic_ref;
+    msg.data_type = body[pos++];
+
+    if (with_address) {
+        memcpy(&msg.ip, body + pos, sizeof(msg.ip));
+        pos += sizeof(msg.ip);
+        memcpy(&msg.port, body + pos, sizeof(msg.port));
+        pos += sizeof(msg.port);
+    } else {
+        msg.ip = 0;
+        msg.port = 0;
+    }
+
+    msg.content = body + pos;
+    msg.content_len = len - pos;
+    return 0;
+}
+
+size_t v2_batch_bound(const size_t frames_len) {
+    return 2 * VARINT_MAX_LEN + 1 + lz_compress_bound(frames_len);
+}
+
+size_t pack_v2_batch(const char *frames, const size_t len,
+        const bool compress, char *out, size_t &start) {
+    // Leave room for the longest header, which is only known at the end
+    const size_t room = 2 * VARINT_MAX_LEN + 1;
+    char *payload = out + room;
+
+    char header[2 * VARINT_MAX_LEN + 1];
+    size_t header_len = 0;
+    size_t payload_len = 0;
+
+    if (compress) {
+        payload_len = lz_compress(frames, len, payload);
+    }
+
+    // Send the frames as they are when compressing didn't pay off
+    char sizes[VARINT_MAX_LEN];
+    size_t sizes_len = 0;
+    uint8_t kind = V2_BATCH_PLAIN;
+    if (compress && payload_len < len) {
+        kind = V2_BATCH_COMPRESSED;
+        sizes_len = put_varint(len, sizes);
+    } else {
+        memcpy(payload, frames, len);
+        payload_len = len;
+    }
+
+    size_t body_len = 1 + sizes_len + payload_len;
+    header_len = put_varint(body_len, header);
+    header[header_len++] = kind;
+    memcpy(header + header_len, sizes, sizes_len);
+    header_len += sizes_len;
+
+    start = room - header_len;
+    memcpy(out + start, header, header_len);
+
+    return header_len + payload_len;
+}
+
+int unpack_v2_batch(const char *body, const size_t len, char *scratch,
+        const char *&frames, size_t &frames_len) {
+    if (len < 1) {
+        return -1;
+    }
+
+    if ((uint8_t)body[0] == V2_BATCH_PLAIN) {
+        frames = body + 1;
+        frames_len = len - 1;
+        return 0;
+    }
+
+    if ((uint8_t)body[0] != V2_BATCH_COMPRESSED) {
+        return -1;
+    }
+
+    uint32_t raw_len;
+    int n = get_varint(body + 1, len - 1, raw_len);
+    if (n <= 0 || raw_len > MAX_BATCH_LEN) {
+        return -1;
+    }
+
+    int decompressed = lz_decompress(body + 1 + n, len - 1 - n, scratch,
+        raw_len);
+    if (decompressed != (int)raw_len) {
+        return -1;
+    }
+
+    frames = scratch;
+    frames_len = raw_len;
+    return 0;
+}
@@ -1,23 +1,134 @@
 #include <iostream>
 #include <cstring>
 #include <cstdlib>
+#include <cerrno>
 #include <unistd.h>
+#include <fcntl.h>
 #include <queue>
+#include <deque>
 #include <vector>
-#include <memory>
 #include <unordered_map>
+#include <unordered_set>
+#include <thread>
 #include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include "include/utils.h"
 #include "include/defines.h"
+#include "include/event_loop.h"
+#include "include/msg_pool.h"
+#include "include/frame_decoder.h"
+#include "include/spsc_queue.h"
+#include "include/topic_trie.h"
+#include "include/topic_table.h"
+#include "include/message_log.h"
+#include "include/protocol_v2.h"
+#include "include/metrics.h"
+#include "include/trace.h"
+
+struct topic;
+
+struct stored_msg {
+    // The delivery the message was part of, ordering the messages stored
+    // on different topics (or, for a message replayed from the log, its
+    // record's sequence number)
+    uint64_t delivery;
+    MsgRef msg;
+
+    // The message's topic in its shard's topic table, -1 if the topic was
+    // unknown to the shard when the message was stored
+    int topic_id;
+};
+
+struct queued_msg {
+    MsgRef msg;
+
+    // The client's reference to the message's topic in compact frames, 0
+    // for the legacy frames and the announcements
+    uint32_t topic_ref;
+};
 
 struct client {
     std::string id;
     int fd;
-    std::queue<std::shared_ptr<server_to_client_msg>> messages_to_receive;
+
+    // The client's position in its shard's client vector
+    uint32_t index;
+
+    // The topics and patterns the client is subscribed to
+    std::unordered_set<topic *> topics;
+
+    // Messages which weren't written to the socket yet
+    std::deque<queued_msg> outbound;
+    size_t outbound_offset;
+    size_t outbound_bytes;
+    uint64_t dropped;
+
+    // The protocol spoken on the current connection, and, for the compact
+    // one, the reference announced for each topic (by topic ID, 0 if none)
+    uint8_t protocol;
+    uint8_t protocol_flags;
+    std::vector<uint32_t> topic_refs;
+    uint32_t topic_ref_count;
+
+    // For a client which asked for batches: the batch being written and
+    // which part of it is left, when the oldest message waiting for the
+    // next batch must be sent, and whether that's scheduled
+    std::vector<char> batch;
+    size_t batch_offset;
+    size_t batch_end;
+    int64_t batch_deadline_us;
+    bool batch_held;
+
+    // Whether the client must be flushed / waits for writability / is
+    // disconnected at the end of the loop iteration for being too slow
+    bool dirty;
+    bool watching_write;
+    bool closing;
+
+    // The last delivery which reached the client, as several of its
+    // subscriptions may match the same topic
+    uint64_t delivered;
+
+    // The first record of the store & forward log the client may want,
+    // once it's disconnected
+    uint64_t log_cursor;
+
+    // Whether the stored messages are still being sent after a reconnect,
+    // up to which delivery, the last one sent, where the log is read
+    // from, and whether all of them were queued
+    bool replaying;
+    uint64_t replay_until;
+    uint64_t replayed;
+    log_position replay_pos;
+    bool replay_queued;
+
+    // The replayed messages which weren't written yet, oldest first, and
+    // how many of them are in the batch being written. The replay only
+    // ends once they were all written
+    std::deque<stored_msg> unacked;
+    size_t batch_unacked;
+
+    // The live messages which wait for the replay to end, with their
+    // delivery (0 for the cached ones)
+    std::deque<stored_msg> pending_live;
+    size_t pending_bytes;
+
+    // The messages a client which left in the middle of a replay didn't
+    // get, by delivery, replayed along with the topics' backlogs
+    std::deque<stored_msg> unsent;
+
+    // How many bytes are stored for the client, the last delivery stored
+    // once it ran out of budget, and what its budget cost it
+    size_t stored_bytes;
+    uint64_t stored_limit;
+    uint64_t sf_dropped;
+    uint64_t sf_conflated;
 };
 
 struct client_info {
@@ -26,413 +137,3298 @@ struct client_info {
     uint16_t port;
 };
 
-struct subscription {
-    client *subbed_client;
-    bool sf;
+// The cursor of a subscription which doesn't need any stored message
+#define NO_CURSOR UINT64_MAX
+
+struct replay_head {
+    // The delivery of the next message of a topic's backlog to replay, and
+    // the client's subscription to the topic
+    uint64_t delivery;
+    topic *stored_on;
+    uint32_t pos;
+
+    bool operator>(const replay_head &other) const {
+        return delivery > other.delivery;
+    }
 };
 
 struct topic {
-    std::unordered_map<std::string, subscription> subscriptions;
+    // The topic's name, or the pattern
+    std::string name;
+
+    // The subscriptions, as parallel arrays scanned in order on fan-out:
+    // the subbed client's index, its descriptor and the SF flag, and where
+    // the client's backlog starts, once it's disconnected
+    std::vector<uint32_t> client_indexes;
+    std::vector<int> fds;
+    std::vector<uint8_t> sfs;
+    std::vector<uint64_t> cursors;
+
+    // The messages kept for the disconnected SF subscribers, once for all
+    // of them, and the sequence number of the first one
+    std::deque<stored_msg> backlog;
+    uint64_t backlog_start;
+
+    // Whether the topic is among the ones the oldest stored message is
+    // looked for in
+    bool evictable;
+
+    // The last message published on the topic, on the shard which owns it,
+    // sent to new subscribers right away
+    MsgRef last_value;
+
+    // Create a map from a subbed client's index to its position in the
+    // arrays
+    std::unordered_map<uint32_t, uint32_t> positions;
+};
+
+struct ingest_counters {
+    Counter datagrams;
+    Counter bytes;
+    Counter batches;
+    Gauge max_batch;
+    Counter kernel_drops;
+
+    // How many datagrams each call received
+    MetricHistogram batch_sizes;
+};
+
+struct backlog_counters {
+    Counter stored;
+    Counter replayed;
+    Gauge messages;
+    Gauge bytes;
+    Counter dropped;
+    Counter conflated;
+};
+
+struct cache_counters {
+    uint64_t snapshots;
+    uint64_t rejected;
+    size_t bytes;
+};
+
+struct sf_log_counters {
+    uint64_t replayed;
+    uint64_t cursors_behind;
+};
+
+struct outbound_counters {
+    Counter queued;
+    Counter writes;
+    Counter frames_written;
+    Counter bytes_written;
+    Counter dropped;
+    Counter disconnected;
+    Counter batches;
+    Counter batched_bytes;
+    Counter batch_wire_bytes;
+
+    // How long live messages took from their datagram's receipt to their
+    // client's socket (or batch), in nanoseconds, and how many bytes a
+    // client had waiting whenever a message was sent to it
+    MetricHistogram delivery_latency;
+    MetricHistogram client_backlog;
+};
+
+struct shard_counters {
+    Counter connections;
+    Gauge clients_connected;
+
+    // How many messages waited in the shard's mailboxes when it was woken
+    // up, and in its outboxes, for mailboxes which were full
+    Gauge mailbox_messages;
+    Gauge outbox_messages;
+};
+
+enum slow_consumer_policy {
+    SLOW_DROP,
+    SLOW_DISCONNECT
+};
+
+enum sf_overflow_policy {
+    SF_DROP_OLDEST,
+    SF_DROP_NEWEST,
+    SF_CONFLATE,
+    SF_DISCONNECT
+};
+
+struct server_config {
+    uint16_t port;
+    int udp_batch;
+    size_t high_water;
+    slow_consumer_policy slow_policy;
+    size_t sf_client_budget;
+    size_t sf_global_budget;
+    sf_overflow_policy sf_policy;
+    int threads;
+    bool reuse_port;
+    size_t batch_bytes;
+    int64_t batch_delay_us;
+    size_t cache_capacity;
+    const char *log_dir;
+    size_t log_bytes;
+    int64_t log_age_ms;
+    uint16_t metrics_port;
+};
+
+enum shard_msg_type {
+    SHARD_HANDOFF,
+    SHARD_PUBLISH,
+    SHARD_DELIVER,
+    SHARD_INTEREST,
+    SHARD_SNAPSHOT_REQUEST,
+    SHARD_SNAPSHOT,
+    SHARD_STATS,
+    SHARD_STOP
+};
+
+struct shard_msg {
+    shard_msg_type type;
+    msg_buf *buf;
+    void *data;
+};
+
+struct connection_handoff {
+    client_info *info;
+    FrameDecoder *decoder;
+    std::string client_id;
+    uint8_t version;
+    uint8_t flags;
+};
+
+struct interest_update {
+    std::string topic_name;
+    int shard;
+    bool interested;
+};
+
+struct snapshot_request {
+    // The topic or pattern subscribed to, and the subscribed client
+    std::string topic_name;
+    int shard;
+    uint32_t client_index;
+};
+
+class Server;
+
+struct broker {
+    int shard_count;
+    std::vector<Server *> shards;
+
+    // The metrics of every shard
+    MetricsRegistry metrics;
 };
 
 class Server {
+    // This server's shard, and the broker it is a part of
+    int shard_id;
+    broker *shared;
+
+    // The readiness notification engine
+    EventLoop loop;
+
+    // The mailboxes of the shard, one per source shard, and the eventfd
+    // which wakes the shard up when something was posted to them
+    std::vector<SpscQueue<shard_msg> *> inboxes;
+    int wake_fd;
+
+    // Messages which didn't fit in their target's mailbox yet, and the
+    // targets to wake up at the end of the current iteration
+    std::vector<std::deque<shard_msg>> outboxes;
+    std::vector<bool> wake_targets;
+
+    // Whether the shard's loop should stop
+    bool stopping;
+
+    // The listening sockets, only opened by the first shard
+    int tcp_socket;
+    int udp_socket;
+
+    // A spare descriptor, given up to accept (and close) a pending
+    // connection when the process runs out of descriptors
+    int reserve_fd;
+
+    // What the shard's counters are prefixed with
+    char stats_prefix[16];
+
     // Create a map from a file descriptor to a client
     std::unordered_map<int, client *> fd_to_client;
 
     // Create a map from a client ID to the client
     std::unordered_map<std::string, client *> id_to_client;
 
+    // Create a vector from a client's index to the client itself
+    std::vector<client *> clients;
+
     // Create a set of descriptors that need to be initialized
     std::unordered_map<int, client_info *> uninitialized_fds;
 
-    // Create a map from a topic name to the actual topic
-    std::unordered_map<std::string, topic> name_to_topic;
+    // Create a map from a file descriptor to the connection's frame decoder
+    std::unordered_map<int, FrameDecoder *> fd_to_decoder;
+
+    // Create a table giving each topic known to this shard a dense ID
+    TopicTable topic_ids;
+
+    // Create a vector from a topic ID to the subscriptions of this shard's
+    // clients to the topic, and a trie from a pattern to the subscriptions
+    // to the pattern
+    std::deque<topic> id_to_topic;
+    TopicTrie<topic> pattern_to_topic;
+
+    // Create a vector from the ID of a topic owned by this shard to the set
+    // of shards which have subscribers to it, and a trie doing the same for
+    // the patterns
+    std::vector<uint64_t> topic_interest;
+    TopicTrie<uint64_t> pattern_interest;
+
+    // How many messages were delivered to this shard's subscribers
+    uint64_t delivery_count;
+
+    // The disk log of the messages stored for disconnected clients, if
+    // enabled, and where the clients' state is saved
+    MessageLog *sf_log;
+    sf_log_counters sf_log_stats;
+    backlog_counters backlog_stats;
+    std::string state_path;
+
+    // Whether the clients' state changed since it was last saved, and when
+    // that was
+    bool state_dirty;
+    int64_t state_saved_ms;
+
+    // The maximum number of datagrams received with a single call
+    int udp_batch;
+
+    // The ingest ring, one buffer / address / header per batched datagram
+    std::vector<udp_to_server_msg> udp_buffers;
+    std::vector<sockaddr_in> udp_addresses;
+    std::vector<iovec> udp_iovecs;
+    std::vector<mmsghdr> udp_headers;
+
+    // The ancillary data of each datagram, holding the socket's drop count
+    std::vector<char> udp_controls;
+
+    // The publish-side counters
+    ingest_counters ingest_stats;
+
+    // How many bytes may wait in a client's outbound queue, and what
+    // happens to the client once they're exceeded
+    size_t high_water;
+    slow_consumer_policy slow_policy;
+
+    // The subscriber-side counters
+    outbound_counters outbound_stats;
+
+    // The counters of the shard's connections and mailboxes
+    shard_counters shard_stats;
+
+    // The clients which had messages queued during the current iteration
+    std::vector<client *> dirty_clients;
+
+    // The clients to disconnect at the end of the current iteration, as
+    // their descriptors, decoders and states may still be in use until then
+    std::vector<client *> closing_clients;
+
+    // The clients whose stored messages are still being sent
+    std::vector<client *> replaying_clients;
+
+    // How many bytes of frames make a batch, and how long a message may
+    // wait for its batch to fill up, for the clients which asked for them
+    size_t batch_bytes;
+    int64_t batch_delay_us;
+
+    // The clients waiting for a batch deadline, the timer which goes off
+    // at the earliest one, and where batches are put together
+    std::vector<client *> held_clients;
+    int batch_timer_fd;
+    std::vector<char> batch_frames;
+
+    // How many bytes may be stored for a client, and for all of them (this
+    // shard's share), and what happens once that's exceeded
+    size_t sf_client_budget;
+    size_t sf_global_budget;
+    sf_overflow_policy sf_policy;
+
+    // How many topics may have their last message cached, the ones which
+    // do, and the cache's counters
+    size_t cache_capacity;
+    std::vector<int> cached_topics;
+    cache_counters cache_stats;
+
+    // The topics holding stored messages, by the delivery of their oldest
+    // one, possibly outdated
+    typedef std::pair<uint64_t, topic *> eviction_entry;
+    std::priority_queue<eviction_entry, std::vector<eviction_entry>,
+        std::greater<eviction_entry>> evictable_topics;
 
     /**
-     * @brief Sends a given message to the client.
+     * @brief Lays out a queued message the way the client's protocol frames
+     *   it. Legacy frames are the message buffer itself, compact ones an
+     *   encoded header followed by the buffer's content.
      * 
-     * @param client_fd the client to send to
-     * @param msg the message to send
-     * @return int - the error code
+     * @param cl the client
+     * @param queued the message, with its topic's reference
+     * @param frame the frame
      */
-    int send_to_client(const int client_fd, const server_to_client_msg *msg) {
-        // Send the message to the client
-        int err = send(client_fd, (char *)msg, ntohs(msg->len), 0);
-        if (err < 0) {
-            fprintf(stderr, "Error sending message to client.\n");
-            return -1;
+    void frame_message(const client *cl, const queued_msg &queued,
+            wire_frame &frame) {
+        const MsgRef &msg = queued.msg;
+        if (cl->protocol == PROTOCOL_V1) {
+            frame.header_len = 0;
+            frame.tail = msg.data();
+            frame.tail_len = msg.len();
+            return;
         }
 
-        return 0;
+        const server_to_client_msg *framed = msg.msg();
+        if (msg.is_announcement()) {
+            encode_v2_announce(framed->content.udp_int.data, framed->topic,
+                frame);
+            return;
+        }
+
+        // The topic was announced when the message was queued
+        encode_v2_message(framed, msg.len(), queued.topic_ref,
+            !(cl->protocol_flags & V2_NO_ADDRESS), frame);
     }
 
     /**
-     * @brief Subscribes the client to the given topic with the given sf.
+     * @brief Queues the announcement of the message's topic to a client
+     *   speaking the compact protocol, unless it was already announced.
      * 
-     * @param client_fd the client to subscribe
-     * @param topic_name the topic to subscribe to
-     * @param sf the store & forward value
+     * @param cl the client
+     * @param msg the message
+     * @param id the topic's ID, -1 if it wasn't added yet
+     * @param topic_ref where to put the client's reference to the topic
      * @return int - the error code
      */
-    int subscribe_client(const int client_fd,
-            const std::string &topic_name, const bool sf) {
-        // Get the client ID
-        std::string &client_id = fd_to_client[client_fd]->id;
+    int announce_topic(client *cl, const MsgRef &msg, int id,
+            uint32_t &topic_ref) {
+        // A topic only matched by patterns is added the first time it's
+        // announced, after which the deliveries find its ID
+        if (id < 0) {
+            id = topic_ids.intern(msg.msg()->topic);
+        }
 
-        // Attempt to find the client
-        auto &topic_subs = name_to_topic[topic_name].subscriptions;
-        if (topic_subs.find(client_id) != topic_subs.end()) {
-            // The client is already subscribed to the topic, update sf value
-            topic_subs[client_id].sf = sf;
+        if ((size_t)id >= cl->topic_refs.size()) {
+            cl->topic_refs.resize(id + 1, 0);
+        }
 
+        topic_ref = cl->topic_refs[id];
+        if (topic_ref != 0) {
             return 0;
         }
 
-        // If the client is not already subscribed, subscribe him
-        topic_subs[client_id] = {fd_to_client[client_fd], sf};
+        MsgRef announcement(MsgPool::local().alloc(UDP_HDR_LEN +
+            sizeof(uint32_t)));
+        if (!announcement) {
+            return -1;
+        }
+
+        // References start at 1, as 0 marks the announcements
+        topic_ref = cl->topic_refs[id] = ++cl->topic_ref_count;
+
+        // The buffer holds the topic and its reference, and is marked as
+        // an announcement apart from the data types publishers can send
+        server_to_client_msg *framed = announcement.msg();
+        memcpy(framed->topic, msg.msg()->topic, MAX_TOPIC_LEN);
+        framed->content.udp_int.data = topic_ref;
+        announcement.set_announcement();
+
+        push_outbound(cl, announcement, id);
         return 0;
     }
 
     /**
-     * @brief Unsubscribes the client from the given topic.
+     * @brief Appends a message to the client's outbound queue.
      * 
-     * @param client_fd the client to unsubscribe
-     * @param topic_name the topic to unsubscribe from
+     * @param cl the client
+     * @param msg the message
+     * @param topic_id the topic's ID, -1 if it wasn't added yet
      * @return int - the error code
      */
-    int unsubscribe_client(const int client_fd,
-            const std::string &topic_name) {
-        // Get the client ID
-        std::string &client_id = fd_to_client[client_fd]->id;
-
-        // Attempt to find the client
-        auto &topic_subs = name_to_topic[topic_name].subscriptions;
-        if (topic_subs.find(client_id) == topic_subs.end()) {
-            // The client is NOT subscribed to the topic, do nothing
+    int push_outbound(client *cl, const MsgRef &msg, const int topic_id) {
+        // A message whose topic can't be announced can't be sent either
+        queued_msg queued{msg, 0};
+        if (cl->protocol == PROTOCOL_V2 && !msg.is_announcement() &&
+                announce_topic(cl, msg, topic_id, queued.topic_ref) < 0) {
+            cl->dropped++;
             return -1;
         }
-        
-        // Otherwise, delete him
-        topic_subs.erase(client_id);
 
+        // The first message waiting for a batch sets when it must go
+        if ((cl->protocol_flags & V2_BATCH) && cl->outbound.empty()) {
+            cl->batch_deadline_us = monotonic_us() + batch_delay_us;
+        }
+
+        // Count what the message takes on the wire
+        wire_frame frame;
+        frame_message(cl, queued, frame);
+
+        cl->outbound.push_back(queued);
+        cl->outbound_bytes += frame.header_len + frame.tail_len;
+        outbound_stats.queued++;
         return 0;
     }
 
     /**
-     * @brief Initializes the client.
+     * @brief Queues a replayed message, which is kept until it's written.
      * 
-     * @param client_fd the client's file descriptor
-     * @param client_id the client's ID
-     * @return client* - a pointer to the client
+     * @param cl the client
+     * @param stored the message, with its delivery or log record
      */
-    client *initialize_client(const int client_fd,
-            const std::string &client_id) {
-        // Try to find if the client ID already exists
-        if (id_to_client.find(client_id) != id_to_client.end()) {
-            // Set the file descriptor
-            client *cl = id_to_client[client_id];
-            cl->fd = client_fd;
-
-            // Send all the messages in the queue
-            while (!cl->messages_to_receive.empty()) {
-                // Get the message at the front of the queue and send it
-                auto &&msg = cl->messages_to_receive.front();
-                send_to_client(client_fd, msg.get());
-
-                // Pop the message from the queue
-                cl->messages_to_receive.pop();
-            }
+    void push_replayed(client *cl, const stored_msg &stored) {
+        if (push_outbound(cl, stored.msg, stored.topic_id) == 0) {
+            cl->unacked.push_back(stored);
+            update_log_cursor(cl);
+        }
+    }
 
-            return id_to_client[client_id];
+    /**
+     * @brief Forgets a replayed message once it leaves the outbound queue
+     *   for the socket, or marks it as part of the batch being cut.
+     * 
+     * @param cl the client
+     * @param msg the message leaving the outbound queue
+     * @param in_batch whether it goes to a batch, rather than the socket
+     */
+    void ack_written(client *cl, const MsgRef &msg, const bool in_batch) {
+        if (cl->batch_unacked == cl->unacked.size() ||
+                cl->unacked[cl->batch_unacked].msg.data() != msg.data()) {
+            return;
         }
 
-        // Otherwise, create a new client
-        client *new_client = new client;
-        new_client->id = std::string(client_id);
-        new_client->fd = client_fd;
+        // A batch's messages are written along with the whole batch
+        if (in_batch) {
+            cl->batch_unacked++;
+            return;
+        }
 
-        id_to_client[client_id] = new_client;
-        return new_client;
+        cl->unacked.pop_front();
+        update_log_cursor(cl);
     }
 
     /**
-     * @brief Disconnects the client.
+     * @brief Forgets the replayed messages of a batch which was written.
      * 
-     * @param client_to_disconnect - the client to disconnect
+     * @param cl the client
      */
-    void disconnect_client(client *client_to_disconnect) {
-        client_to_disconnect->fd = -1;
+    void ack_batch(client *cl) {
+        cl->unacked.erase(cl->unacked.begin(),
+            cl->unacked.begin() + cl->batch_unacked);
+        cl->batch_unacked = 0;
+        update_log_cursor(cl);
     }
 
     /**
-     * @brief Handles input given in the standard input.
+     * @brief Moves a replaying client's log cursor up to the first record
+     *   which wasn't written yet, which a new replay would start from.
      * 
-     * @return int - the error code
+     * @param cl the client
      */
-    int handle_stdin() {
-        // Read the message from stdin
-        char buffer[BUFLEN + 1];
-        fgets(buffer, BUFLEN, stdin);
-
-        // Remove the final '\n'
-        buffer[strlen(buffer) - 1] = '\0';
-
-        // If the message is "exit", close the server
-        if (strcmp(buffer, EXIT_CMD) == 0) {
-            return -1;
+    void update_log_cursor(client *cl) {
+        if (sf_log && cl->replaying) {
+            cl->log_cursor = cl->unacked.empty() ? cl->replay_pos.seq :
+                cl->unacked.front().delivery;
         }
-
-        // Otherwise, do nothing
-        return 0;
     }
 
     /**
-     * @brief Handles everything received on the TCP socket (clients wanting
-     *   to connect to the server).
+     * @brief Appends a message to the client's outbound queue and marks
+     *   the client for flushing at the end of the loop iteration.
      * 
-     * @param tcp_fd the tcp socket
-     * @return client_info* - information about the client wanting to connect
+     * @param cl the client
+     * @param msg the message to queue
+     * @param topic_id the topic's ID, -1 if it wasn't added yet
      */
-    client_info* handle_tcp_socket(const int tcp_fd) {
-        // Declare variables to store client information
-        sockaddr_in client_address;
-        socklen_t client_length = sizeof(client_address);
+    void queue_to_client(client *cl, const MsgRef &msg, const int topic_id) {
+        push_outbound(cl, msg, topic_id);
 
-        // Accept the client
-        int client_socket = accept(tcp_fd, (struct sockaddr *)&client_address,
-            &client_length);
-        if (client_socket < 0) {
-            fprintf(stderr, "Error accepting client.\n");
-            return NULL;
+        // Remember to flush the client
+        if (!cl->dirty) {
+            cl->dirty = true;
+            dirty_clients.push_back(cl);
         }
+    }
 
-        // Construct new client info
-        client_info *info = (client_info *)malloc(1 * sizeof(client_info));
-        if (!info) {
-            fprintf(stderr, "Error allocating memory for client info.\n");
-            close(client_socket);
-            return NULL;
+    /**
+     * @brief Counts how long a message took from its receipt to its
+     *   client's socket, for the messages received live.
+     * 
+     * @param msg the message
+     * @param now the time it was written, 0 if it was stored meanwhile
+     */
+    void record_delivery(const MsgRef &msg, const int64_t now) {
+        if (now != 0 && msg.received_ns() != 0) {
+            outbound_stats.delivery_latency.record(now - msg.received_ns());
         }
-
-        info->fd = client_socket;
-
-        char *client_addr = inet_ntoa(client_address.sin_addr);
-        strcpy(info->ip, client_addr);
-
-        info->port = ntohs(client_address.sin_port);
-
-        return info;
     }
 
     /**
-     * @brief Handles everything received on the UDP socket
-     *   (messages received from the UDP clients).
+     * @brief Writes as much of the client's outbound queue as the socket
+     *   accepts, coalescing the queued messages into a single sendmsg()
+     *   whose iovecs point straight at the shared message buffers (and at
+     *   the encoded headers of compact frames), and resuming partially
+     *   written messages.
      * 
-     * @param udp_fd the UDP socket
+     * @param cl the client
      * @return int - the error code
      */
-    int handle_udp_socket(const int udp_fd) {
-        // Declare client information
-        sockaddr_in client_address;
-        socklen_t client_len = sizeof(client_address);
+    int flush_client(client *cl) {
+        // Top up the queue with the next stored messages
+        if (cl->replaying) {
+            replay_step(cl);
+        }
 
-        // Receive a message from the UDP clients
-        udp_to_server_msg received_msg;
-        memset(&received_msg, 0, sizeof(received_msg));
-        int n = recvfrom(udp_fd, &received_msg, sizeof(received_msg), 0,
-            (sockaddr *)&client_address, &client_len);
-        if (n < 0) {
+        bool batching = cl->protocol_flags & V2_BATCH;
+        if ((batching ? write_batches(cl) : write_frames(cl)) < 0) {
             return -1;
         }
 
-        // Create the message to send to the client
-        std::shared_ptr<server_to_client_msg> msg_to_send(
-            new server_to_client_msg
-        );
-        memset(msg_to_send.get(), 0, sizeof(*msg_to_send));
-        memcpy(&msg_to_send->ip, (char *)&client_address.sin_addr, 4);
-        memcpy(&msg_to_send->port, (char *)&client_address.sin_port, 2);
-
-        // Extract the message info
-        memcpy(msg_to_send->topic, received_msg.topic, MAX_TOPIC_LEN);
-        msg_to_send->data_type = received_msg.data_type;
-        memcpy(msg_to_send->content.udp_string,
-            received_msg.content, MAX_CONTENT_LEN);
-
-        // Calculate the message length
-        int content_len = 0;
-        switch (msg_to_send->data_type) {
-            case UDP_INT:
-                content_len = sizeof(msg_to_send->content.udp_int);
-                break;
-
-            case UDP_SHORT_REAL:
-                content_len = sizeof(msg_to_send->content.udp_short_real);
-                break;
-
-            case UDP_FLOAT:
-                content_len = sizeof(msg_to_send->content.udp_float);
-                break;
-
-            case UDP_STRING:
-                content_len = strnlen(received_msg.content,
-                    MAX_CONTENT_LEN - 1) + 1;
-                break;
+        // Once the replay was written, the live messages held back follow
+        if (cl->replaying && end_replay(cl) &&
+                (batching ? write_batches(cl) : write_frames(cl)) < 0) {
+            return -1;
         }
 
-        // Update the message's length
-        msg_to_send->len = htons(UDP_HDR_LEN + content_len);
-
-        // Search for the topic and go through all subscribers
-        for (auto& subscription_entry :
-                name_to_topic[std::string(msg_to_send->topic)].subscriptions) {
-            // Get a reference to the subscription
-            auto &sub = subscription_entry.second;
-
-            // Get the client's fd
-            int client_fd = sub.subbed_client->fd;
-
-            // Check if the client is connected
-            if (client_fd != -1) {
-                // Send the message and go to the next subscriber
-                send_to_client(client_fd, msg_to_send.get());
-                continue;
-            }
-
-            // Otherwise, check the SF flag
-            // If it's 1, add the message to the client's queue
-            if (sub.sf == 1) {
-                sub.subbed_client->messages_to_receive.push(msg_to_send);
-            }
+        // Only watch for writability while something is left to write,
+        // which, for batches, is the one being written
+        bool should_watch = batching ? cl->batch_offset < cl->batch_end :
+            !cl->outbound.empty();
+        if (should_watch != cl->watching_write) {
+            cl->watching_write = should_watch;
+            loop.modify(cl->fd, should_watch ?
+                EV_READ | EV_WRITE | EV_EDGE : EV_READ | EV_EDGE);
         }
 
         return 0;
     }
 
     /**
-     * @brief Handles a single message received from the given client.
+     * @brief Writes the client's queued messages, each in its own frame.
      * 
-     * @param msg the message received from the client
-     * @param read_fds the read descriptors
-     * @param client_fd the client's descriptor
+     * @param cl the client
      * @return int - the error code
      */
-    int handle_client_message(const client_to_server_msg* msg,
-            fd_set *read_fds, const int client_fd) {
-        // Check if the file descriptor is uninitialized
-        if (uninitialized_fds.find(client_fd) != uninitialized_fds.end()) {
-            // Save the client ID in a string
-            std::string client_id(msg->client_id.id);
+    int write_frames(client *cl) {
+        iovec iov[MAX_IOVECS];
+        wire_frame frames[MAX_IOVECS];
 
-            // Check if a client with the same ID is already connected
-            if (id_to_client.find(client_id) != id_to_client.end() &&
-                    id_to_client[client_id]->fd != -1) {
-                // Write a message to stdout
-                fprintf(stdout, "Client %s already connected.\n",
-                    client_id.c_str());
+        while (!cl->outbound.empty()) {
+            // Point iovecs at each of the first queued messages, skipping
+            // what was already written of the first one
+            int iov_count = 0;
+            int frame_count = 0;
+            size_t total_len = 0;
+            for (auto it = cl->outbound.begin(); it != cl->outbound.end() &&
+                    iov_count + 2 <= MAX_IOVECS; ++it, ++frame_count) {
+                wire_frame &frame = frames[frame_count];
+                frame_message(cl, *it, frame);
 
-                // Disconnect the current client
-                client_info *client = uninitialized_fds[client_fd];
-                free(client);
-                uninitialized_fds.erase(client_fd);
+                size_t offset = frame_count == 0 ? cl->outbound_offset : 0;
+                if (offset < frame.header_len) {
+                    iov[iov_count].iov_base = frame.header + offset;
+                    iov[iov_count].iov_len = frame.header_len - offset;
+                    total_len += iov[iov_count++].iov_len;
+                    offset = 0;
+                } else {
+                    offset -= frame.header_len;
+                }
 
-                close(client_fd);
-                FD_CLR(client_fd, read_fds);
-                return -1;
+                iov[iov_count].iov_base = (char *)frame.tail + offset;
+                iov[iov_count].iov_len = frame.tail_len - offset;
+                total_len += iov[iov_count++].iov_len;
             }
 
-            // Otherwise, display a connection successful message
-            client_info *client = uninitialized_fds[client_fd];
-            fprintf(stdout, "New client %s connected from %s:%hu.\n",
-                msg->client_id.id, client->ip, client->port);
+            // Write all of them at once
+            msghdr hdr;
+            memset(&hdr, 0, sizeof(hdr));
+            hdr.msg_iov = iov;
+            hdr.msg_iovlen = iov_count;
 
-            // Initialize the client
-            fd_to_client[client_fd] = initialize_client(client_fd, client_id);
-            free(client);
+            ssize_t n;
+            {
+                TRACE_SCOPE("sendmsg");
+                n = sendmsg(cl->fd, &hdr, MSG_NOSIGNAL);
+            }
 
-            uninitialized_fds.erase(client_fd);
-            return 0;
-        }
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    // The socket is full, wait for it to become writable
+                    break;
+                }
 
-        // Check if the client wants to subscribe to / unsubscribe from a topic
-        if (strncmp(msg->client_sub.command,
-                SUB_CMD, strlen(SUB_CMD)) == 0) {
-            // Extract the topic and the SF flag
-            std::string topic(msg->client_sub.topic);
-            bool sf = atoi(msg->client_sub.sf);
+                fprintf(stderr, "Error sending message to client.\n");
+                return -1;
+            }
 
-            // Subscribe the client to the topic
-            subscribe_client(client_fd, topic, sf);
-        } else if (strncmp(msg->client_unsub.command,
-                UNSUB_CMD, strlen(UNSUB_CMD)) == 0) {
-            // Extract the topic
-            std::string topic(msg->client_unsub.topic);
+            outbound_stats.writes++;
+            outbound_stats.bytes_written += n;
+            cl->outbound_bytes -= n;
 
-            // Unsubscribe the client from the topic
-            unsubscribe_client(client_fd, topic);
+            // Pop the fully written messages, timing the live ones
+            int64_t now = cl->replaying ? 0 : monotonic_ns();
+            size_t written = n;
+            for (int i = 0; written > 0; ++i) {
+                size_t remaining = frames[i].header_len +
+                    frames[i].tail_len - cl->outbound_offset;
+                if (written < remaining) {
+                    cl->outbound_offset += written;
+                    break;
+                }
+
+                written -= remaining;
+                record_delivery(cl->outbound.front().msg, now);
+                ack_written(cl, cl->outbound.front().msg, false);
+                cl->outbound.pop_front();
+                cl->outbound_offset = 0;
+                outbound_stats.frames_written++;
+            }
+
+            // A short write means the socket is full
+            if ((size_t)n < total_len) {
+                break;
+            }
         }
 
         return 0;
     }
 
     /**
-     * @brief Handles all messages received from the given client.
+     * @brief Packs the first of the client's queued messages into its next
+     *   batch, up to the batch size.
      * 
-     * @param read_fds - the read descriptors
-     * @param client_fd - the client's descriptor
-     * @return int - the error code
+     * @param cl the client
      */
-    int handle_client(fd_set *read_fds, const int client_fd) {
-        // Receive potentially multiple messages from the client
-        std::vector<char *> messages;
-        int n = recv_messages(client_fd, messages); 
-        if (n < 0) {
-            return -2;
-        }
+    void cut_batch(client *cl) {
+        TRACE_SCOPE("cut_batch");
+        int64_t now = cl->replaying ? 0 : monotonic_ns();
+        size_t frames_len = 0;
+        while (!cl->outbound.empty()) {
+            wire_frame frame;
+            frame_message(cl, cl->outbound.front(), frame);
 
-        if (n == 0) {
-            // If nothing was received, disconnect the client
-            if (fd_to_client.find(client_fd) == fd_to_client.end() ||
-                    fd_to_client[client_fd] == NULL) {
-                // The client was somehow not found
-                fprintf(stderr, "Client not found in the clients list.\n");
-                return -2;
+            // Stop once the batch is full, or before it grows too long
+            size_t frame_len = frame.header_len + frame.tail_len;
+            if (frames_len > 0 && (frames_len >= batch_bytes ||
+                    frames_len + frame_len > MAX_BATCH_LEN)) {
+                break;
             }
 
-            // The client was found, disconnect him
-            fprintf(stdout, "Client %s disconnected.\n",
-                fd_to_client[client_fd]->id.c_str());
+            memcpy(batch_frames.data() + frames_len, frame.header,
+                frame.header_len);
+            memcpy(batch_frames.data() + frames_len + frame.header_len,
+                frame.tail, frame.tail_len);
+            frames_len += frame_len;
 
-            disconnect_client(fd_to_client[client_fd]);
-            fd_to_client.erase(client_fd);
-            close(client_fd);
-            FD_CLR(client_fd, read_fds);
-            return -1;
+            cl->outbound_bytes -= frame_len;
+            record_delivery(cl->outbound.front().msg, now);
+            ack_written(cl, cl->outbound.front().msg, true);
+            cl->outbound.pop_front();
+            outbound_stats.frames_written++;
         }
 
-        // Handle each client message
-        for (char *msg : messages) {
-            handle_client_message((client_to_server_msg *)msg,
-                read_fds, client_fd);
-            delete[] msg;
+        if (cl->batch.empty()) {
+            cl->batch.resize(v2_batch_bound(MAX_BATCH_LEN));
         }
 
-        return 0;
+        size_t start;
+        size_t len = pack_v2_batch(batch_frames.data(), frames_len,
+            cl->protocol_flags & V2_COMPRESS, cl->batch.data(), start);
+
+        cl->batch_offset = start;
+        cl->batch_end = start + len;
+        cl->outbound_bytes += len;
+
+        outbound_stats.batches++;
+        outbound_stats.batched_bytes += frames_len;
+        outbound_stats.batch_wire_bytes += len;
     }
 
     /**
-     * @brief Checks if the descriptor is either
-     *   for STDIN, TCP, UDP or clients.
+     * @brief Writes the client's queued messages in batches, cutting a batch
+     *   once enough bytes are queued, or once the oldest message's deadline
+     *   passed. Until then, the client waits for its deadline.
+     * 
+     * @param cl the client
+     * @return int - the error code
+     */
+    int write_batches(client *cl) {
+        int64_t now = monotonic_us();
+
+        while (true) {
+            if (cl->batch_offset == cl->batch_end) {
+                if (cl->outbound.empty()) {
+                    break;
+                }
+
+                // Nothing is being written, so every byte left is queued
+                if (cl->outbound_bytes < batch_bytes &&
+                        now < cl->batch_deadline_us) {
+                    hold_batch(cl);
+                    break;
+                }
+
+                cut_batch(cl);
+            }
+
+            ssize_t n;
+            {
+                TRACE_SCOPE("send_batch");
+                n = send(cl->fd, cl->batch.data() + cl->batch_offset,
+                    cl->batch_end - cl->batch_offset, MSG_NOSIGNAL);
+            }
+
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    // The socket is full, wait for it to become writable
+                    break;
+                }
+
+                fprintf(stderr, "Error sending message to client.\n");
+                return -1;
+            }
+
+            outbound_stats.writes++;
+            outbound_stats.bytes_written += n;
+            cl->outbound_bytes -= n;
+            cl->batch_offset += n;
+
+            // A short write means the socket is full
+            if (cl->batch_offset < cl->batch_end) {
+                break;
+            }
+
+            ack_batch(cl);
+        }
+
+        return 0;
+    }
+
+    /**
+     * @brief Remembers to flush a client once its batch deadline passes.
+     * 
+     * @param cl the client
+     */
+    void hold_batch(client *cl) {
+        if (!cl->batch_held) {
+            cl->batch_held = true;
+            held_clients.push_back(cl);
+        }
+    }
+
+    /**
+     * @brief Flushes the clients whose batch deadline passed, and sets the
+     *   batch timer to the earliest deadline left.
+     * 
+     */
+    void flush_held_batches() {
+        if (held_clients.empty()) {
+            return;
+        }
+
+        std::vector<client *> held;
+        held.swap(held_clients);
+
+        int64_t now = monotonic_us();
+        for (client *cl : held) {
+            cl->batch_held = false;
+
+            // Skip clients which disconnected or were flushed meanwhile,
+            // or which wait for their socket
+            if (cl->fd == -1 || cl->outbound.empty() || cl->watching_write) {
+                continue;
+            }
+
+            if (cl->batch_deadline_us > now) {
+                hold_batch(cl);
+                continue;
+            }
+
+            if (flush_client(cl) < 0) {
+                close_client(cl->fd);
+            }
+        }
+
+        if (held_clients.empty()) {
+            return;
+        }
+
+        int64_t earliest = INT64_MAX;
+        for (client *cl : held_clients) {
+            earliest = std::min(earliest, cl->batch_deadline_us);
+        }
+
+        // Wake up at the earliest deadline
+        itimerspec deadline;
+        memset(&deadline, 0, sizeof(deadline));
+        deadline.it_value.tv_sec = earliest / 1000000;
+        deadline.it_value.tv_nsec = (earliest % 1000000) * 1000;
+
+        if (timerfd_settime(batch_timer_fd, TFD_TIMER_ABSTIME, &deadline,
+                NULL) < 0) {
+            fprintf(stderr, "Error setting the batch timer.\n");
+        }
+    }
+
+    /**
+     * @brief Flushes every client which had messages queued during the
+     *   current loop iteration.
+     * 
+     */
+    void flush_dirty_clients() {
+        TRACE_SCOPE("flush_clients");
+        for (client *cl : dirty_clients) {
+            cl->dirty = false;
+
+            // Skip clients which disconnected in the meantime, or which
+            // are about to
+            if (cl->fd == -1 || cl->closing) {
+                continue;
+            }
+
+            // Let the socket signal writability if it's already full
+            if (cl->watching_write) {
+                continue;
+            }
+
+            if (flush_client(cl) < 0) {
+                close_client(cl->fd);
+            }
+        }
+
+        dirty_clients.clear();
+    }
+
+    /**
+     * @brief Disconnects the clients which were found too slow during the
+     *   current loop iteration.
+     * 
+     */
+    void close_slow_clients() {
+        for (client *cl : closing_clients) {
+            // Skip clients which disconnected on their own meanwhile
+            if (cl->closing) {
+                close_client(cl->fd);
+            }
+        }
+
+        closing_clients.clear();
+    }
+
+    /**
+     * @brief Sends a given message to the client, without ever blocking.
+     *   The message is queued, and all of the messages queued for the client
+     *   during the current loop iteration are written together.
+     * 
+     * @param cl the client to send to
+     * @param msg the message to send
+     * @param delivery the delivery the message is part of, 0 if it's a
+     *   cached one
+     * @param topic_id the topic's ID, -1 if it wasn't added yet
+     * @return int - the error code
+     */
+    int send_to_client(client *cl, const MsgRef &msg,
+            const uint64_t delivery, const int topic_id) {
+        // A client about to be disconnected doesn't get anything more
+        if (cl->closing) {
+            return -1;
+        }
+
+        outbound_stats.client_backlog.record(cl->outbound_bytes +
+            cl->pending_bytes);
+
+        // Check if the client is keeping up
+        if (cl->outbound_bytes + cl->pending_bytes + msg.len() >
+                high_water) {
+            // The callers may still be using the client's connection, so
+            // it's only closed at the end of the loop iteration
+            if (slow_policy == SLOW_DISCONNECT) {
+                fprintf(stderr, "Client %s is too slow.\n", cl->id.c_str());
+                outbound_stats.disconnected++;
+                cl->closing = true;
+                closing_clients.push_back(cl);
+                return -1;
+            }
+
+            cl->dropped++;
+            outbound_stats.dropped++;
+            return 0;
+        }
+
+        // Live messages follow the stored ones still being sent
+        if (cl->replaying) {
+            cl->pending_live.push_back(stored_msg{delivery, msg, topic_id});
+            cl->pending_bytes += msg.len();
+            return 0;
+        }
+
+        queue_to_client(cl, msg, topic_id);
+        return 0;
+    }
+
+    /**
+     * @brief Finds the subscriptions to a topic or pattern.
+     * 
+     * @param topic_name the topic or pattern
+     * @param create whether to add the topic if it's unknown
+     * @return topic* - the subscriptions, or NULL if the topic is unknown
+     */
+    topic *find_topic(const std::string &topic_name, const bool create) {
+        if (TopicTrie<topic>::is_pattern(topic_name)) {
+            if (!create) {
+                return pattern_to_topic.find(topic_name);
+            }
+
+            topic *found = &pattern_to_topic.insert(topic_name);
+            found->name = topic_name;
+            return found;
+        }
+
+        topic_key key = make_topic_key(topic_name);
+        int id = create ? topic_ids.intern(key.name) :
+            topic_ids.lookup(key.name);
+        if (id < 0) {
+            return NULL;
+        }
+
+        if ((size_t)id >= id_to_topic.size()) {
+            if (!create) {
+                return NULL;
+            }
+
+            id_to_topic.resize(id + 1);
+        }
+
+        id_to_topic[id].name = topic_name;
+        return &id_to_topic[id];
+    }
+
+    /**
+     * @brief Subscribes the client to the given topic with the given sf.
+     * 
+     * @param cl the client to subscribe
+     * @param topic_name the topic to subscribe to
+     * @param sf the store & forward value
+     * @return int - the error code
+     */
+    int subscribe_client(client *cl, const std::string &topic_name,
+            const bool sf) {
+        // The subscriptions are part of the saved state
+        state_dirty = true;
+
+        // Attempt to find the client
+        topic *found = find_topic(topic_name, true);
+        auto position = found->positions.find(cl->index);
+        if (position != found->positions.end()) {
+            // The client is already subscribed to the topic, update sf value
+            found->sfs[position->second] = sf;
+
+            return 0;
+        }
+
+        // The first subscriber on this shard makes the shard interested
+        if (found->client_indexes.empty()) {
+            update_interest(topic_name, true);
+        }
+
+        // If the client is not already subscribed, subscribe him
+        found->positions[cl->index] = found->client_indexes.size();
+        found->client_indexes.push_back(cl->index);
+        found->fds.push_back(cl->fd);
+        found->sfs.push_back(sf);
+        found->cursors.push_back(cl->fd == -1 ? backlog_end(found) :
+            NO_CURSOR);
+        cl->topics.insert(found);
+
+        return 0;
+    }
+
+    /**
+     * @brief Unsubscribes the client from the given topic.
+     * 
+     * @param cl the client to unsubscribe
+     * @param topic_name the topic to unsubscribe from
+     * @return int - the error code
+     */
+    int unsubscribe_client(client *cl, const std::string &topic_name) {
+        // Attempt to find the client
+        topic *found = find_topic(topic_name, false);
+        if (!found || found->positions.find(cl->index) ==
+                found->positions.end()) {
+            // The client is NOT subscribed to the topic, do nothing
+            return -1;
+        }
+        
+        // Otherwise, delete him, moving the last subscription in his place
+        uint32_t pos = found->positions[cl->index];
+        uint32_t last = found->client_indexes.size() - 1;
+        found->client_indexes[pos] = found->client_indexes[last];
+        found->fds[pos] = found->fds[last];
+        found->sfs[pos] = found->sfs[last];
+        found->cursors[pos] = found->cursors[last];
+        found->positions[found->client_indexes[pos]] = pos;
+
+        found->client_indexes.pop_back();
+        found->fds.pop_back();
+        found->sfs.pop_back();
+        found->cursors.pop_back();
+        found->positions.erase(cl->index);
+        cl->topics.erase(found);
+        state_dirty = true;
+
+        // The client's stored messages aren't needed anymore
+        trim_backlog(found);
+
+        // The last subscriber on this shard makes the shard uninterested
+        if (found->client_indexes.empty()) {
+            if (TopicTrie<topic>::is_pattern(topic_name)) {
+                forget_evictable(found);
+                pattern_to_topic.erase(topic_name);
+            }
+
+            update_interest(topic_name, false);
+        }
+
+        return 0;
+    }
+
+    /**
+     * @brief Initializes the client.
+     * 
+     * @param client_fd the client's file descriptor
+     * @param client_id the client's ID
+     * @return client* - a pointer to the client
+     */
+    client *initialize_client(const int client_fd,
+            const std::string &client_id) {
+        shard_stats.connections++;
+
+        // Try to find if the client ID already exists
+        if (id_to_client.find(client_id) != id_to_client.end()) {
+            // Set the file descriptor
+            client *cl = id_to_client[client_id];
+            set_client_fd(cl, client_fd);
+
+            // Send the stored messages, a bit at a time
+            start_replay(cl);
+
+            return id_to_client[client_id];
+        }
+
+        // Otherwise, create a new client
+        return create_client(client_id, client_fd);
+    }
+
+    /**
+     * @brief Creates a client.
+     * 
+     * @param client_id the client's ID
+     * @param client_fd the client's file descriptor, -1 if disconnected
+     * @return client* - a pointer to the client
+     */
+    client *create_client(const std::string &client_id,
+            const int client_fd) {
+        client *new_client = new client;
+        new_client->id = std::string(client_id);
+        new_client->fd = client_fd;
+        new_client->outbound_offset = 0;
+        new_client->outbound_bytes = 0;
+        new_client->dropped = 0;
+        new_client->protocol = PROTOCOL_V1;
+        new_client->protocol_flags = 0;
+        new_client->topic_ref_count = 0;
+        new_client->batch_offset = 0;
+        new_client->batch_end = 0;
+        new_client->batch_deadline_us = 0;
+        new_client->batch_held = false;
+        new_client->dirty = false;
+        new_client->closing = false;
+        new_client->watching_write = false;
+        new_client->delivered = 0;
+        new_client->log_cursor = 0;
+        new_client->replaying = false;
+        new_client->replay_until = 0;
+        new_client->replayed = 0;
+        new_client->replay_queued = false;
+        new_client->batch_unacked = 0;
+        new_client->pending_bytes = 0;
+        new_client->stored_bytes = 0;
+        new_client->stored_limit = NO_CURSOR;
+        new_client->sf_dropped = 0;
+        new_client->sf_conflated = 0;
+        new_client->index = clients.size();
+
+        id_to_client[client_id] = new_client;
+        clients.push_back(new_client);
+        state_dirty = true;
+        return new_client;
+    }
+
+    /**
+     * @brief Sets the client's descriptor, in the client itself and in each
+     *   of its subscriptions.
+     * 
+     * @param cl the client
+     * @param client_fd the descriptor, -1 if the client is disconnected
+     */
+    void set_client_fd(client *cl, const int client_fd) {
+        cl->fd = client_fd;
+
+        for (topic *subbed : cl->topics) {
+            subbed->fds[subbed->positions[cl->index]] = client_fd;
+        }
+    }
+
+    /**
+     * @brief Returns the sequence number the next message stored on a
+     *   topic will get.
+     * 
+     * @param stored_on the topic
+     * @return uint64_t - the sequence number
+     */
+    static uint64_t backlog_end(const topic *stored_on) {
+        return stored_on->backlog_start + stored_on->backlog.size();
+    }
+
+    /**
+     * @brief Frees the messages stored on a topic which every disconnected
+     *   SF subscriber is past.
+     * 
+     * @param stored_on the topic
+     */
+    void trim_backlog(topic *stored_on) {
+        uint64_t needed = backlog_end(stored_on);
+        for (size_t i = 0; i < stored_on->client_indexes.size(); ++i) {
+            if (stored_on->sfs[i]) {
+                needed = std::min(needed, stored_on->cursors[i]);
+            }
+        }
+
+        while (stored_on->backlog_start < needed) {
+            backlog_stats.messages--;
+            backlog_stats.bytes -= stored_on->backlog.front().msg.len();
+
+            stored_on->backlog.pop_front();
+            stored_on->backlog_start++;
+        }
+    }
+
+    /**
+     * @brief Takes a stored message off a client's account.
+     * 
+     * @param cl the client
+     * @param len the length of the message
+     */
+    static void unstore(client *cl, const size_t len) {
+        // A client which dropped in the middle of a replay may have been
+        // sent some of the messages stored after it reconnected, which it
+        // wasn't charged for
+        cl->stored_bytes -= std::min(cl->stored_bytes, len);
+    }
+
+    /**
+     * @brief Stores a message on a topic, for its disconnected SF
+     *   subscribers.
+     * 
+     * @param stored_on the topic
+     * @param delivery the delivery the message is part of
+     * @param msg the message
+     * @param topic_id the topic's ID, -1 if it wasn't added yet
+     */
+    void store_message(topic *stored_on, const uint64_t delivery,
+            const MsgRef &msg, const int topic_id) {
+        // Let the oldest stored message be found on the topic
+        if (!stored_on->evictable) {
+            stored_on->evictable = true;
+            evictable_topics.push(eviction_entry(delivery, stored_on));
+        }
+
+        stored_on->backlog.push_back(stored_msg{delivery, msg, topic_id});
+        backlog_stats.stored++;
+        backlog_stats.messages++;
+        backlog_stats.bytes += msg.len();
+    }
+
+    /**
+     * @brief Drops the oldest message stored on a topic, even if some of
+     *   its disconnected SF subscribers didn't get it.
+     * 
+     * @param stored_on the topic
+     */
+    void drop_oldest_stored(topic *stored_on) {
+        size_t len = stored_on->backlog.front().msg.len();
+
+        // Move the subscribers which were about to get it past it
+        for (size_t i = 0; i < stored_on->client_indexes.size(); ++i) {
+            if (stored_on->sfs[i] &&
+                    stored_on->cursors[i] == stored_on->backlog_start) {
+                client *cl = clients[stored_on->client_indexes[i]];
+                stored_on->cursors[i]++;
+                unstore(cl, len);
+                cl->sf_dropped++;
+                backlog_stats.dropped++;
+            }
+        }
+
+        backlog_stats.messages--;
+        backlog_stats.bytes -= len;
+
+        stored_on->backlog.pop_front();
+        stored_on->backlog_start++;
+    }
+
+    /**
+     * @brief Makes room for a message among all the stored ones, dropping
+     *   the oldest ones, unless the newest ones should be dropped instead.
+     * 
+     * @param len the length of the message
+     * @return true, if the message may be stored
+     */
+    bool make_global_room(const size_t len) {
+        while (backlog_stats.bytes + len > sf_global_budget) {
+            if (sf_policy == SF_DROP_NEWEST || evictable_topics.empty()) {
+                return false;
+            }
+
+            eviction_entry oldest = evictable_topics.top();
+            evictable_topics.pop();
+
+            topic *stored_on = oldest.second;
+            if (stored_on->backlog.empty()) {
+                stored_on->evictable = false;
+                continue;
+            }
+
+            // Drop the topic's oldest message only if it's the oldest of
+            // all, which the entry may be outdated about
+            if (stored_on->backlog.front().delivery == oldest.first) {
+                drop_oldest_stored(stored_on);
+            }
+
+            if (stored_on->backlog.empty()) {
+                stored_on->evictable = false;
+            } else {
+                evictable_topics.push(eviction_entry(
+                    stored_on->backlog.front().delivery, stored_on));
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * @brief Stops looking for stored messages on a topic which is about to
+     *   be freed.
+     * 
+     * @param removed the topic
+     */
+    void forget_evictable(topic *removed) {
+        if (!removed->evictable) {
+            return;
+        }
+
+        std::vector<eviction_entry> kept;
+        while (!evictable_topics.empty()) {
+            if (evictable_topics.top().second != removed) {
+                kept.push_back(evictable_topics.top());
+            }
+
+            evictable_topics.pop();
+        }
+
+        for (auto &entry : kept) {
+            evictable_topics.push(entry);
+        }
+    }
+
+    /**
+     * @brief Moves a client's cursor on a topic past the messages it was
+     *   charged for.
+     * 
+     * @param cl the client
+     * @param stored_on the topic
+     * @param pos the client's position in the topic's subscriptions
+     * @param end where to stop
+     * @return uint64_t - how many messages the client skipped
+     */
+    uint64_t skip_stored(client *cl, topic *stored_on, const uint32_t pos,
+            const uint64_t end) {
+        uint64_t &cursor = stored_on->cursors[pos];
+        uint64_t skipped = 0;
+        while (cursor < std::min(end, backlog_end(stored_on))) {
+            const stored_msg &stored =
+                stored_on->backlog[cursor - stored_on->backlog_start];
+            if (stored.delivery > cl->stored_limit) {
+                break;
+            }
+
+            unstore(cl, stored.msg.len());
+            ++cursor;
+            ++skipped;
+        }
+
+        trim_backlog(stored_on);
+        return skipped;
+    }
+
+    /**
+     * @brief Makes room for a message among the ones stored for a client,
+     *   as its overflow policy says.
+     * 
+     * @param cl the client, disconnected
+     * @param matched the topic the message is stored on
+     * @param pos the client's position in the topic's subscriptions
+     * @param delivery the delivery the message is part of
+     * @param len the length of the message
+     * @return true, if the message may be stored for the client
+     */
+    bool make_client_room(client *cl, topic *matched, const uint32_t pos,
+            const uint64_t delivery, const size_t len) {
+        if (cl->stored_bytes + len <= sf_client_budget) {
+            return true;
+        }
+
+        if (sf_policy == SF_DROP_OLDEST) {
+            while (cl->stored_bytes + len > sf_client_budget) {
+                // Find the client's oldest stored message, on any topic
+                topic *oldest = NULL;
+                uint32_t oldest_pos = 0;
+                uint64_t oldest_delivery = NO_CURSOR;
+                for (topic *subbed : cl->topics) {
+                    uint32_t sub_pos = subbed->positions[cl->index];
+                    uint64_t cursor = subbed->cursors[sub_pos];
+                    if (!subbed->sfs[sub_pos] ||
+                            cursor >= backlog_end(subbed)) {
+                        continue;
+                    }
+
+                    uint64_t stored_delivery = subbed->backlog[
+                        cursor - subbed->backlog_start].delivery;
+                    if (stored_delivery < oldest_delivery) {
+                        oldest = subbed;
+                        oldest_pos = sub_pos;
+                        oldest_delivery = stored_delivery;
+                    }
+                }
+
+                if (!oldest) {
+                    break;
+                }
+
+                uint64_t dropped = skip_stored(cl, oldest, oldest_pos,
+                    oldest->cursors[oldest_pos] + 1);
+                cl->sf_dropped += dropped;
+                backlog_stats.dropped += dropped;
+            }
+
+            return true;
+        }
+
+        if (sf_policy == SF_CONFLATE) {
+            // Only keep the latest message of each topic, starting with
+            // the one the new message replaces
+            uint64_t conflated = skip_stored(cl, matched, pos,
+                backlog_end(matched));
+
+            for (topic *subbed : cl->topics) {
+                if (cl->stored_bytes + len <= sf_client_budget) {
+                    break;
+                }
+
+                uint32_t sub_pos = subbed->positions[cl->index];
+                if (subbed->sfs[sub_pos] && subbed != matched &&
+                        !subbed->backlog.empty()) {
+                    conflated += skip_stored(cl, subbed, sub_pos,
+                        backlog_end(subbed) - 1);
+                }
+            }
+
+            cl->sf_conflated += conflated;
+            backlog_stats.conflated += conflated;
+
+            if (cl->stored_bytes + len <= sf_client_budget) {
+                return true;
+            }
+        }
+
+        if (sf_policy == SF_DISCONNECT) {
+            // Drop everything stored for the client
+            fprintf(stderr, "Client %s exceeded its store & forward "
+                "budget.\n", cl->id.c_str());
+
+            for (topic *subbed : cl->topics) {
+                uint32_t sub_pos = subbed->positions[cl->index];
+                if (subbed->sfs[sub_pos]) {
+                    uint64_t dropped = skip_stored(cl, subbed, sub_pos,
+                        backlog_end(subbed));
+                    cl->sf_dropped += dropped;
+                    backlog_stats.dropped += dropped;
+                }
+            }
+        }
+
+        // Stop storing messages for the client until it reconnects
+        cl->stored_limit = delivery - 1;
+        return false;
+    }
+
+    /**
+     * @brief Queues the next messages stored for a reconnected client,
+     *   merging its topics' backlogs in the order the messages were
+     *   delivered, and sending a message stored on several of them once.
+     * 
+     * @param cl the client
+     * @return true, if every message stored before the reconnect was queued
+     */
+    bool replay_backlogs(client *cl) {
+        // Start from the client's cursor in each backlog it has messages in,
+        // and from the messages it didn't get before it last left, which
+        // aren't stored on any topic
+        std::priority_queue<replay_head, std::vector<replay_head>,
+            std::greater<replay_head>> heads;
+        auto push_head = [&](topic *stored_on, const uint32_t pos) {
+            if (stored_on == NULL) {
+                if (!cl->unsent.empty()) {
+                    heads.push(replay_head{cl->unsent.front().delivery,
+                        NULL, 0});
+                }
+
+                return;
+            }
+
+            uint64_t cursor = stored_on->cursors[pos];
+            if (cursor < backlog_end(stored_on)) {
+                uint64_t delivery = stored_on->backlog[
+                    cursor - stored_on->backlog_start].delivery;
+                if (delivery <= std::min(cl->replay_until,
+                        cl->stored_limit)) {
+                    heads.push(replay_head{delivery, stored_on, pos});
+                }
+            }
+        };
+
+        push_head(NULL, 0);
+        for (topic *subbed : cl->topics) {
+            uint32_t pos = subbed->positions[cl->index];
+            if (subbed->sfs[pos]) {
+                push_head(subbed, pos);
+            }
+        }
+
+        // Always take the earliest delivery among the backlogs, until the
+        // budget is spent. A message in several of them is sent once
+        while (!heads.empty()) {
+            if (cl->outbound_bytes >= REPLAY_BUDGET) {
+                break;
+            }
+
+            replay_head head = heads.top();
+            heads.pop();
+
+            if (head.stored_on == NULL) {
+                if (head.delivery != cl->replayed) {
+                    push_replayed(cl, cl->unsent.front());
+                    cl->replayed = head.delivery;
+                    backlog_stats.replayed++;
+                }
+
+                cl->unsent.pop_front();
+                push_head(NULL, 0);
+                continue;
+            }
+
+            uint64_t &cursor = head.stored_on->cursors[head.pos];
+            const stored_msg &stored =
+                head.stored_on->backlog[cursor - head.stored_on->backlog_start];
+            if (stored.delivery != cl->replayed) {
+                push_replayed(cl, stored);
+                cl->replayed = stored.delivery;
+                backlog_stats.replayed++;
+            }
+
+            unstore(cl, stored.msg.len());
+
+            ++cursor;
+            push_head(head.stored_on, head.pos);
+        }
+
+        // Free what the client was the last to need
+        for (topic *subbed : cl->topics) {
+            trim_backlog(subbed);
+        }
+
+        return heads.empty();
+    }
+
+    /**
+     * @brief Starts sending the messages stored for a client which just
+     *   reconnected. Live messages wait until they were all sent.
+     * 
+     * @param cl the client
+     */
+    void start_replay(client *cl) {
+        cl->replaying = true;
+        cl->replayed = 0;
+        cl->replay_queued = false;
+
+        if (sf_log) {
+            // Read the log from where the client left it, up to its end,
+            // which the messages the client wants stored keep moving
+            // until the replay catches up with it
+            sf_log->seek(cl->replay_pos, cl->log_cursor);
+            if (cl->replay_pos.seq > cl->log_cursor) {
+                // Retention already removed some of them
+                sf_log_stats.cursors_behind++;
+            }
+        } else {
+            cl->replay_until = delivery_count;
+        }
+
+        replaying_clients.push_back(cl);
+    }
+
+    /**
+     * @brief Queues the client's next stored messages, up to the replay
+     *   budget.
+     * 
+     * @param cl the client
+     */
+    void replay_step(client *cl) {
+        if (!cl->replay_queued) {
+            cl->replay_queued = sf_log ? replay_log(cl) : replay_backlogs(cl);
+        }
+    }
+
+    /**
+     * @brief Ends the client's replay once every stored message was queued
+     *   and written, queueing the live messages held back meanwhile.
+     * 
+     * @param cl the client
+     * @return true, if the replay ended
+     */
+    bool end_replay(client *cl) {
+        // Messages stored in the log since it was read must be sent first
+        if (sf_log && cl->replay_pos.seq < sf_log->end_seq()) {
+            cl->replay_queued = false;
+        }
+
+        if (!cl->replay_queued || !cl->unacked.empty()) {
+            return false;
+        }
+
+        cl->replaying = false;
+        cl->stored_bytes = 0;
+        cl->stored_limit = NO_CURSOR;
+
+        // The client doesn't need any stored message anymore
+        for (topic *subbed : cl->topics) {
+            subbed->cursors[subbed->positions[cl->index]] = NO_CURSOR;
+            trim_backlog(subbed);
+        }
+
+        if (sf_log) {
+            state_dirty = true;
+        }
+
+        // The live messages held back during the replay follow it
+        for (const stored_msg &pending : cl->pending_live) {
+            push_outbound(cl, pending.msg, pending.topic_id);
+        }
+
+        cl->pending_live.clear();
+        cl->pending_bytes = 0;
+        return true;
+    }
+
+    /**
+     * @brief Continues the replays whose clients' sockets aren't full, as
+     *   they won't signal writability.
+     * 
+     * @return true, if some replays can continue right away
+     */
+    bool continue_replays() {
+        bool can_continue = false;
+
+        size_t kept = 0;
+        for (size_t i = 0; i < replaying_clients.size(); ++i) {
+            client *cl = replaying_clients[i];
+
+            // Forget the replays which ended, or whose client left
+            if (!cl->replaying || cl->fd == -1) {
+                continue;
+            }
+
+            replaying_clients[kept++] = cl;
+            if (cl->watching_write) {
+                continue;
+            }
+
+            if (flush_client(cl) < 0) {
+                close_client(cl->fd);
+                continue;
+            }
+
+            // Only come back for replays with more to queue, the others
+            // wait for their messages to be written
+            can_continue = can_continue || (cl->replaying &&
+                !cl->watching_write && !cl->replay_queued);
+        }
+
+        replaying_clients.resize(kept);
+        return can_continue;
+    }
+
+    /**
+     * @brief Keeps the messages a client leaving in the middle of a replay
+     *   didn't get, in the order they were delivered.
+     * 
+     * @param cl the client
+     */
+    void keep_unsent(client *cl) {
+        // The unwritten replayed messages come before the unsent ones not
+        // queued yet, which all come before the live ones
+        std::deque<stored_msg> unsent;
+        unsent.swap(cl->unacked);
+        unsent.insert(unsent.end(), cl->unsent.begin(), cl->unsent.end());
+
+        for (const stored_msg &pending : cl->pending_live) {
+            if (pending.delivery != 0 &&
+                    wants_stored(cl, pending.msg.msg()->topic,
+                        pending.topic_id)) {
+                unsent.push_back(pending);
+            }
+        }
+
+        cl->unsent.swap(unsent);
+    }
+
+    /**
+     * @brief Disconnects the client.
+     * 
+     * @param client_to_disconnect - the client to disconnect
+     */
+    void disconnect_client(client *client_to_disconnect) {
+        set_client_fd(client_to_disconnect, -1);
+        client_to_disconnect->closing = false;
+
+        // The client may want everything stored from now on, apart from
+        // a replay which didn't end, which goes on from where it stopped
+        for (topic *subbed : client_to_disconnect->topics) {
+            uint64_t &cursor =
+                subbed->cursors[subbed->positions[client_to_disconnect->index]];
+            if (!client_to_disconnect->replaying || cursor == NO_CURSOR) {
+                cursor = backlog_end(subbed);
+            }
+        }
+
+        if (sf_log) {
+            if (!client_to_disconnect->replaying) {
+                client_to_disconnect->log_cursor = sf_log->end_seq();
+            }
+
+            state_dirty = true;
+        }
+
+        // The replayed messages which weren't written, and the live ones
+        // held back which the client wants stored, are replayed again.
+        // The log's cursor already points at the first of them
+        if (client_to_disconnect->replaying && !sf_log) {
+            keep_unsent(client_to_disconnect);
+        }
+
+        client_to_disconnect->replaying = false;
+        client_to_disconnect->unacked.clear();
+        client_to_disconnect->batch_unacked = 0;
+        client_to_disconnect->pending_live.clear();
+        client_to_disconnect->pending_bytes = 0;
+
+        // Whatever wasn't written is lost along with the connection
+        client_to_disconnect->outbound.clear();
+        client_to_disconnect->outbound_offset = 0;
+        client_to_disconnect->outbound_bytes = 0;
+        client_to_disconnect->watching_write = false;
+
+        // Topic references only last as long as the connection
+        client_to_disconnect->protocol = PROTOCOL_V1;
+        client_to_disconnect->protocol_flags = 0;
+        client_to_disconnect->topic_refs.clear();
+        client_to_disconnect->topic_ref_count = 0;
+        client_to_disconnect->batch_offset = 0;
+        client_to_disconnect->batch_end = 0;
+    }
+
+    /**
+     * @brief Closes the connection with an initialized client.
+     * 
+     * @param client_fd the client's descriptor
+     */
+    void close_client(const int client_fd) {
+        fprintf(stdout, "Client %s disconnected.\n",
+            fd_to_client[client_fd]->id.c_str());
+
+        disconnect_client(fd_to_client[client_fd]);
+        fd_to_client.erase(client_fd);
+        shard_stats.clients_connected = fd_to_client.size();
+        close_connection(client_fd);
+    }
+
+    /**
+     * @brief Closes a connection, be it with an initialized client or not.
+     * 
+     * @param client_fd the connection's descriptor
+     */
+    void close_connection(const int client_fd) {
+        // Forget the client's information if it wasn't initialized yet
+        if (uninitialized_fds.find(client_fd) != uninitialized_fds.end()) {
+            free(uninitialized_fds[client_fd]);
+            uninitialized_fds.erase(client_fd);
+        }
+
+        delete fd_to_decoder[client_fd];
+        fd_to_decoder.erase(client_fd);
+
+        loop.remove(client_fd);
+        close(client_fd);
+    }
+
+    /**
+     * @brief Finds the shard which owns a client's state.
+     * 
+     * @param client_id the client's ID
+     * @return int - the shard
+     */
+    int client_owner(const std::string &client_id) const {
+        return std::hash<std::string>()(client_id) % shared->shard_count;
+    }
+
+    /**
+     * @brief Finds the shard which owns a topic, that is, which knows which
+     *   shards have subscribers to it.
+     * 
+     * @param name the zero padded topic
+     * @return int - the shard
+     */
+    int topic_owner(const char *name) const {
+        return hash_topic(name) % shared->shard_count;
+    }
+
+    /**
+     * @brief Sends a message to a shard. Messages for this shard are handled
+     *   right away, while the others are woken up at the end of the current
+     *   iteration.
+     * 
+     * @param target the shard
+     * @param msg the message, which the target takes over
+     */
+    void post(const int target, const shard_msg &msg) {
+        if (target == shard_id) {
+            handle_shard_msg(msg);
+            return;
+        }
+
+        // Keep the messages in order if the target's mailbox was full
+        auto &pending = outboxes[target];
+        SpscQueue<shard_msg> *inbox =
+            shared->shards[target]->inboxes[shard_id];
+        if (!pending.empty() || !inbox->push(msg)) {
+            pending.push_back(msg);
+        }
+
+        wake_targets[target] = true;
+    }
+
+    /**
+     * @brief Sends a message without a payload to every shard.
+     * 
+     * @param type the message's type
+     */
+    void broadcast(const shard_msg_type type) {
+        for (int shard = 0; shard < shared->shard_count; ++shard) {
+            post(shard, {type, NULL, NULL});
+        }
+    }
+
+    /**
+     * @brief Moves the messages which didn't fit in their targets' mailboxes
+     *   yet, then wakes up every shard something was posted to.
+     * 
+     * @return bool - true, if some messages still don't fit
+     */
+    bool flush_outboxes() {
+        bool left = false;
+        size_t waiting = 0;
+
+        for (int target = 0; target < shared->shard_count; ++target) {
+            auto &pending = outboxes[target];
+            SpscQueue<shard_msg> *inbox =
+                shared->shards[target]->inboxes[shard_id];
+            while (!pending.empty() && inbox->push(pending.front())) {
+                pending.pop_front();
+            }
+
+            left = left || !pending.empty();
+            waiting += pending.size();
+
+            // One wakeup covers everything posted during the iteration
+            if (wake_targets[target]) {
+                uint64_t one = 1;
+                if (write(shared->shards[target]->wake_fd,
+                        &one, sizeof(one)) < 0 && errno != EAGAIN) {
+                    fprintf(stderr, "Error waking up shard %d.\n", target);
+                }
+
+                wake_targets[target] = false;
+            }
+        }
+
+        shard_stats.outbox_messages = waiting;
+        return left;
+    }
+
+    /**
+     * @brief Handles everything the other shards posted to this one.
+     * 
+     */
+    void drain_inboxes() {
+        TRACE_SCOPE("drain_inboxes");
+        // Reset the wakeup first, so nothing posted afterwards is missed
+        uint64_t count;
+        if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            fprintf(stderr, "Error reading the shard wakeup.\n");
+        }
+
+        // Count what waits, before handling any of it
+        size_t waiting = 0;
+        for (auto inbox : inboxes) {
+            waiting += inbox ? inbox->size() : 0;
+        }
+
+        shard_stats.mailbox_messages = waiting;
+
+        shard_msg msg;
+        for (auto inbox : inboxes) {
+            while (inbox && inbox->pop(msg)) {
+                handle_shard_msg(msg);
+            }
+        }
+    }
+
+    /**
+     * @brief Handles a message posted by a shard.
+     * 
+     * @param msg the message
+     */
+    void handle_shard_msg(const shard_msg &msg) {
+        switch (msg.type) {
+            case SHARD_HANDOFF:
+                adopt_connection((connection_handoff *)msg.data);
+                break;
+
+            case SHARD_PUBLISH:
+            case SHARD_DELIVER: {
+                // Adopt the reference the sender gave up
+                MsgRef published(msg.buf);
+
+                if (msg.type == SHARD_PUBLISH) {
+                    route_publish(published);
+                } else {
+                    deliver_local(published);
+                }
+                break;
+            }
+
+            case SHARD_INTEREST:
+                apply_interest((interest_update *)msg.data);
+                break;
+
+            case SHARD_SNAPSHOT_REQUEST:
+                send_snapshots((snapshot_request *)msg.data);
+                break;
+
+            case SHARD_SNAPSHOT: {
+                MsgRef snapshot(msg.buf);
+                deliver_snapshot((snapshot_request *)msg.data, snapshot);
+                break;
+            }
+
+            case SHARD_STATS:
+                print_stats();
+                break;
+
+            case SHARD_STOP:
+                stopping = true;
+                break;
+        }
+    }
+
+    /**
+     * @brief Frees whatever a message which will never be handled holds.
+     * 
+     * @param msg the message
+     */
+    static void discard_shard_msg(const shard_msg &msg) {
+        if (msg.buf) {
+            MsgRef dropped(msg.buf);
+        }
+
+        if (msg.type == SHARD_HANDOFF) {
+            connection_handoff *handoff = (connection_handoff *)msg.data;
+            close(handoff->info->fd);
+            free(handoff->info);
+            delete handoff->decoder;
+            delete handoff;
+        } else if (msg.type == SHARD_INTEREST) {
+            delete (interest_update *)msg.data;
+        } else if (msg.type == SHARD_SNAPSHOT_REQUEST ||
+                msg.type == SHARD_SNAPSHOT) {
+            delete (snapshot_request *)msg.data;
+        }
+    }
+
+    /**
+     * @brief Gives a connection whose client belongs to another shard, along
+     *   with whatever was received on it, to that shard.
+     * 
+     * @param client_fd the connection's descriptor
+     * @param client_id the ID the client sent
+     * @param version the protocol version the client asked for
+     * @param flags the protocol flags the client asked for
+     */
+    void hand_off_connection(const int client_fd,
+            const std::string &client_id, const uint8_t version,
+            const uint8_t flags) {
+        // Stop watching the descriptor, the other shard will
+        loop.remove(client_fd);
+
+        connection_handoff *handoff = new connection_handoff;
+        handoff->info = uninitialized_fds[client_fd];
+        handoff->decoder = fd_to_decoder[client_fd];
+        handoff->client_id = client_id;
+        handoff->version = version;
+        handoff->flags = flags;
+
+        uninitialized_fds.erase(client_fd);
+        fd_to_decoder.erase(client_fd);
+
+        post(client_owner(client_id), {SHARD_HANDOFF, NULL, handoff});
+    }
+
+    /**
+     * @brief Takes over a connection handed off by another shard.
+     * 
+     * @param handoff the connection
+     */
+    void adopt_connection(connection_handoff *handoff) {
+        const int client_fd = handoff->info->fd;
+        uninitialized_fds[client_fd] = handoff->info;
+        fd_to_decoder[client_fd] = handoff->decoder;
+
+        std::string client_id = std::move(handoff->client_id);
+        uint8_t version = handoff->version;
+        uint8_t flags = handoff->flags;
+        delete handoff;
+
+        // Start watching the client's descriptor
+        if (loop.add(client_fd, EV_READ | EV_EDGE) < 0) {
+            fprintf(stderr, "Error watching the client descriptor.\n");
+            close_connection(client_fd);
+            return;
+        }
+
+        if (initialize_connection(client_fd, client_id, version, flags) < 0) {
+            return;
+        }
+
+        // Handle the commands which followed the ID
+        process_frames(client_fd);
+    }
+
+    /**
+     * @brief Tells the shard which owns a topic whether this shard has
+     *   subscribers to it. A pattern may match topics owned by any shard,
+     *   so every shard is told about it.
+     * 
+     * @param topic_name the topic or pattern
+     * @param interested whether there are subscribers
+     */
+    void update_interest(const std::string &topic_name,
+            const bool interested) {
+        int first = 0;
+        int last = shared->shard_count - 1;
+        if (!TopicTrie<topic>::is_pattern(topic_name)) {
+            first = last = topic_owner(make_topic_key(topic_name).name);
+        }
+
+        for (int shard = first; shard <= last; ++shard) {
+            interest_update *update = new interest_update;
+            update->topic_name = topic_name;
+            update->shard = shard_id;
+            update->interested = interested;
+
+            post(shard, {SHARD_INTEREST, NULL, update});
+        }
+    }
+
+    /**
+     * @brief Records whether a shard has subscribers to a topic this shard
+     *   owns, or to a pattern.
+     * 
+     * @param update the shard's interest
+     */
+    void apply_interest(interest_update *update) {
+        uint64_t bit = 1ULL << update->shard;
+
+        if (TopicTrie<uint64_t>::is_pattern(update->topic_name)) {
+            if (update->interested) {
+                pattern_interest.insert(update->topic_name) |= bit;
+            } else {
+                uint64_t *shards = pattern_interest.find(update->topic_name);
+                if (shards && !(*shards &= ~bit)) {
+                    pattern_interest.erase(update->topic_name);
+                }
+            }
+        } else {
+            int id = topic_ids.intern(make_topic_key(update->topic_name).name);
+            if ((size_t)id >= topic_interest.size()) {
+                topic_interest.resize(id + 1, 0);
+            }
+
+            if (update->interested) {
+                topic_interest[id] |= bit;
+            } else {
+                topic_interest[id] &= ~bit;
+            }
+        }
+
+        delete update;
+    }
+
+    /**
+     * @brief Asks the shards which may have cached the last message of a
+     *   topic, or of the topics matching a pattern, to send it to a client
+     *   which just subscribed.
+     * 
+     * @param cl the client
+     * @param topic_name the topic or pattern
+     */
+    void request_snapshots(client *cl, const std::string &topic_name) {
+        int first = 0;
+        int last = shared->shard_count - 1;
+        if (!TopicTrie<topic>::is_pattern(topic_name)) {
+            first = last = topic_owner(make_topic_key(topic_name).name);
+        }
+
+        for (int shard = first; shard <= last; ++shard) {
+            snapshot_request *request = new snapshot_request;
+            request->topic_name = topic_name;
+            request->shard = shard_id;
+            request->client_index = cl->index;
+
+            post(shard, {SHARD_SNAPSHOT_REQUEST, NULL, request});
+        }
+    }
+
+    /**
+     * @brief Sends the cached last messages a client asked for to its
+     *   shard.
+     * 
+     * @param request the request
+     */
+    void send_snapshots(snapshot_request *request) {
+        auto reply = [&](const MsgRef &last_value) {
+            snapshot_request *answer = new snapshot_request(*request);
+            MsgRef copy(last_value);
+            post(request->shard, {SHARD_SNAPSHOT, copy.release(), answer});
+            cache_stats.snapshots++;
+        };
+
+        if (!TopicTrie<topic>::is_pattern(request->topic_name)) {
+            int id = topic_ids.lookup(
+                make_topic_key(request->topic_name).name);
+            if (id >= 0 && (size_t)id < id_to_topic.size() &&
+                    id_to_topic[id].last_value) {
+                reply(id_to_topic[id].last_value);
+            }
+        } else if (!cached_topics.empty()) {
+            // Match every cached topic against the pattern
+            TopicTrie<bool> pattern;
+            pattern.insert(request->topic_name) = true;
+
+            for (int id : cached_topics) {
+                const char *name = topic_ids.name(id);
+                pattern.match(std::string_view(name,
+                        strnlen(name, MAX_TOPIC_LEN)),
+                    [&](bool &) {
+                        reply(id_to_topic[id].last_value);
+                    });
+            }
+        }
+
+        delete request;
+    }
+
+    /**
+     * @brief Sends a cached last message to the client which asked for it,
+     *   if it's still connected and subscribed.
+     * 
+     * @param answer the request it answers
+     * @param snapshot the message
+     */
+    void deliver_snapshot(snapshot_request *answer, const MsgRef &snapshot) {
+        client *cl = clients[answer->client_index];
+        topic *subbed = find_topic(answer->topic_name, false);
+        if (cl->fd != -1 && subbed && subbed->positions.find(cl->index) !=
+                subbed->positions.end()) {
+            send_to_client(cl, snapshot, 0,
+                topic_ids.lookup(snapshot.msg()->topic));
+        }
+
+        delete answer;
+    }
+
+    /**
+     * @brief Keeps the last message published on a topic this shard owns,
+     *   unless the cache is full. Once the topic is known, this only swaps
+     *   references.
+     * 
+     * @param id the topic's ID, -1 if it wasn't added yet
+     * @param msg the message
+     */
+    void cache_last_value(int id, const MsgRef &msg) {
+        const bool full = cached_topics.size() >= cache_capacity;
+        if (id < 0 || (size_t)id >= id_to_topic.size()) {
+            if (full) {
+                cache_stats.rejected++;
+                return;
+            }
+
+            id = topic_ids.intern(msg.msg()->topic);
+            if ((size_t)id >= id_to_topic.size()) {
+                id_to_topic.resize(id + 1);
+            }
+        }
+
+        MsgRef &last_value = id_to_topic[id].last_value;
+        if (last_value) {
+            cache_stats.bytes -= last_value.len();
+        } else if (full) {
+            cache_stats.rejected++;
+            return;
+        } else {
+            cached_topics.push_back(id);
+        }
+
+        last_value = msg;
+        cache_stats.bytes += msg.len();
+    }
+
+    /**
+     * @brief Handles input given in the standard input.
+     * 
+     * @return int - the error code
+     */
+    int handle_stdin() {
+        // Read the message from stdin
+        char buffer[BUFLEN + 1];
+        fgets(buffer, BUFLEN, stdin);
+
+        // Remove the final '\n'
+        buffer[strlen(buffer) - 1] = '\0';
+
+        // If the message is "exit", close the server along with the other
+        // shards
+        if (strcmp(buffer, EXIT_CMD) == 0) {
+            broadcast(SHARD_STOP);
+            return -1;
+        }
+
+        // If the message is "stats", have every shard print its counters
+        if (strcmp(buffer, STATS_CMD) == 0) {
+            broadcast(SHARD_STATS);
+            return 0;
+        }
+
+        // If the message is "trace", write the events recorded by every
+        // shard to the given file, or to the default one
+        char *cmd = strtok(buffer, WHITESPACE);
+        if (cmd != NULL && strcmp(cmd, TRACE_CMD) == 0) {
+            trace_dump(strtok(NULL, WHITESPACE));
+            return 0;
+        }
+
+        // Otherwise, do nothing
+        return 0;
+    }
+
+    /**
+     * @brief Turns away a pending connection when the process is out of
+     *   descriptors: the reserve descriptor is given up to accept it, so it
+     *   leaves the queue instead of being reported again and again (or, as
+     *   the socket is edge-triggered, never again).
+     * 
+     * @param tcp_fd the tcp socket
+     * @return int - 0 if a connection was turned away, -1 if none is
+     *   pending or none could be accepted
+     */
+    int shed_connection(const int tcp_fd) {
+        if (reserve_fd != -1) {
+            close(reserve_fd);
+            reserve_fd = -1;
+        }
+
+        int client_socket = accept4(tcp_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client_socket >= 0) {
+            close(client_socket);
+        }
+
+        // Take the reserve back for the next time
+        reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (reserve_fd < 0) {
+            fprintf(stderr, "Error reopening the reserve descriptor.\n");
+        }
+
+        return client_socket >= 0 ? 0 : -1;
+    }
+
+    /**
+     * @brief Handles everything received on the TCP socket (clients wanting
+     *   to connect to the server).
+     * 
+     * @param tcp_fd the tcp socket
+     * @param info where to store information about the client wanting to
+     *   connect, NULL if the connection failed or was turned away
+     * @return int - 0 if a connection was handled, -1 if none is pending
+     */
+    int handle_tcp_socket(const int tcp_fd, client_info **info) {
+        // Declare variables to store client information
+        sockaddr_in client_address;
+        socklen_t client_length = sizeof(client_address);
+        *info = NULL;
+
+        // Accept the client
+        int client_socket = accept4(tcp_fd, (struct sockaddr *)&client_address,
+            &client_length, SOCK_NONBLOCK);
+        if (client_socket < 0) {
+            // No more pending connections is not an error
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return -1;
+            }
+
+            // Out of descriptors, which accept() reports whether or not a
+            // connection is pending, so turn the pending one away, if any
+            if (errno == EMFILE || errno == ENFILE) {
+                if (shed_connection(tcp_fd) < 0) {
+                    return -1;
+                }
+
+                fprintf(stderr, "Out of descriptors, refusing client.\n");
+                return 0;
+            }
+
+            // The connection failed (e.g. it was aborted), but others may
+            // still be pending
+            fprintf(stderr, "Error accepting client.\n");
+            return 0;
+        }
+
+        // Construct new client info
+        *info = (client_info *)malloc(1 * sizeof(client_info));
+        if (!*info) {
+            fprintf(stderr, "Error allocating memory for client info.\n");
+            close(client_socket);
+            return 0;
+        }
+
+        (*info)->fd = client_socket;
+
+        char *client_addr = inet_ntoa(client_address.sin_addr);
+        strcpy((*info)->ip, client_addr);
+
+        (*info)->port = ntohs(client_address.sin_port);
+
+        return 0;
+    }
+
+    /**
+     * @brief Frames a datagram received from a UDP client and sends it to
+     *   (or stores it for) all of the topic's subscribers.
+     * 
+     * @param received_msg the datagram
+     * @param received_len the length of the datagram
+     * @param client_address the address of the UDP client
+     * @param received_ns when the datagram was received
+     * @return int - the error code
+     */
+    int publish_datagram(const udp_to_server_msg &received_msg,
+            const int received_len, const sockaddr_in &client_address,
+            const int64_t received_ns) {
+        TRACE_SCOPE("publish");
+
+        // Drop datagrams which don't even contain the header
+        if (received_len < MAX_TOPIC_LEN + 1) {
+            return -1;
+        }
+
+        // Drop the datagrams of unknown data types, which the subscribers
+        // couldn't read either
+        int content_len = framed_content_len(received_msg, received_len);
+        if (content_len < 0) {
+            return -1;
+        }
+
+        // Create the message to send to the client, in a pooled buffer
+        // sized to the framed message
+        MsgRef msg_to_send(
+            MsgPool::local().alloc(UDP_HDR_LEN + content_len)
+        );
+        if (!msg_to_send) {
+            return -1;
+        }
+
+        frame_datagram(msg_to_send.msg(), received_msg, received_len,
+            content_len, client_address);
+        msg_to_send.set_received_ns(received_ns);
+
+        // Hand the message to the shard which owns its topic
+        int owner = topic_owner(msg_to_send.msg()->topic);
+        if (owner == shard_id) {
+            route_publish(msg_to_send);
+        } else {
+            post(owner, {SHARD_PUBLISH, msg_to_send.release(), NULL});
+        }
+
+        return 0;
+    }
+
+    /**
+     * @brief Sends a message published on a topic owned by this shard to
+     *   every shard which has subscribers to the topic.
+     * 
+     * @param msg the framed message
+     */
+    void route_publish(const MsgRef &msg) {
+        TRACE_SCOPE("route");
+        const char *name = msg.msg()->topic;
+
+        // Gather the shards interested in the topic or a matching pattern
+        uint64_t interested = 0;
+        int id;
+        {
+            TRACE_SCOPE("topic_lookup");
+            id = topic_ids.lookup(name);
+            if (id >= 0 && (size_t)id < topic_interest.size()) {
+                interested = topic_interest[id];
+            }
+
+            if (pattern_interest.size() != 0) {
+                pattern_interest.match(
+                    std::string_view(name, strnlen(name, MAX_TOPIC_LEN)),
+                    [&](uint64_t &shards) {
+                        interested |= shards;
+                    });
+            }
+        }
+
+        if (cache_capacity != 0) {
+            cache_last_value(id, msg);
+        }
+
+        for (int shard = 0; shard < shared->shard_count; ++shard) {
+            if (!(interested & (1ULL << shard))) {
+                continue;
+            }
+
+            if (shard == shard_id) {
+                deliver_local(msg);
+            } else {
+                MsgRef copy(msg);
+                post(shard, {SHARD_DELIVER, copy.release(), NULL});
+            }
+        }
+    }
+
+    /**
+     * @brief Sends a message to (or stores it for) all of this shard's
+     *   subscribers to the topic or to a matching pattern, once per client.
+     * 
+     * @param msg the framed message
+     */
+    void deliver_local(const MsgRef &msg) {
+        TRACE_SCOPE("deliver");
+        const char *name = msg.msg()->topic;
+        const uint64_t delivery = ++delivery_count;
+        bool log_needed = false;
+
+        // The topic's ID is looked up once, and carried along with the
+        // message to its subscribers' queues and backlogs
+        const int id = topic_ids.lookup(name);
+
+        // Go through all subscribers of a matching topic
+        auto deliver_to = [&](topic &matched) {
+            bool store = false;
+            bool may_store = true;
+            bool room_made = false;
+            const size_t count = matched.client_indexes.size();
+            for (size_t i = 0; i < count; ++i) {
+                const int client_fd = matched.fds[i];
+
+                // Skip the disconnected clients which don't want the
+                // message stored, without touching them
+                if (client_fd == -1 && !matched.sfs[i]) {
+                    continue;
+                }
+
+                // Otherwise, the SF flag is 1, so the message is stored
+                // once for all of the disconnected clients which want it,
+                // in the log or in the topic's backlog
+                if (client_fd == -1 && sf_log) {
+                    log_needed = true;
+                    continue;
+                }
+
+                // A client replaying the log gets the messages it wants
+                // stored from the log, in order, once they're appended
+                client *cl = clients[matched.client_indexes[i]];
+                if (sf_log && cl->replaying) {
+                    if (matched.sfs[i]) {
+                        log_needed = true;
+                        continue;
+                    }
+
+                    if (wants_stored(cl, name, id)) {
+                        continue;
+                    }
+                }
+
+                // Skip the clients which already got the message, or
+                // have it stored on another topic
+                if (cl->delivered == delivery) {
+                    continue;
+                }
+
+                cl->delivered = delivery;
+
+                if (client_fd == -1) {
+                    // Keep the stored messages within their budgets
+                    if (!room_made) {
+                        may_store = make_global_room(msg.len());
+                        room_made = true;
+                    }
+
+                    if (!may_store || cl->stored_limit != NO_CURSOR ||
+                            !make_client_room(cl, &matched, i, delivery,
+                                msg.len())) {
+                        cl->sf_dropped++;
+                        backlog_stats.dropped++;
+                        continue;
+                    }
+
+                    cl->stored_bytes += msg.len();
+                    store = true;
+                    continue;
+                }
+
+                // Send the message and go to the next subscriber
+                send_to_client(cl, msg, delivery, id);
+            }
+
+            if (store) {
+                store_message(&matched, delivery, msg, id);
+            }
+        };
+
+        // Search for the topic itself, then for the matching patterns
+        if (id >= 0 && (size_t)id < id_to_topic.size()) {
+            deliver_to(id_to_topic[id]);
+        }
+
+        if (pattern_to_topic.size() != 0) {
+            pattern_to_topic.match(
+                std::string_view(name, strnlen(name, MAX_TOPIC_LEN)),
+                deliver_to);
+        }
+
+        uint64_t seq;
+        if (log_needed && sf_log->append(msg.data(), msg.len(), seq) < 0) {
+            fprintf(stderr, "Error storing a message in the log.\n");
+        }
+    }
+
+    /**
+     * @brief Checks whether a disconnected client wanted the messages
+     *   published on a topic stored.
+     * 
+     * @param cl the client
+     * @param name the zero padded topic
+     * @param id the topic's ID, -1 if it wasn't added yet
+     * @return true, if one of its subscriptions matching the topic has
+     *   the SF flag set
+     */
+    bool wants_stored(const client *cl, const char *name, const int id) {
+        auto subscribed = [&](const topic &matched) {
+            auto position = matched.positions.find(cl->index);
+            return position != matched.positions.end() &&
+                matched.sfs[position->second];
+        };
+
+        if (id >= 0 && (size_t)id < id_to_topic.size() &&
+                subscribed(id_to_topic[id])) {
+            return true;
+        }
+
+        bool wanted = false;
+        if (pattern_to_topic.size() != 0) {
+            pattern_to_topic.match(
+                std::string_view(name, strnlen(name, MAX_TOPIC_LEN)),
+                [&](topic &matched) {
+                    wanted = wanted || subscribed(matched);
+                });
+        }
+
+        return wanted;
+    }
+
+    /**
+     * @brief Queues the next messages logged since the client was
+     *   disconnected, on the topics it wanted them stored for.
+     * 
+     * @param cl the client
+     * @return true, if every message logged so far was queued
+     */
+    bool replay_log(client *cl) {
+        // Filtering the log costs as much as sending it
+        size_t scanned = 0;
+
+        log_entry entry;
+        while (cl->outbound_bytes < REPLAY_BUDGET &&
+                scanned < REPLAY_BUDGET) {
+            uint64_t seq = cl->replay_pos.seq;
+            if (sf_log->next(cl->replay_pos, entry) != 1) {
+                return true;
+            }
+
+            update_log_cursor(cl);
+            scanned += entry.len;
+
+            const server_to_client_msg *stored =
+                (const server_to_client_msg *)entry.data;
+            int id = topic_ids.lookup(stored->topic);
+            if (!wants_stored(cl, stored->topic, id)) {
+                continue;
+            }
+
+            // Copy the message out of the mapping into a pooled buffer
+            MsgRef replayed(MsgPool::local().alloc(entry.len));
+            if (!replayed) {
+                fprintf(stderr, "Error allocating a replayed message.\n");
+                return true;
+            }
+
+            memcpy(replayed.data(), entry.data, entry.len);
+            push_replayed(cl, stored_msg{seq, replayed, id});
+            sf_log_stats.replayed++;
+        }
+
+        return false;
+    }
+
+    /**
+     * @brief Saves the clients which have subscriptions, along with their
+     *   subscriptions and log cursors, replacing the previous state
+     *   atomically.
+     * 
+     * @return int - the error code
+     */
+    int save_state() {
+        std::string tmp_path = state_path + ".tmp";
+        FILE *state = fopen(tmp_path.c_str(), "wb");
+        if (!state) {
+            fprintf(stderr, "Error saving the clients' state.\n");
+            return -1;
+        }
+
+        // The connected clients want everything logged from now on
+        uint64_t end_seq = sf_log->end_seq();
+
+        for (client *cl : clients) {
+            if (cl->topics.empty()) {
+                continue;
+            }
+
+            uint8_t id_len = cl->id.size();
+            uint64_t cursor = cl->fd == -1 || cl->replaying ?
+                cl->log_cursor : end_seq;
+            uint32_t sub_count = cl->topics.size();
+            fwrite(&id_len, sizeof(id_len), 1, state);
+            fwrite(cl->id.data(), 1, id_len, state);
+            fwrite(&cursor, sizeof(cursor), 1, state);
+            fwrite(&sub_count, sizeof(sub_count), 1, state);
+
+            for (topic *subbed : cl->topics) {
+                uint8_t sf = subbed->sfs[subbed->positions[cl->index]];
+                uint8_t name_len = subbed->name.size();
+                fwrite(&sf, sizeof(sf), 1, state);
+                fwrite(&name_len, sizeof(name_len), 1, state);
+                fwrite(subbed->name.data(), 1, name_len, state);
+            }
+        }
+
+        if (fclose(state) != 0 ||
+                rename(tmp_path.c_str(), state_path.c_str()) < 0) {
+            fprintf(stderr, "Error saving the clients' state.\n");
+            return -1;
+        }
+
+        return 0;
+    }
+
+    /**
+     * @brief Recreates the clients saved by a previous run, all of them
+     *   disconnected.
+     * 
+     * @return int - the number of recovered clients
+     */
+    int load_state() {
+        FILE *state = fopen(state_path.c_str(), "rb");
+        if (!state) {
+            return 0;
+        }
+
+        int count = 0;
+        uint8_t id_len;
+        while (fread(&id_len, sizeof(id_len), 1, state) == 1) {
+            char id[UINT8_MAX + 1];
+            uint64_t cursor;
+            uint32_t sub_count;
+            if (fread(id, 1, id_len, state) != id_len ||
+                    fread(&cursor, sizeof(cursor), 1, state) != 1 ||
+                    fread(&sub_count, sizeof(sub_count), 1, state) != 1) {
+                break;
+            }
+
+            std::string client_id(id, id_len);
+            client *cl = id_to_client.find(client_id) == id_to_client.end() ?
+                create_client(client_id, -1) : id_to_client[client_id];
+            cl->log_cursor = cursor;
+            ++count;
+
+            for (uint32_t i = 0; i < sub_count; ++i) {
+                uint8_t sf, name_len;
+                char name[UINT8_MAX + 1];
+                if (fread(&sf, sizeof(sf), 1, state) != 1 ||
+                        fread(&name_len, sizeof(name_len), 1, state) != 1 ||
+                        fread(name, 1, name_len, state) != name_len) {
+                    break;
+                }
+
+                subscribe_client(cl, std::string(name, name_len), sf);
+            }
+        }
+
+        fclose(state);
+        return count;
+    }
+
+    /**
+     * @brief Saves the clients' state if it changed and wasn't saved for a
+     *   while, then lets the log drop what no client needs anymore.
+     * 
+     * @return int - how long until the state should be saved, -1 if it
+     *   doesn't need to be
+     */
+    int maintain_log() {
+        if (!sf_log || !state_dirty) {
+            return -1;
+        }
+
+        int64_t now = monotonic_ms();
+        if (now - state_saved_ms < SF_STATE_INTERVAL_MS) {
+            return SF_STATE_INTERVAL_MS - (now - state_saved_ms);
+        }
+
+        save_state();
+        state_dirty = false;
+        state_saved_ms = now;
+
+        // Nothing before the oldest disconnected client's cursor is needed
+        uint64_t needed_seq = sf_log->end_seq();
+        for (client *cl : clients) {
+            if ((cl->fd == -1 || cl->replaying) && !cl->topics.empty()) {
+                needed_seq = std::min(needed_seq, cl->log_cursor);
+            }
+        }
+
+        sf_log->trim(needed_seq);
+        return -1;
+    }
+
+    /**
+     * @brief Handles everything received on the UDP socket
+     *   (messages received from the UDP clients), receiving a whole
+     *   batch of datagrams into the ingest ring with a single call.
+     * 
+     * @param udp_fd the UDP socket
+     * @return int - the error code (-1 when there are no more datagrams)
+     */
+    int handle_udp_socket(const int udp_fd) {
+        TRACE_SCOPE("udp_batch");
+
+        // Reset the address and ancillary data lengths, as they are
+        // overwritten by each call
+        for (int i = 0; i < udp_batch; ++i) {
+            udp_headers[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            udp_headers[i].msg_hdr.msg_controllen = UDP_CONTROL_LEN;
+        }
+
+        // Receive a batch of messages from the UDP clients
+        int n;
+        {
+            TRACE_SCOPE("recvmmsg");
+            n = recvmmsg(udp_fd, udp_headers.data(), udp_batch,
+                MSG_DONTWAIT, NULL);
+        }
+
+        if (n <= 0) {
+            return -1;
+        }
+
+        TRACE_COUNTER("datagrams_per_batch", n);
+
+        // The whole batch counts as received now
+        int64_t received_ns = monotonic_ns();
+
+        // Update the ingest counters
+        ingest_stats.datagrams += n;
+        ingest_stats.batches++;
+        ingest_stats.batch_sizes.record(n);
+        if (n > ingest_stats.max_batch) {
+            ingest_stats.max_batch = n;
+        }
+
+        // Publish every datagram in the batch
+        for (int i = 0; i < n; ++i) {
+            ingest_stats.bytes += udp_headers[i].msg_len;
+            publish_datagram(udp_buffers[i], udp_headers[i].msg_len,
+                udp_addresses[i], received_ns);
+        }
+
+        // The kernel attaches how many datagrams it dropped so far, because
+        // the socket's buffer was full, to each received datagram
+        msghdr *last = &udp_headers[n - 1].msg_hdr;
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(last); cmsg;
+                cmsg = CMSG_NXTHDR(last, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET &&
+                    cmsg->cmsg_type == SO_RXQ_OVFL) {
+                uint32_t kernel_drops;
+                memcpy(&kernel_drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+                ingest_stats.kernel_drops = kernel_drops;
+            }
+        }
+
+        // A partial batch means that the socket was drained
+        return n == udp_batch ? 0 : -1;
+    }
+
+    /**
+     * @brief Allocates the ingest ring and points a message header
+     *   at each of its buffers.
+     * 
+     */
+    void init_udp_ring() {
+        udp_buffers.resize(udp_batch);
+        udp_addresses.resize(udp_batch);
+        udp_iovecs.resize(udp_batch);
+        udp_headers.resize(udp_batch);
+        udp_controls.assign(udp_batch * UDP_CONTROL_LEN, 0);
+
+        for (int i = 0; i < udp_batch; ++i) {
+            udp_iovecs[i].iov_base = &udp_buffers[i];
+            udp_iovecs[i].iov_len = sizeof(udp_to_server_msg);
+
+            memset(&udp_headers[i], 0, sizeof(mmsghdr));
+            udp_headers[i].msg_hdr.msg_name = &udp_addresses[i];
+            udp_headers[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            udp_headers[i].msg_hdr.msg_iov = &udp_iovecs[i];
+            udp_headers[i].msg_hdr.msg_iovlen = 1;
+            udp_headers[i].msg_hdr.msg_control =
+                &udp_controls[i * UDP_CONTROL_LEN];
+            udp_headers[i].msg_hdr.msg_controllen = UDP_CONTROL_LEN;
+        }
+    }
+
+    /**
+     * @brief Adds the shard's counters to the broker's metrics, labelled
+     *   with the shard.
+     * 
+     */
+    void register_metrics() {
+        MetricsRegistry &metrics = shared->metrics;
+        std::string labels = "shard=\"" + std::to_string(shard_id) + "\"";
+
+        metrics.add_counter("broker_datagrams_received_total",
+            "Datagrams received from the publishers.", labels,
+            ingest_stats.datagrams);
+        metrics.add_counter("broker_datagram_bytes_received_total",
+            "Bytes of the datagrams received.", labels, ingest_stats.bytes);
+        metrics.add_counter("broker_ingest_batches_total",
+            "Calls which received datagrams.", labels, ingest_stats.batches);
+        metrics.add_histogram("broker_ingest_batch_datagrams",
+            "Datagrams received by each call.", labels,
+            ingest_stats.batch_sizes, 1);
+        metrics.add_counter("broker_kernel_drops_total",
+            "Datagrams dropped by the kernel, the socket's buffer being "
+            "full.", labels, ingest_stats.kernel_drops);
+
+        metrics.add_counter("broker_messages_queued_total",
+            "Messages queued to the subscribers.", labels,
+            outbound_stats.queued);
+        metrics.add_counter("broker_frames_written_total",
+            "Frames written to the subscribers.", labels,
+            outbound_stats.frames_written);
+        metrics.add_counter("broker_writes_total",
+            "Writes to the subscribers' sockets.", labels,
+            outbound_stats.writes);
+        metrics.add_counter("broker_bytes_written_total",
+            "Bytes written to the subscribers' sockets.", labels,
+            outbound_stats.bytes_written);
+        metrics.add_counter("broker_messages_dropped_total",
+            "Messages dropped for slow subscribers.", labels,
+            outbound_stats.dropped);
+        metrics.add_counter("broker_slow_disconnects_total",
+            "Slow subscribers disconnected.", labels,
+            outbound_stats.disconnected);
+        metrics.add_counter("broker_batches_total",
+            "Batches cut for the subscribers.", labels,
+            outbound_stats.batches);
+        metrics.add_histogram("broker_delivery_latency_seconds",
+            "Time from a datagram's receipt to its subscriber's socket, or "
+            "batch, for live messages.", labels,
+            outbound_stats.delivery_latency, 1e-9);
+        metrics.add_histogram("broker_client_backlog_bytes",
+            "Bytes waiting for a subscriber whenever a message is sent to "
+            "it.", labels, outbound_stats.client_backlog, 1);
+
+        metrics.add_counter("broker_sf_stored_total",
+            "Messages stored for disconnected subscribers.", labels,
+            backlog_stats.stored);
+        metrics.add_counter("broker_sf_replayed_total",
+            "Stored messages replayed from memory.", labels,
+            backlog_stats.replayed);
+        metrics.add_gauge("broker_sf_backlog_messages",
+            "Messages kept in the topics' backlogs.", labels,
+            backlog_stats.messages);
+        metrics.add_gauge("broker_sf_backlog_bytes",
+            "Bytes kept in the topics' backlogs.", labels,
+            backlog_stats.bytes);
+
+        metrics.add_counter("broker_connections_total",
+            "Subscribers which connected.", labels, shard_stats.connections);
+        metrics.add_gauge("broker_clients_connected",
+            "Subscribers connected.", labels, shard_stats.clients_connected);
+        metrics.add_gauge("broker_mailbox_messages",
+            "Messages from other shards waiting when the shard last woke "
+            "up.", labels, shard_stats.mailbox_messages);
+        metrics.add_gauge("broker_outbox_messages",
+            "Messages for other shards waiting for room in their "
+            "mailboxes.", labels, shard_stats.outbox_messages);
+    }
+
+    /**
+     * @brief Prints the server's counters to stdout.
+     * 
+     */
+    void print_stats() {
+        double avg_batch = ingest_stats.batches == 0 ? 0 :
+            1.0 * ingest_stats.datagrams / ingest_stats.batches;
+
+        fprintf(stdout, "%sUDP ingest: %lu datagrams in %lu batches "
+            "(average batch %.2f, max batch %ld, batch size %d), "
+            "%lu dropped by the kernel.\n", stats_prefix,
+            ingest_stats.datagrams.value(), ingest_stats.batches.value(),
+            avg_batch, ingest_stats.max_batch.value(), udp_batch,
+            ingest_stats.kernel_drops.value());
+
+        // Sum up the bytes waiting to be written to the clients
+        size_t outbound_bytes = 0;
+        for (auto &client_entry : fd_to_client) {
+            outbound_bytes += client_entry.second->outbound_bytes;
+        }
+
+        double avg_frames = outbound_stats.writes == 0 ? 0 :
+            1.0 * outbound_stats.frames_written / outbound_stats.writes;
+
+        fprintf(stdout, "%sOutbound: %lu messages queued, %lu written with "
+            "%lu writes (average %.2f per write), %lu bytes waiting, "
+            "%lu dropped, %lu slow clients disconnected.\n",
+            stats_prefix, outbound_stats.queued.value(),
+            outbound_stats.frames_written.value(),
+            outbound_stats.writes.value(), avg_frames, outbound_bytes,
+            outbound_stats.dropped.value(),
+            outbound_stats.disconnected.value());
+
+        if (outbound_stats.batches != 0) {
+            fprintf(stdout, "%sBatches: %lu sent, %lu bytes of frames in "
+                "%lu bytes (ratio %.2f).\n", stats_prefix,
+                outbound_stats.batches.value(),
+                outbound_stats.batched_bytes.value(),
+                outbound_stats.batch_wire_bytes.value(),
+                1.0 * outbound_stats.batched_bytes /
+                    outbound_stats.batch_wire_bytes);
+        }
+
+        const pool_counters &pool_stats = MsgPool::local().counters();
+        fprintf(stdout, "%sMessage pool: %lu buffers allocated, %lu freed, "
+            "%lu slabs (%lu bytes).\n", stats_prefix, pool_stats.allocs,
+            pool_stats.frees, pool_stats.slabs, pool_stats.slab_bytes);
+
+        if (cache_capacity != 0) {
+            fprintf(stdout, "%sLast value cache: %lu of %lu topics (%lu "
+                "bytes), %lu snapshots sent, %lu topics not cached.\n",
+                stats_prefix, cached_topics.size(), cache_capacity,
+                cache_stats.bytes, cache_stats.snapshots,
+                cache_stats.rejected);
+        }
+
+        if (!sf_log) {
+            fprintf(stdout, "%sStore & forward: %lu messages stored, %lu "
+                "replayed, %ld kept in the topics' backlogs (%ld of %lu "
+                "bytes), %lu dropped, %lu conflated.\n", stats_prefix,
+                backlog_stats.stored.value(), backlog_stats.replayed.value(),
+                backlog_stats.messages.value(), backlog_stats.bytes.value(),
+                sf_global_budget, backlog_stats.dropped.value(),
+                backlog_stats.conflated.value());
+
+            // Only list the clients which ran out of budget
+            for (client *cl : clients) {
+                if (cl->sf_dropped != 0 || cl->sf_conflated != 0) {
+                    fprintf(stdout, "%sClient %s: %lu bytes stored, %lu "
+                        "stored messages dropped, %lu conflated.\n",
+                        stats_prefix, cl->id.c_str(), cl->stored_bytes,
+                        cl->sf_dropped, cl->sf_conflated);
+                }
+            }
+        } else {
+            const log_counters &log_stats = sf_log->counters();
+            fprintf(stdout, "%sStore & forward log: %lu messages logged "
+                "(%lu recovered), %lu replayed, %lu segments (%lu bytes), "
+                "%lu segments removed, %lu cursors behind retention.\n",
+                stats_prefix, log_stats.appended, log_stats.recovered,
+                sf_log_stats.replayed, sf_log->segment_count(),
+                sf_log->bytes(), log_stats.segments_removed,
+                sf_log_stats.cursors_behind);
+        }
+    }
+
+    /**
+     * @brief Turns a connection into the connection of the given client,
+     *   unless the client is already connected.
+     * 
+     * @param client_fd the connection's descriptor
+     * @param client_id the ID the client sent
+     * @param version the protocol version the client asked for, 0 if none
+     * @param flags the protocol flags the client asked for
+     * @return int - the error code
+     */
+    int initialize_connection(const int client_fd,
+            const std::string &client_id, const uint8_t version,
+            const uint8_t flags) {
+        // Check if a client with the same ID is already connected
+        if (id_to_client.find(client_id) != id_to_client.end() &&
+                id_to_client[client_id]->fd != -1) {
+            // Write a message to stdout
+            fprintf(stdout, "Client %s already connected.\n",
+                client_id.c_str());
+
+            // Disconnect the current client
+            close_connection(client_fd);
+            return -1;
+        }
+
+        // Otherwise, display a connection successful message
+        client_info *info = uninitialized_fds[client_fd];
+        fprintf(stdout, "New client %s connected from %s:%hu.\n",
+            client_id.c_str(), info->ip, info->port);
+
+        // Initialize the client
+        client *cl = initialize_client(client_fd, client_id);
+        fd_to_client[client_fd] = cl;
+        shard_stats.clients_connected = fd_to_client.size();
+        free(info);
+
+        uninitialized_fds.erase(client_fd);
+
+        // Clients which predate the negotiation keep the legacy frames
+        if (version == 0) {
+            return 0;
+        }
+
+        return negotiate_protocol(cl, version, flags);
+    }
+
+    /**
+     * @brief Picks the protocol for a client which asked for a version,
+     *   and tells the client about it. The answer is written right away,
+     *   as nothing can be queued for the connection before it.
+     * 
+     * @param cl the client
+     * @param version the protocol version the client asked for
+     * @param flags the protocol flags the client asked for
+     * @return int - the error code
+     */
+    int negotiate_protocol(client *cl, const uint8_t version,
+            const uint8_t flags) {
+        if (version >= PROTOCOL_V2) {
+            cl->protocol = PROTOCOL_V2;
+            cl->protocol_flags = flags & V2_KNOWN_FLAGS;
+
+            // Compressing only works on batches
+            if (cl->protocol_flags & V2_COMPRESS) {
+                cl->protocol_flags |= V2_BATCH;
+            }
+        } else {
+            cl->protocol = PROTOCOL_V1;
+            cl->protocol_flags = 0;
+        }
+
+        v2_ack ack;
+        ack.len = htons(sizeof(ack));
+        ack.magic = V2_ACK_MAGIC;
+        ack.version = cl->protocol;
+        ack.flags = cl->protocol_flags;
+
+        if (send(cl->fd, &ack, sizeof(ack), MSG_NOSIGNAL) !=
+                (ssize_t)sizeof(ack)) {
+            fprintf(stderr, "Error answering client %s.\n", cl->id.c_str());
+            close_client(cl->fd);
+            return -1;
+        }
+
+        return 0;
+    }
+
+    /**
+     * @brief Handles a single message received from the given client.
+     * 
+     * @param msg the message received from the client
+     * @param client_fd the client's descriptor
+     * @return int - the error code
+     */
+    int handle_client_message(const client_to_server_msg* msg,
+            const int client_fd) {
+        // Check if the file descriptor is uninitialized
+        if (uninitialized_fds.find(client_fd) != uninitialized_fds.end()) {
+            // Save the client ID in a string
+            std::string client_id(msg->client_id.id);
+            uint8_t version = msg->client_id.version;
+            uint8_t flags = msg->client_id.flags;
+
+            // The client's state lives on the shard which owns its ID
+            if (client_owner(client_id) != shard_id) {
+                hand_off_connection(client_fd, client_id, version, flags);
+                return -1;
+            }
+
+            return initialize_connection(client_fd, client_id, version,
+                flags);
+        }
+
+        // Compact commands start with an opcode, legacy ones with text
+        const v2_command *command = (const v2_command *)msg;
+        if (command->opcode == V2_SUBSCRIBE ||
+                command->opcode == V2_UNSUBSCRIBE) {
+            std::string topic(command->topic,
+                strnlen(command->topic, MAX_TOPIC_LEN));
+
+            if (command->opcode == V2_UNSUBSCRIBE) {
+                unsubscribe_client(fd_to_client[client_fd], topic);
+                return 0;
+            }
+
+            subscribe_client(fd_to_client[client_fd], topic, command->sf);
+            if (cache_capacity != 0) {
+                request_snapshots(fd_to_client[client_fd], topic);
+
+                // Snapshots cached on this shard are delivered right away,
+                // which may have closed the connection
+                if (fd_to_client.find(client_fd) == fd_to_client.end()) {
+                    return -1;
+                }
+            }
+
+            return 0;
+        }
+
+        // Check if the client wants to subscribe to / unsubscribe from a topic
+        if (strncmp(msg->client_sub.command,
+                SUB_CMD, strlen(SUB_CMD)) == 0) {
+            // Extract the topic and the SF flag
+            std::string topic(msg->client_sub.topic);
+            bool sf = atoi(msg->client_sub.sf);
+
+            // Subscribe the client to the topic
+            subscribe_client(fd_to_client[client_fd], topic, sf);
+
+            // Send the topic's last message right away, which may have
+            // closed the connection if it's cached on this shard
+            if (cache_capacity != 0) {
+                request_snapshots(fd_to_client[client_fd], topic);
+                if (fd_to_client.find(client_fd) == fd_to_client.end()) {
+                    return -1;
+                }
+            }
+        } else if (strncmp(msg->client_unsub.command,
+                UNSUB_CMD, strlen(UNSUB_CMD)) == 0) {
+            // Extract the topic
+            std::string topic(msg->client_unsub.topic);
+
+            // Unsubscribe the client from the topic
+            unsubscribe_client(fd_to_client[client_fd], topic);
+        }
+
+        return 0;
+    }
+
+    /**
+     * @brief Handles all messages received from the given client, reading
+     *   until the socket is drained, as it's edge-triggered.
+     * 
+     * @param client_fd - the client's descriptor
+     * @return int - the error code
+     */
+    int handle_client(const int client_fd) {
+        // The connection may have been closed while handling an earlier
+        // event of the same iteration
+        auto found = fd_to_decoder.find(client_fd);
+        if (found == fd_to_decoder.end()) {
+            return -1;
+        }
+
+        FrameDecoder *decoder = found->second;
+
+        while (true) {
+            // Receive the next chunk of the stream
+            ssize_t n = decoder->recv_from(client_fd);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    // Everything was read
+                    return 0;
+                }
+
+                fprintf(stderr, "Error reading from TCP socket.\n");
+            }
+
+            if (n <= 0) {
+                // The connection was closed or broke, disconnect the client
+                if (fd_to_client.find(client_fd) != fd_to_client.end()) {
+                    close_client(client_fd);
+                } else {
+                    close_connection(client_fd);
+                }
+
+                return -1;
+            }
+
+            // Handle each complete message
+            if (process_frames(client_fd) < 0) {
+                // The connection was closed or handed off
+                return -1;
+            }
+        }
+    }
+
+    /**
+     * @brief Handles the complete messages the client's decoder holds.
+     * 
+     * @param client_fd - the client's descriptor
+     * @return int - the error code, -1 if the connection is no longer
+     *   served by this shard
+     */
+    int process_frames(const int client_fd) {
+        FrameDecoder *decoder = fd_to_decoder[client_fd];
+
+        frame_view frame;
+        int err;
+        while ((err = decoder->next(frame)) == 1) {
+            // Commands are short, so work on a padded copy which is
+            // safe to read regardless of the frame's length
+            client_to_server_msg msg;
+            memset(&msg, 0, sizeof(msg));
+            memcpy(&msg, frame.data, frame.len);
+
+            if (handle_client_message(&msg, client_fd) < 0) {
+                // The connection was closed or handed off, so neither it
+                // nor its decoder may be touched anymore
+                return -1;
+            }
+        }
+
+        if (err < 0) {
+            fprintf(stderr, "Malformed message received from client.\n");
+            if (fd_to_client.find(client_fd) != fd_to_client.end()) {
+                close_client(client_fd);
+            } else {
+                close_connection(client_fd);
+            }
+
+            return -1;
+        }
+
+        return 0;
+    }
+
+    /**
+     * @brief Accepts all pending connections on the TCP socket.
      * 
-     * @param fd the descriptor to check
      * @param tcp_socket the tcp socket
-     * @param udp_socket the udp socket
-     * @param fd_max the maximum descriptor, given as a reference
-     * @param read_fds the read descriptors
      * @return int - the error code
      */
-    int check_fd(const int fd, const int tcp_socket,
-            const int udp_socket, int &fd_max, fd_set *read_fds) {
+    int accept_clients(const int tcp_socket) {
+        // The socket is edge-triggered, so accept until nothing is pending
+        while (true) {
+            // Grab the client information
+            client_info *new_client_info;
+            if (handle_tcp_socket(tcp_socket, &new_client_info) < 0) {
+                return 0;
+            }
+
+            // Go on with the next one if this one failed
+            if (new_client_info == NULL) {
+                continue;
+            }
+
+            // Mark the client as uninitialized
+            uninitialized_fds[new_client_info->fd] = new_client_info;
+
+            // Disable Nagle for the client's descriptor
+            int enable = 1;
+            if (setsockopt(new_client_info->fd, IPPROTO_TCP,
+                    TCP_NODELAY, &enable, sizeof(int)) < 0) {
+                fprintf(stderr, "Error disabling Nagle on Client.\n");
+            }
+
+            // Create the connection's frame decoder
+            fd_to_decoder[new_client_info->fd] = new FrameDecoder(
+                SERVER_DECODER_CAPACITY, sizeof(client_to_server_msg));
+
+            // Start watching the client's descriptor
+            if (loop.add(new_client_info->fd, EV_READ | EV_EDGE) < 0) {
+                fprintf(stderr, "Error watching the client descriptor.\n");
+                close_connection(new_client_info->fd);
+            }
+        }
+    }
+
+    /**
+     * @brief Dispatches a ready descriptor to its handler, be it
+     *   STDIN, TCP, UDP, the shard's wakeup or a client.
+     * 
+     * @param event the ready descriptor and its events
+     * @return int - the error code
+     */
+    int check_fd(const io_event &event) {
+        const int fd = event.fd;
         // Declare a variable for return values
         int err;
 
@@ -449,53 +3445,57 @@ class Server {
         
         // Check for the TCP socket
         if (fd == tcp_socket) {
-            // Grab the client information
-            client_info *new_client_info = handle_tcp_socket(tcp_socket);
-            if (new_client_info == NULL) {
-                // If the client could not be accepted, do nothing
-                return -1;
-            }
-
-            // Mark the client as uninitialized
-            uninitialized_fds[new_client_info->fd] = new_client_info;
+            return accept_clients(tcp_socket);
+        }
+        
+        // Check for the UDP socket, draining it since it's edge-triggered
+        if (fd == udp_socket) {
+            while (handle_udp_socket(udp_socket) == 0);
+            return 0;
+        }
 
-            // Disable Nagle for the client's descriptor
-            int enable = 0;
-            if (setsockopt(new_client_info->fd, IPPROTO_TCP,
-                    TCP_NODELAY, &enable, sizeof(int)) < 0) {
-                fprintf(stderr, "Error disabling Nagle on Client.\n");
-                return -1;
-            }
+        // Check for messages from the other shards
+        if (fd == wake_fd) {
+            drain_inboxes();
+            return 0;
+        }
 
-            // Add it to the read descriptors and update the maximum descriptor
-            FD_SET(new_client_info->fd, read_fds);
-            fd_max = std::max(fd_max, new_client_info->fd);
+        // Check for batch deadlines, whose clients are flushed at the end
+        // of the iteration
+        if (fd == batch_timer_fd) {
+            uint64_t expirations;
+            if (read(batch_timer_fd, &expirations, sizeof(expirations)) < 0 &&
+                    errno != EAGAIN) {
+                fprintf(stderr, "Error reading the batch timer.\n");
+            }
 
             return 0;
         }
         
-        // Check for the UDP socket
-        if (fd == udp_socket) {
-            handle_udp_socket(udp_socket);
-            return 0;
+        // Check if a client's socket can take more of its outbound queue
+        if ((event.events & EV_WRITE) &&
+                fd_to_client.find(fd) != fd_to_client.end()) {
+            if (flush_client(fd_to_client[fd]) < 0) {
+                close_client(fd);
+                return 0;
+            }
         }
-        
+
         // Check for client messages
-        if (fd > STDERR_FILENO) {
-            handle_client(read_fds, fd);
+        if ((event.events & EV_READ) && fd > STDERR_FILENO) {
+            handle_client(fd);
         }
 
         return 0;
     }
 
-public:
     /**
-     * @brief Initializes the server.
+     * @brief Opens the TCP socket, and starts watching it along with STDIN.
      * 
-     * @param server_port the port on which to initialize
+     * @param server_port the port to bind to
      * @return int - the error code
      */
-    int init(const uint16_t server_port) {
+    int open_sockets(const uint16_t server_port) {
         // Set the server address
         sockaddr_in server_address;
         memset((uint8_t *)&server_address, 0, sizeof(server_address));
@@ -504,7 +3504,7 @@ public:
         server_address.sin_port = htons(server_port);
 
         // Open the TCP socket
-        const int tcp_socket = socket(AF_INET, SOCK_STREAM, 0);
+        tcp_socket = socket(AF_INET, SOCK_STREAM, 0);
         if (tcp_socket == -1) {
             fprintf(stderr, "Error opening TCP socket.\n");
             return -1;
@@ -519,115 +3519,503 @@ public:
         }
 
         // Disable Nagle
-        enable = 0;
+        enable = 1;
         if (setsockopt(tcp_socket,
                 IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int)) < 0) {
             fprintf(stderr, "Error disabling Nagle on TCP socket.\n");
             return -1;
         }
 
+        // Bind the socket to the given port
+        int err = bind(tcp_socket,
+            (sockaddr *)&server_address, sizeof(sockaddr));
+        if (err < 0) {
+            fprintf(stderr, "Error binding TCP socket.\n");
+            return -1;
+        }
+
+        // Listen for the TCP clients
+        err = listen(tcp_socket, MAX_PENDING_CLIENTS);
+        if (err < 0) {
+            fprintf(stderr, "Error listening on the TCP socket.\n");
+            return -1;
+        }
+
+        // The socket is edge-triggered, so it must not block
+        if (set_non_blocking(tcp_socket) < 0) {
+            fprintf(stderr, "Error making the TCP socket non-blocking.\n");
+            return -1;
+        }
+
+        // Keep a descriptor in reserve, to turn clients away when there are
+        // no descriptors left
+        reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (reserve_fd < 0) {
+            fprintf(stderr, "Error opening the reserve descriptor.\n");
+            return -1;
+        }
+
+        // Watch the TCP descriptor and STDIN
+        if (loop.add(tcp_socket, EV_READ | EV_EDGE) < 0 ||
+                loop.add(STDIN_FILENO, EV_READ) < 0) {
+            fprintf(stderr, "Error watching the server descriptors.\n");
+            return -1;
+        }
+
+        return 0;
+    }
+
+    /**
+     * @brief Opens the shard's UDP socket, and starts watching it.
+     * 
+     * @param server_port the port to bind to
+     * @param reuse_port whether every shard opens its own socket on the port
+     * @return int - the error code
+     */
+    int open_udp_socket(const uint16_t server_port, const bool reuse_port) {
+        // Set the server address
+        sockaddr_in server_address;
+        memset((uint8_t *)&server_address, 0, sizeof(server_address));
+        server_address.sin_family = AF_INET;
+        server_address.sin_addr.s_addr = INADDR_ANY;
+        server_address.sin_port = htons(server_port);
+
         // Open the UDP socket
-        const int udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
+        udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
         if (udp_socket == -1) {
             fprintf(stderr, "Error opening UDP socket.\n");
             return -1;
         }
 
-        // Bind the two sockets to the given port
-        int err = bind(tcp_socket,
-            (sockaddr *)&server_address, sizeof(sockaddr));
-        if (err < 0) {
-            fprintf(stderr, "Error binding TCP socket.\n");
+        // Let the kernel spread the datagrams over the shards' sockets
+        int enable = 1;
+        if (reuse_port && setsockopt(udp_socket,
+                SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0) {
+            fprintf(stderr, "Error setting UDP socket port as reusable.\n");
             return -1;
         }
 
-        err = bind(udp_socket,
+        // Have the kernel report how many datagrams it dropped
+        if (setsockopt(udp_socket,
+                SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(int)) < 0) {
+            fprintf(stderr, "Error enabling UDP drop counters.\n");
+        }
+
+        // Bind the socket to the given port
+        int err = bind(udp_socket,
             (sockaddr *)&server_address, sizeof(sockaddr));
         if (err < 0) {
             fprintf(stderr, "Error binding UDP socket.\n");
             return -1;
         }
 
-        // Listen for the TCP clients
-        err = listen(tcp_socket, MAX_PENDING_CLIENTS);
-        if (err < 0) {
-            fprintf(stderr, "Error listening on the TCP socket.\n");
+        // The socket is edge-triggered, so it must not block
+        if (set_non_blocking(udp_socket) < 0) {
+            fprintf(stderr, "Error making the UDP socket non-blocking.\n");
+            return -1;
+        }
+
+        // Watch the UDP descriptor
+        if (loop.add(udp_socket, EV_READ | EV_EDGE) < 0) {
+            fprintf(stderr, "Error watching the UDP descriptor.\n");
             return -1;
         }
 
-        // Create and clear the read file descriptors
-        fd_set read_fds;
-        fd_set tmp_read_fds;
-        int fd_max = std::max(tcp_socket, udp_socket);
-        FD_ZERO(&read_fds);
+        return 0;
+    }
+
+public:
+    /**
+     * @brief Creates one of the broker's shards.
+     * 
+     * @param shard_id the shard's index
+     * @param shared the broker
+     */
+    Server(const int shard_id, broker *shared)
+            : shard_id(shard_id), shared(shared), wake_fd(-1),
+              stopping(false), tcp_socket(-1), udp_socket(-1),
+              reserve_fd(-1), delivery_count(0), sf_log(NULL),
+              state_dirty(false), state_saved_ms(0), batch_timer_fd(-1) {}
+
+    ~Server() {
+        for (auto inbox : inboxes) {
+            delete inbox;
+        }
 
-        // Add the TCP and UDP descriptors for accepting connections
-        FD_SET(tcp_socket, &read_fds);
-        FD_SET(udp_socket, &read_fds);
+        delete sf_log;
 
-        // Add STDIN fd to read descriptors
-        FD_SET(STDIN_FILENO, &read_fds);
+        if (wake_fd != -1) {
+            close(wake_fd);
+        }
 
-        // Begin an infinite loop, holding the logic of the server
-        while (true) {
-            // Store the read fds in a temporary variable
-            tmp_read_fds = read_fds;
+        if (batch_timer_fd != -1) {
+            close(batch_timer_fd);
+        }
+    }
 
-            // Detect new changes to the read fds
-            err = select(fd_max + 1, &tmp_read_fds, NULL, NULL, NULL);
-            if (err < 0) {
-                fprintf(stderr, "Error selecting the "
-                    "read file descriptors.\n");
+    /**
+     * @brief Initializes the shard. The first shard also listens for
+     *   clients, and either it or every shard listens for publishers.
+     * 
+     * @param config the configuration to initialize with
+     * @return int - the error code
+     */
+    int init(const server_config &config) {
+        // Apply the configuration
+        udp_batch = config.udp_batch;
+        high_water = config.high_water;
+        slow_policy = config.slow_policy;
+        memset(&sf_log_stats, 0, sizeof(sf_log_stats));
+        sf_client_budget = config.sf_client_budget;
+        sf_global_budget = config.sf_global_budget / shared->shard_count;
+        sf_policy = config.sf_policy;
+        batch_bytes = config.batch_bytes;
+        batch_delay_us = config.batch_delay_us;
+        batch_frames.resize(MAX_BATCH_LEN);
+        cache_capacity = config.cache_capacity;
+        cached_topics.reserve(cache_capacity);
+        memset(&cache_stats, 0, sizeof(cache_stats));
+        init_udp_ring();
+
+        // Open the shard's own log of stored messages
+        if (config.log_dir) {
+            std::string shard_dir = std::string(config.log_dir) +
+                "/shard-" + std::to_string(shard_id);
+
+            sf_log = new MessageLog();
+            if (sf_log->open(shard_dir, config.log_bytes,
+                    config.log_age_ms) < 0) {
                 return -1;
             }
 
-            // Save a variable which decides if the server should close
-            bool should_close = false;
+            state_path = shard_dir + "/clients";
+        }
 
-            // Go through each descriptor and check if it's set
-            for (int fd = 0; fd <= fd_max; ++fd) {
-                if (FD_ISSET(fd, &tmp_read_fds)) {
-                    err = check_fd(fd, tcp_socket,
-                        udp_socket, fd_max, &read_fds);
-                    if (err == -2) {
-                        should_close = true;
-                        break;
-                    }
+        // Expose the shard's counters
+        register_metrics();
+
+        // Only tell the shards' counters apart when there are several
+        stats_prefix[0] = '\0';
+        if (shared->shard_count > 1) {
+            snprintf(stats_prefix, sizeof(stats_prefix), "Shard %d - ",
+                shard_id);
+        }
+
+        // Create a mailbox for every other shard
+        for (int shard = 0; shard < shared->shard_count; ++shard) {
+            inboxes.push_back(shard == shard_id ? NULL :
+                new SpscQueue<shard_msg>(SHARD_INBOX_CAPACITY));
+        }
+
+        outboxes.resize(shared->shard_count);
+        wake_targets.assign(shared->shard_count, false);
+
+        // Create the event loop
+        if (loop.init() < 0) {
+            return -1;
+        }
+
+        // Create and watch the shard's wakeup
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wake_fd < 0 || loop.add(wake_fd, EV_READ) < 0) {
+            fprintf(stderr, "Error creating the shard wakeup.\n");
+            return -1;
+        }
+
+        // Create and watch the timer of the batch deadlines
+        batch_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+            TFD_NONBLOCK | TFD_CLOEXEC);
+        if (batch_timer_fd < 0 || loop.add(batch_timer_fd, EV_READ) < 0) {
+            fprintf(stderr, "Error creating the batch timer.\n");
+            return -1;
+        }
+
+        if (shard_id == 0 && open_sockets(config.port) < 0) {
+            return -1;
+        }
+
+        if (shard_id == 0 || config.reuse_port) {
+            return open_udp_socket(config.port, config.reuse_port);
+        }
+
+        return 0;
+    }
+
+    /**
+     * @brief Runs the shard's loop until the server is closed.
+     * 
+     * @return int - the error code
+     */
+    int run() {
+        TRACE_THREAD(("shard " + std::to_string(shard_id)).c_str());
+
+        // Begin an infinite loop, holding the logic of the shard
+        std::vector<io_event> ready_events;
+        int timeout = -1;
+
+        // Bring back the clients which had messages stored for them
+        if (sf_log) {
+            int recovered = load_state();
+            if (recovered > 0) {
+                fprintf(stdout, "%sRecovered %d clients from the log.\n",
+                    stats_prefix, recovered);
+            }
+
+            state_dirty = false;
+            state_saved_ms = monotonic_ms();
+            timeout = flush_outboxes() ? 1 : -1;
+        }
+
+        while (!stopping) {
+            // Wait for descriptors to become ready, coming back soon if
+            // another shard's mailbox was full
+            int err;
+            {
+                TRACE_SCOPE("wait");
+                err = loop.wait(ready_events, timeout);
+            }
+
+            if (err < 0) {
+                fprintf(stderr, "Error waiting for the descriptors.\n");
+                stopping = true;
+                broadcast(SHARD_STOP);
+            }
+
+            // Only go through the descriptors that are ready
+            for (auto &event : ready_events) {
+                err = check_fd(event);
+                if (err == -2) {
+                    stopping = true;
+                    break;
                 }
             }
 
-            // Check if the server should close
-            if (should_close) {
-                break;
+            // Write everything that was queued during this iteration,
+            // then let go of the clients which couldn't keep up
+            flush_dirty_clients();
+            close_slow_clients();
+
+            // Pass on everything posted to the other shards
+            timeout = flush_outboxes() ? 1 : -1;
+
+            // Come back at once if some replays can go on
+            if (continue_replays()) {
+                timeout = 0;
+            }
+
+            // Write the batches which are due, once nothing else can queue
+            // messages during this iteration
+            flush_held_batches();
+
+            // Save the clients' state once it's due
+            int state_timeout = maintain_log();
+            if (state_timeout >= 0 && (timeout < 0 ||
+                    state_timeout < timeout)) {
+                timeout = state_timeout;
             }
         }
 
+        // Make sure the other shards are told to stop
+        while (flush_outboxes()) {
+            std::this_thread::yield();
+        }
+
         // Close all connections with clients
         for (auto &client_entry : fd_to_client) {
             close(client_entry.first);
         }
 
+        // Close the connections which weren't initialized yet
+        for (auto &info_entry : uninitialized_fds) {
+            close(info_entry.first);
+            free(info_entry.second);
+        }
+
         // Close the TCP and UDP sockets
-        close(tcp_socket);
-        close(udp_socket);
+        if (tcp_socket != -1) {
+            close(tcp_socket);
+        }
+
+        if (udp_socket != -1) {
+            close(udp_socket);
+        }
+
+        if (reserve_fd != -1) {
+            close(reserve_fd);
+        }
+
+        // Keep the stored messages' cursors for the next run
+        if (sf_log) {
+            for (client *cl : clients) {
+                if (cl->fd != -1 && !cl->replaying) {
+                    cl->log_cursor = sf_log->end_seq();
+                }
+
+                cl->fd = -1;
+                cl->replaying = false;
+            }
+
+            save_state();
+        }
 
         // Free the memory of all the clients
         for (auto client_entry : id_to_client) {
             delete client_entry.second;
         }
 
+        // Free the frame decoders of all connections
+        for (auto decoder_entry : fd_to_decoder) {
+            delete decoder_entry.second;
+        }
+
         return 0;
     }
+
+    /**
+     * @brief Frees the messages posted to the shard which it will never
+     *   handle. Only called once every shard stopped.
+     * 
+     */
+    void discard_inboxes() {
+        shard_msg msg;
+        for (auto inbox : inboxes) {
+            while (inbox && inbox->pop(msg)) {
+                discard_shard_msg(msg);
+            }
+        }
+
+        for (auto &pending : outboxes) {
+            for (auto &pending_msg : pending) {
+                discard_shard_msg(pending_msg);
+            }
+
+            pending.clear();
+        }
+    }
 };
 
+/**
+ * @brief Creates the log directory, checking that a log already in it was
+ *   written by as many shards as are running now.
+ * 
+ * @param config the configuration to run with
+ * @return int - the error code
+ */
+int check_log_dir(const server_config &config) {
+    if (mkdir(config.log_dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Error creating log directory %s.\n",
+            config.log_dir);
+        return -1;
+    }
+
+    std::string shards_path = std::string(config.log_dir) + "/shards";
+    FILE *shards_file = fopen(shards_path.c_str(), "r");
+    if (shards_file) {
+        int shard_count = 0;
+        int read = fscanf(shards_file, "%d", &shard_count);
+        fclose(shards_file);
+
+        if (read != 1 || shard_count != config.threads) {
+            fprintf(stderr, "Log directory %s was written by %d threads, "
+                "so it must be used with as many.\n", config.log_dir,
+                shard_count);
+            return -1;
+        }
+
+        return 0;
+    }
+
+    shards_file = fopen(shards_path.c_str(), "w");
+    if (!shards_file) {
+        fprintf(stderr, "Error writing to log directory %s.\n",
+            config.log_dir);
+        return -1;
+    }
+
+    fprintf(shards_file, "%d\n", config.threads);
+    fclose(shards_file);
+    return 0;
+}
+
+/**
+ * @brief Runs the broker: the first shard on the calling thread and every
+ *   other one on its own thread.
+ * 
+ * @param config the configuration to run with
+ * @return int - the error code
+ */
+int run_broker(const server_config &config) {
+    broker shared;
+    shared.shard_count = config.threads;
+
+    // Topics and clients are split among the shards, so the log can only
+    // be reused with the same number of them
+    if (config.log_dir && check_log_dir(config) < 0) {
+        return -1;
+    }
+
+    // Create and initialize the shards
+    int err = 0;
+    for (int shard = 0; shard < shared.shard_count; ++shard) {
+        shared.shards.push_back(new Server(shard, &shared));
+    }
+
+    for (auto shard : shared.shards) {
+        if (shard->init(config) < 0) {
+            err = -1;
+            break;
+        }
+    }
+
+    // Serve the metrics, if asked to, until the shards stop
+    MetricsServer metrics_server(shared.metrics);
+    if (err == 0 && config.metrics_port != 0 &&
+            metrics_server.start(config.metrics_port) < 0) {
+        err = -1;
+    }
+
+    if (err == 0) {
+        // Start the other shards' threads
+        std::vector<std::thread> threads;
+        for (int shard = 1; shard < shared.shard_count; ++shard) {
+            threads.emplace_back(&Server::run, shared.shards[shard]);
+        }
+
+        err = shared.shards[0]->run();
+
+        for (auto &thread : threads) {
+            thread.join();
+        }
+
+        // Free what was posted after the shards stopped
+        for (auto shard : shared.shards) {
+            shard->discard_inboxes();
+        }
+    }
+
+    metrics_server.stop();
+
+    // Keep what was traced until the end
+    if (TRACE_ENABLED) {
+        trace_dump(NULL);
+    }
+
+    // Deallocate the shards
+    for (auto shard : shared.shards) {
+        delete shard;
+    }
+
+    return err;
+}
+
 int main(int argc, char **argv) {
     // Deactivate stdout buffer
     setvbuf(stdout, NULL, _IONBF, BUFSIZ);
 
     // Extract the port from the command line arguments
-    if (argc != 2) {
+    if (argc < 2) {
         fprintf(stderr, "Incorrect command arguments.\n");
-        fprintf(stderr, "Usage: %s <SERVER_PORT>\n", argv[0]);
+        fprintf(stderr, SERVER_USAGE, argv[0]);
         return -1;
     }
 
@@ -637,20 +4025,196 @@ int main(int argc, char **argv) {
         return -1;
     }
 
-    uint16_t server_port = atoi(argv[1]);
+    server_config config;
+    config.port = atoi(argv[1]);
+    config.udp_batch = DEFAULT_UDP_BATCH;
+    config.high_water = DEFAULT_HIGH_WATER;
+    config.slow_policy = SLOW_DISCONNECT;
+    config.threads = 1;
+    config.reuse_port = false;
+    config.batch_bytes = DEFAULT_BATCH_BYTES;
+    config.batch_delay_us = DEFAULT_BATCH_DELAY_US;
+    config.cache_capacity = 0;
+    config.log_dir = NULL;
+    config.log_bytes = DEFAULT_LOG_BYTES;
+    config.log_age_ms = 0;
+    config.sf_client_budget = DEFAULT_SF_CLIENT_BYTES;
+    config.sf_global_budget = DEFAULT_SF_GLOBAL_BYTES;
+    config.sf_policy = SF_DROP_OLDEST;
+    config.metrics_port = 0;
+
+    // Extract the options following the port
+    optind = 2;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:w:s:t:rc:B:D:d:L:A:q:g:p:m:")) != -1) {
+        switch (opt) {
+            case 'b':
+                config.udp_batch = atoi(optarg);
+                if (!is_number(optarg, strlen(optarg)) ||
+                        config.udp_batch < 1 ||
+                        config.udp_batch > MAX_UDP_BATCH) {
+                    fprintf(stderr, "UDP batch must be between 1 and %d.\n",
+                        MAX_UDP_BATCH);
+                    return -1;
+                }
+                break;
+
+            case 'w':
+                if (!is_number(optarg, strlen(optarg)) ||
+                        atoll(optarg) < BUFLEN) {
+                    fprintf(stderr, "High-water mark must be at least "
+                        "%d bytes.\n", BUFLEN);
+                    return -1;
+                }
+
+                config.high_water = atoll(optarg);
+                break;
+
+            case 's':
+                if (strcmp(optarg, SLOW_DROP_STR) == 0) {
+                    config.slow_policy = SLOW_DROP;
+                } else if (strcmp(optarg, SLOW_DISCONNECT_STR) == 0) {
+                    config.slow_policy = SLOW_DISCONNECT;
+                } else {
+                    fprintf(stderr, "Slow consumer policy must be either "
+                        "%s or %s.\n", SLOW_DROP_STR, SLOW_DISCONNECT_STR);
+                    return -1;
+                }
+                break;
+
+            case 't':
+                config.threads = atoi(optarg);
+                if (!is_number(optarg, strlen(optarg)) ||
+                        config.threads < 1 || config.threads > MAX_SHARDS) {
+                    fprintf(stderr, "Threads must be between 1 and %d.\n",
+                        MAX_SHARDS);
+                    return -1;
+                }
+                break;
+
+            case 'r':
+                config.reuse_port = true;
+                break;
+
+            case 'c':
+                if (!is_number(optarg, strlen(optarg))) {
+                    fprintf(stderr, "Cached topics must be a number, 0 to "
+                        "disable the cache.\n");
+                    return -1;
+                }
+
+                config.cache_capacity = atoll(optarg);
+                break;
+
+            case 'B':
+                config.batch_bytes = atoll(optarg);
+                if (!is_number(optarg, strlen(optarg)) ||
+                        config.batch_bytes < 1 ||
+                        config.batch_bytes > MAX_BATCH_LEN) {
+                    fprintf(stderr, "Batch size must be between 1 and %d "
+                        "bytes.\n", MAX_BATCH_LEN);
+                    return -1;
+                }
+                break;
+
+            case 'D':
+                if (!is_number(optarg, strlen(optarg))) {
+                    fprintf(stderr, "Batch delay must be a number of "
+                        "microseconds.\n");
+                    return -1;
+                }
+
+                config.batch_delay_us = atoll(optarg);
+                break;
+
+            case 'd':
+                config.log_dir = optarg;
+                break;
+
+            case 'L':
+                if (!is_number(optarg, strlen(optarg)) ||
+                        atoll(optarg) < LOG_SEGMENT_SIZE) {
+                    fprintf(stderr, "Log size must be at least %d bytes.\n",
+                        LOG_SEGMENT_SIZE);
+                    return -1;
+                }
+
+                config.log_bytes = atoll(optarg);
+                break;
+
+            case 'q':
+            case 'g':
+                if (!is_number(optarg, strlen(optarg)) ||
+                        atoll(optarg) < BUFLEN) {
+                    fprintf(stderr, "Store & forward budgets must be at "
+                        "least %d bytes.\n", BUFLEN);
+                    return -1;
+                }
+
+                if (opt == 'q') {
+                    config.sf_client_budget = atoll(optarg);
+                } else {
+                    config.sf_global_budget = atoll(optarg);
+                }
+                break;
+
+            case 'p':
+                if (strcmp(optarg, SF_DROP_OLDEST_STR) == 0) {
+                    config.sf_policy = SF_DROP_OLDEST;
+                } else if (strcmp(optarg, SF_DROP_NEWEST_STR) == 0) {
+                    config.sf_policy = SF_DROP_NEWEST;
+                } else if (strcmp(optarg, SF_CONFLATE_STR) == 0) {
+                    config.sf_policy = SF_CONFLATE;
+                } else if (strcmp(optarg, SF_DISCONNECT_STR) == 0) {
+                    config.sf_policy = SF_DISCONNECT;
+                } else {
+                    fprintf(stderr, "Store & forward policy must be one of "
+                        "%s, %s, %s or %s.\n", SF_DROP_OLDEST_STR,
+                        SF_DROP_NEWEST_STR, SF_CONFLATE_STR,
+                        SF_DISCONNECT_STR);
+                    return -1;
+                }
+                break;
+
+            case 'A':
+                if (!is_number(optarg, strlen(optarg))) {
+                    fprintf(stderr, "Log age must be a number of seconds, "
+                        "0 for no limit.\n");
+                    return -1;
+                }
+
+                config.log_age_ms = atoll(optarg) * 1000;
+                break;
+
+            case 'm':
+                if (!is_number(optarg, strlen(optarg)) ||
+                        atoi(optarg) < 1 || atoi(optarg) > 65535) {
+                    fprintf(stderr, "Metrics port must be between 1 and "
+                        "65535.\n");
+                    return -1;
+                }
 
-    // Create a new server
-    Server *server = new Server;
-    if (!server) {
-        fprintf(stderr, "Memory allocation for the server failed.\n");
+                config.metrics_port = atoi(optarg);
+                break;
+
+            default:
+                fprintf(stderr, SERVER_USAGE, argv[0]);
+                return -1;
+        }
+    }
+
+    if (optind != argc) {
+        fprintf(stderr, "Extra command arguments given.\n");
         return -1;
     }
 
-    // Initialize the server
-    server->init(server_port);
+    // Allow as many concurrent clients as the hard limit permits
+    raise_fd_limit();
 
-    // Deallocate the server
-    delete server;
+    // Run the server
+    if (run_broker(config) < 0) {
+        return -1;
+    }
 
     return 0;
 }
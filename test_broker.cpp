@@ -0,0 +1,929 @@
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cstddef>
+#include <cerrno>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "include/utils.h"
+#include "include/frame_decoder.h"
+#include "include/protocol_v2.h"
+
+/*
+ * End-to-end tests of the broker. The server is started as a child
+ * process, fed its commands through a pipe, and spoken to over loopback
+ * by publishers and subscribers built from the protocol's structures.
+ *
+ * The messages carry their sequence number as a string, so the messages a
+ * subscriber got can be checked against the ones the broker accepted. A
+ * witness subscriber, connected throughout, tells which those are, since
+ * datagrams may be dropped before the broker reads them. Messages of other
+ * data types are recorded as -1.
+ */
+
+#define TEST_TOPIC "test/seq"
+#define TEST_STRING_LEN 1000
+#define TEST_STORED 10000
+#define TEST_LIVE 300
+#define TEST_OFFLINE 100
+#define TEST_PACED_FRAMES 500
+#define TEST_RCVBUF 4096
+#define TEST_BURST 32
+#define TEST_TIMEOUT_MS 5000
+#define TEST_SLOW_SUBSCRIBERS 20
+#define TEST_FLOOD_ROUNDS 200
+#define TEST_FLOOD_LEN 1400
+
+/**
+ * @brief A running server, and the pipe its commands are written to.
+ *
+ */
+struct test_server {
+    pid_t pid;
+    int commands;
+    uint16_t port;
+};
+
+/**
+ * @brief A connected subscriber, and the sequence numbers it received.
+ *
+ */
+struct test_subscriber {
+    int fd;
+    FrameDecoder *decoder;
+    std::vector<long> received;
+    bool closed;
+
+    // The protocol it asked for, whether the server acked it, and the
+    // topic references announced to it, with the compact protocol
+    int version;
+    bool acked;
+    std::vector<uint32_t> announced;
+};
+
+/**
+ * @brief Starts the server on a port derived from the test's PID.
+ *
+ * @param server where to store the server
+ * @param args the server's options, after the port
+ * @return int - the error code
+ */
+static int start_server(test_server &server,
+        const std::vector<std::string> &args) {
+    server.port = 20000 + getpid() % 20000;
+
+    int commands[2];
+    if (pipe(commands) < 0) {
+        fprintf(stderr, "Error creating the server's command pipe.\n");
+        return -1;
+    }
+
+    server.pid = fork();
+    if (server.pid < 0) {
+        fprintf(stderr, "Error starting the server.\n");
+        return -1;
+    }
+
+    if (server.pid == 0) {
+        // Read the commands from the pipe and keep quiet, apart from errors
+        dup2(commands[0], STDIN_FILENO);
+        close(commands[0]);
+        close(commands[1]);
+
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+
+        std::string port = std::to_string(server.port);
+        std::vector<char *> argv;
+        argv.push_back((char *)"./server");
+        argv.push_back((char *)port.c_str());
+        for (const std::string &arg : args) {
+            argv.push_back((char *)arg.c_str());
+        }
+
+        argv.push_back(NULL);
+        execv("./server", argv.data());
+        fprintf(stderr, "Error running ./server.\n");
+        _exit(1);
+    }
+
+    close(commands[0]);
+    server.commands = commands[1];
+    return 0;
+}
+
+/**
+ * @brief Stops the server and waits for it to exit.
+ *
+ * @param server the server
+ * @return int - the error code
+ */
+static int stop_server(test_server &server) {
+    int status;
+    if (write(server.commands, "exit\n", 5) != 5) {
+        kill(server.pid, SIGKILL);
+    }
+
+    close(server.commands);
+    if (waitpid(server.pid, &status, 0) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "The server didn't exit cleanly.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Returns the address of the server, on loopback.
+ *
+ * @param server the server
+ * @return sockaddr_in - the address
+ */
+static sockaddr_in server_address(const test_server &server) {
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(server.port);
+    return address;
+}
+
+/**
+ * @brief Connects a subscriber, retrying while the server starts.
+ *
+ * @param server the server
+ * @param sub where to store the subscriber
+ * @param id the subscriber's ID
+ * @param rcvbuf the size of its receive buffer, 0 for the default
+ * @param version the protocol to ask for
+ * @return int - the error code
+ */
+static int connect_subscriber(const test_server &server,
+        test_subscriber &sub, const char *id, const int rcvbuf,
+        const int version = PROTOCOL_V1) {
+    sockaddr_in address = server_address(server);
+
+    sub.fd = -1;
+    sub.decoder = NULL;
+    sub.closed = false;
+    sub.version = version;
+    sub.acked = false;
+    sub.announced.clear();
+    for (int attempt = 0; attempt < 250 && sub.fd < 0; ++attempt) {
+        sub.fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (sub.fd < 0) {
+            fprintf(stderr, "Error opening a TCP socket.\n");
+            return -1;
+        }
+
+        // A small receive buffer must be set before connecting
+        if (rcvbuf != 0) {
+            setsockopt(sub.fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(int));
+        }
+
+        if (connect(sub.fd, (sockaddr *)&address, sizeof(address)) < 0) {
+            close(sub.fd);
+            sub.fd = -1;
+            usleep(20000);
+        }
+    }
+
+    if (sub.fd < 0) {
+        fprintf(stderr, "Error connecting to the server.\n");
+        return -1;
+    }
+
+    int enable = 1;
+    setsockopt(sub.fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
+
+    client_to_server_msg msg;
+    memset(&msg, 0, sizeof(msg));
+    strncpy(msg.client_id.id, id, MAX_ID_LEN);
+    if (version == PROTOCOL_V2) {
+        msg.client_id.version = PROTOCOL_V2;
+    }
+
+    msg.len = htons(sizeof(msg.client_id) + 2);
+    if (send(sub.fd, &msg, ntohs(msg.len), 0) < 0) {
+        fprintf(stderr, "Error sending the ID.\n");
+        return -1;
+    }
+
+    sub.decoder = new FrameDecoder(CLIENT_DECODER_CAPACITY,
+        sizeof(server_to_client_msg));
+    return 0;
+}
+
+/**
+ * @brief Subscribes to a topic or pattern.
+ *
+ * @param sub the subscriber
+ * @param topic the topic or pattern
+ * @param sf whether the messages are stored while it's away
+ * @return int - the error code
+ */
+static int subscribe_to(test_subscriber &sub, const char *topic,
+        const bool sf) {
+    // The compact command only holds the topic's own bytes
+    if (sub.version == PROTOCOL_V2) {
+        v2_command command;
+        memset(&command, 0, sizeof(command));
+        command.opcode = V2_SUBSCRIBE;
+        command.sf = sf;
+        memcpy(command.topic, topic, strlen(topic));
+        command.len = htons(offsetof(v2_command, topic) + strlen(topic));
+
+        if (send(sub.fd, &command, ntohs(command.len), 0) < 0) {
+            fprintf(stderr, "Error subscribing.\n");
+            return -1;
+        }
+
+        return 0;
+    }
+
+    client_to_server_msg msg;
+    memset(&msg, 0, sizeof(msg));
+    memcpy(msg.client_sub.command, SUB_CMD, strlen(SUB_CMD));
+    memcpy(msg.client_sub.topic, topic, strlen(topic));
+    msg.client_sub.sf[0] = sf ? '1' : '0';
+    msg.len = htons(sizeof(msg.client_sub) + 2);
+
+    if (send(sub.fd, &msg, ntohs(msg.len), 0) < 0) {
+        fprintf(stderr, "Error subscribing.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Subscribes to the test topic.
+ *
+ * @param sub the subscriber
+ * @param sf whether the messages are stored while it's away
+ * @return int - the error code
+ */
+static int subscribe(test_subscriber &sub, const bool sf) {
+    return subscribe_to(sub, TEST_TOPIC, sf);
+}
+
+/**
+ * @brief Closes the subscriber's connection.
+ *
+ * @param sub the subscriber
+ */
+static void close_subscriber(test_subscriber &sub) {
+    close(sub.fd);
+    delete sub.decoder;
+    sub.fd = -1;
+    sub.decoder = NULL;
+}
+
+/**
+ * @brief Records a frame received by the subscriber.
+ *
+ * @param sub the subscriber
+ * @param frame the frame
+ * @return int - the error code
+ */
+static int record_frame(test_subscriber &sub, const frame_view &frame) {
+    if (sub.version == PROTOCOL_V1) {
+        const server_to_client_msg *msg =
+            (const server_to_client_msg *)frame.data;
+        sub.received.push_back(msg->data_type == UDP_STRING ?
+            strtol(msg->content.udp_string, NULL, 10) : -1);
+        return 0;
+    }
+
+    // The compact frames follow the ack, framed the legacy way
+    if (!sub.acked) {
+        if (frame.len != sizeof(v2_ack) ||
+                (uint8_t)frame.data[offsetof(v2_ack, magic)] !=
+                    V2_ACK_MAGIC) {
+            fprintf(stderr, "The compact protocol wasn't acked.\n");
+            return -1;
+        }
+
+        sub.acked = true;
+        sub.decoder->use_varint_lengths(sizeof(server_to_client_msg));
+        return 0;
+    }
+
+    v2_message decoded;
+    if (decode_v2_frame(frame.data, frame.len, true, decoded) < 0) {
+        fprintf(stderr, "Malformed compact frame received.\n");
+        return -1;
+    }
+
+    if (decoded.announce) {
+        sub.announced.push_back(decoded.topic_ref);
+        return 0;
+    }
+
+    if (std::find(sub.announced.begin(), sub.announced.end(),
+            decoded.topic_ref) == sub.announced.end()) {
+        fprintf(stderr, "Message received on an unannounced topic.\n");
+        return -1;
+    }
+
+    sub.received.push_back(decoded.data_type == UDP_STRING ?
+        strtol(std::string(decoded.content, decoded.content_len).c_str(),
+            NULL, 10) : -1);
+    return 0;
+}
+
+/**
+ * @brief Receives one chunk and records the messages it completes.
+ *
+ * @param sub the subscriber
+ * @param timeout_ms how long to wait for the chunk
+ * @return int - 1 if a chunk was received, 0 on timeout or end of stream,
+ *   -1 on errors
+ */
+static int receive(test_subscriber &sub, const int timeout_ms) {
+    pollfd readable = {sub.fd, POLLIN, 0};
+    if (sub.closed || poll(&readable, 1, timeout_ms) <= 0) {
+        return 0;
+    }
+
+    ssize_t n = sub.decoder->recv_from(sub.fd);
+    if (n <= 0) {
+        sub.closed = true;
+        return n < 0 ? -1 : 0;
+    }
+
+    frame_view frame;
+    int ret;
+    while ((ret = sub.decoder->next(frame)) == 1) {
+        if (record_frame(sub, frame) < 0) {
+            return -1;
+        }
+    }
+
+    if (ret < 0) {
+        fprintf(stderr, "Malformed stream received.\n");
+        return -1;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Publishes messages, until the witness got every one of them,
+ *   sending those which got lost before the broker read them again.
+ *
+ * @param server the server
+ * @param witness the subscriber connected throughout
+ * @param first the sequence number of the first message
+ * @param count how many messages to publish
+ * @return int - the error code
+ */
+static int publish(const test_server &server, test_subscriber &witness,
+        const long first, const long count) {
+    sockaddr_in address = server_address(server);
+    int udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udp_fd < 0) {
+        fprintf(stderr, "Error opening a UDP socket.\n");
+        return -1;
+    }
+
+    udp_to_server_msg msg;
+    memset(&msg, 0, sizeof(msg));
+    memcpy(msg.topic, TEST_TOPIC, strlen(TEST_TOPIC));
+    msg.data_type = UDP_STRING;
+    memset(msg.content, 'x', TEST_STRING_LEN);
+
+    // Send a burst at a time, then wait for the witness to get it
+    long next = first;
+    int err = 0;
+    while (next < first + count && err == 0) {
+        long end = std::min(next + TEST_BURST, first + count);
+        for (long seq = next; seq < end; ++seq) {
+            int len = snprintf(msg.content, 12, "%010ld", seq);
+            msg.content[len] = ' ';
+            sendto(udp_fd, &msg, MAX_TOPIC_LEN + 1 + TEST_STRING_LEN, 0,
+                (sockaddr *)&address, sizeof(address));
+        }
+
+        while (witness.received.empty() || witness.received.back() < end - 1) {
+            int ret = receive(witness, TEST_TIMEOUT_MS / 10);
+            if (ret < 0) {
+                err = -1;
+                break;
+            }
+
+            if (ret == 0) {
+                break;
+            }
+        }
+
+        // Send again from the first message missing
+        next = witness.received.empty() ? next :
+            std::max(next, witness.received.back() + 1);
+    }
+
+    close(udp_fd);
+    return err;
+}
+
+/**
+ * @brief Publishes a string of the given length, which doesn't carry a
+ *   sequence number.
+ *
+ * @param udp_fd the socket to publish from
+ * @param address the server's address
+ * @param topic the topic
+ * @param len the length of the string
+ */
+static void publish_filler(const int udp_fd, const sockaddr_in &address,
+        const char *topic, const int len) {
+    udp_to_server_msg msg;
+    memset(&msg, 0, sizeof(msg));
+    memcpy(msg.topic, topic, strlen(topic));
+    msg.data_type = UDP_STRING;
+    memset(msg.content, 'x', len);
+
+    sendto(udp_fd, &msg, MAX_TOPIC_LEN + 1 + len, 0, (sockaddr *)&address,
+        sizeof(address));
+}
+
+/**
+ * @brief Checks that a subscriber got its messages in order.
+ *
+ * @param received the sequence numbers received on one connection
+ * @param name the connection's name, for the errors
+ * @return int - the error code
+ */
+static int check_order(const std::vector<long> &received, const char *name) {
+    for (size_t i = 1; i < received.size(); ++i) {
+        if (received[i] <= received[i - 1]) {
+            fprintf(stderr, "%s: message %ld received after %ld.\n", name,
+                received[i], received[i - 1]);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Disconnects a store and forward subscriber in the middle of a
+ *   paced replay, with live messages held back, and checks that it gets
+ *   every message once it reconnects.
+ *
+ * @param args the server's options
+ * @return int - the error code
+ */
+static int test_interrupted_replay(const std::vector<std::string> &args) {
+    test_server server;
+    if (start_server(server, args) < 0) {
+        return -1;
+    }
+
+    test_subscriber witness, sub;
+    int err = 0;
+
+    // Subscribe, then leave, so the next messages are stored
+    if (connect_subscriber(server, witness, "witness", 0) < 0 ||
+            subscribe(witness, false) < 0 ||
+            connect_subscriber(server, sub, "replayed", 0) < 0 ||
+            subscribe(sub, true) < 0) {
+        stop_server(server);
+        return -1;
+    }
+
+    usleep(100000);
+    close_subscriber(sub);
+    usleep(100000);
+
+    if (publish(server, witness, 0, TEST_STORED) < 0) {
+        err = -1;
+    }
+
+    // Come back with a small buffer and read slowly, so the replay is
+    // paced, while live messages arrive
+    std::vector<long> paced;
+    if (err == 0 &&
+            connect_subscriber(server, sub, "replayed", TEST_RCVBUF) == 0) {
+        long live = 0;
+        while (err == 0 && sub.received.size() < TEST_PACED_FRAMES &&
+                receive(sub, TEST_TIMEOUT_MS) > 0) {
+            usleep(1000);
+            if (live < TEST_LIVE) {
+                err = publish(server, witness, TEST_STORED + live, 10);
+                live += 10;
+            }
+        }
+
+        // Leave in the middle of the replay, taking whatever was written
+        shutdown(sub.fd, SHUT_WR);
+        while (receive(sub, TEST_TIMEOUT_MS) > 0) {
+        }
+
+        paced.swap(sub.received);
+        close_subscriber(sub);
+    } else {
+        err = -1;
+    }
+
+    // Then come back for the rest, with some more stored meanwhile
+    long published = TEST_STORED + TEST_LIVE + TEST_OFFLINE;
+    if (err == 0 && publish(server, witness, TEST_STORED + TEST_LIVE,
+            TEST_OFFLINE) < 0) {
+        err = -1;
+    }
+
+    if (err == 0 &&
+            connect_subscriber(server, sub, "replayed", 0) == 0) {
+        std::vector<bool> seen(published, false);
+        size_t missing = published;
+        auto mark = [&](const std::vector<long> &received, size_t from) {
+            for (size_t i = from; i < received.size(); ++i) {
+                if (received[i] >= 0 && received[i] < published &&
+                        !seen[received[i]]) {
+                    seen[received[i]] = true;
+                    missing--;
+                }
+            }
+        };
+
+        mark(paced, 0);
+        while (missing > 0) {
+            size_t from = sub.received.size();
+            if (receive(sub, TEST_TIMEOUT_MS) <= 0) {
+                break;
+            }
+
+            mark(sub.received, from);
+        }
+
+        if (missing > 0) {
+            fprintf(stderr, "%zu of %ld messages missing after the "
+                "interrupted replay.\n", missing, published);
+            err = -1;
+        }
+
+        if (paced.size() >= (size_t)published) {
+            fprintf(stderr, "The replay wasn't interrupted.\n");
+            err = -1;
+        }
+
+        if (check_order(paced, "paced replay") < 0 ||
+                check_order(sub.received, "second replay") < 0) {
+            err = -1;
+        }
+
+        close_subscriber(sub);
+    } else {
+        err = -1;
+    }
+
+    close_subscriber(witness);
+    if (stop_server(server) < 0) {
+        err = -1;
+    }
+
+    return err;
+}
+
+/**
+ * @brief Publishes datagrams of unknown data types, among them the one the
+ *   server once used for its own topic announcements, and checks that
+ *   neither kind of subscriber gets anything but the valid messages, and
+ *   that each topic is announced once.
+ *
+ * @return int - the error code
+ */
+static int test_unknown_data_types() {
+    test_server server;
+    if (start_server(server, {}) < 0) {
+        return -1;
+    }
+
+    test_subscriber witness, sub;
+    if (connect_subscriber(server, witness, "witness", 0) < 0 ||
+            subscribe(witness, false) < 0 ||
+            connect_subscriber(server, sub, "compact", 0, PROTOCOL_V2) < 0 ||
+            subscribe(sub, false) < 0) {
+        stop_server(server);
+        return -1;
+    }
+
+    usleep(100000);
+
+    // The content looks like an INT, whose value could pass for a
+    // topic reference
+    sockaddr_in address = server_address(server);
+    int udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    udp_to_server_msg msg;
+    memset(&msg, 0, sizeof(msg));
+    memcpy(msg.topic, TEST_TOPIC, strlen(TEST_TOPIC));
+    msg.content[4] = 7;
+
+    const uint8_t unknown_types[] = {0xFF, UDP_STRING + 1, 0x80};
+    for (uint8_t data_type : unknown_types) {
+        msg.data_type = data_type;
+        sendto(udp_fd, &msg, MAX_TOPIC_LEN + 1 + 5, 0, (sockaddr *)&address,
+            sizeof(address));
+    }
+
+    close(udp_fd);
+
+    // The valid messages which follow show when they were all handled
+    int err = publish(server, witness, 0, 3);
+    while (err == 0 && sub.received.size() < 3 &&
+            receive(sub, TEST_TIMEOUT_MS) > 0) {
+    }
+
+    const std::vector<long> expected = {0, 1, 2};
+    if (witness.received != expected || sub.received != expected) {
+        fprintf(stderr, "Messages of unknown data types were delivered.\n");
+        err = -1;
+    }
+
+    if (sub.announced != std::vector<uint32_t>{1}) {
+        fprintf(stderr, "The topic was announced %zu times.\n",
+            sub.announced.size());
+        err = -1;
+    }
+
+    close_subscriber(sub);
+    close_subscriber(witness);
+    if (stop_server(server) < 0) {
+        err = -1;
+    }
+
+    return err;
+}
+
+/**
+ * @brief Has a compact subscriber get a topic it only matched through a
+ *   pattern, which the server didn't know yet, then subscribe to the topic
+ *   itself, and checks that the topic keeps the reference it was first
+ *   announced with.
+ *
+ * @return int - the error code
+ */
+static int test_pattern_announcements() {
+    test_server server;
+    if (start_server(server, {"-t", "1"}) < 0) {
+        return -1;
+    }
+
+    test_subscriber witness, sub;
+    if (connect_subscriber(server, witness, "witness", 0) < 0 ||
+            subscribe_to(witness, "test/*", false) < 0 ||
+            connect_subscriber(server, sub, "compact", 0, PROTOCOL_V2) < 0 ||
+            subscribe_to(sub, "test/*", false) < 0) {
+        stop_server(server);
+        return -1;
+    }
+
+    usleep(100000);
+
+    int err = publish(server, witness, 0, 3);
+    while (err == 0 && sub.received.size() < 3 &&
+            receive(sub, TEST_TIMEOUT_MS) > 0) {
+    }
+
+    // The topic is now matched by both subscriptions, and still delivered
+    // once
+    if (err == 0 && (err = subscribe(sub, false)) == 0) {
+        usleep(100000);
+        err = publish(server, witness, 3, 3);
+    }
+
+    while (err == 0 && sub.received.size() < 6 &&
+            receive(sub, TEST_TIMEOUT_MS) > 0) {
+    }
+
+    const std::vector<long> expected = {0, 1, 2, 3, 4, 5};
+    if (sub.received != expected) {
+        fprintf(stderr, "The compact subscriber got %zu messages.\n",
+            sub.received.size());
+        err = -1;
+    }
+
+    if (sub.announced != std::vector<uint32_t>{1}) {
+        fprintf(stderr, "The topic was announced %zu times.\n",
+            sub.announced.size());
+        err = -1;
+    }
+
+    close_subscriber(sub);
+    close_subscriber(witness);
+    if (stop_server(server) < 0) {
+        err = -1;
+    }
+
+    return err;
+}
+
+/**
+ * @brief Floods subscribers which never read, with a tiny high-water mark,
+ *   while they keep sending commands, so that some are disconnected for
+ *   being too slow in the same loop iteration as their commands arrive.
+ *
+ * @return int - the error code
+ */
+static int test_slow_consumers() {
+    test_server server;
+    if (start_server(server, {"-w", "1600"}) < 0) {
+        return -1;
+    }
+
+    std::vector<test_subscriber> subs(TEST_SLOW_SUBSCRIBERS);
+    int err = 0;
+    for (size_t i = 0; i < subs.size() && err == 0; ++i) {
+        std::string id = "slow" + std::to_string(i);
+        if (connect_subscriber(server, subs[i], id.c_str(), 1024) < 0 ||
+                subscribe(subs[i], false) < 0) {
+            err = -1;
+        }
+    }
+
+    usleep(100000);
+
+    sockaddr_in address = server_address(server);
+    int udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    for (int round = 0; round < TEST_FLOOD_ROUNDS && err == 0; ++round) {
+        for (int i = 0; i < TEST_BURST; ++i) {
+            publish_filler(udp_fd, address, TEST_TOPIC, TEST_FLOOD_LEN);
+        }
+
+        // The connections which were closed just fail to send
+        client_to_server_msg msg;
+        memset(&msg, 0, sizeof(msg));
+        memcpy(msg.client_sub.command, SUB_CMD, strlen(SUB_CMD));
+        memcpy(msg.client_sub.topic, TEST_TOPIC, strlen(TEST_TOPIC));
+        msg.client_sub.sf[0] = '0';
+        msg.len = htons(sizeof(msg.client_sub) + 2);
+        for (test_subscriber &sub : subs) {
+            send(sub.fd, &msg, ntohs(msg.len), MSG_DONTWAIT);
+        }
+    }
+
+    close(udp_fd);
+    for (test_subscriber &sub : subs) {
+        if (sub.decoder != NULL) {
+            close_subscriber(sub);
+        }
+    }
+
+    if (stop_server(server) < 0) {
+        err = -1;
+    }
+
+    return err;
+}
+
+/**
+ * @brief Has a subscriber, in a single write, identify itself and
+ *   subscribe to a pattern matching several cached topics, which goes over
+ *   the high-water mark on the spot, then to another topic, and checks that
+ *   it's disconnected and that the server survives handling what follows.
+ *
+ * @return int - the error code
+ */
+static int test_snapshot_overflow() {
+    test_server server;
+    if (start_server(server, {"-t", "1", "-c", "100", "-w", "4000"}) < 0) {
+        return -1;
+    }
+
+    // Wait for the server to start, then cache the topics
+    test_subscriber sub;
+    if (connect_subscriber(server, sub, "starter", 0) < 0) {
+        stop_server(server);
+        return -1;
+    }
+
+    close_subscriber(sub);
+
+    sockaddr_in address = server_address(server);
+    int udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    for (int i = 0; i < 10; ++i) {
+        std::string topic = "a/" + std::to_string(i);
+        publish_filler(udp_fd, address, topic.c_str(), TEST_FLOOD_LEN);
+    }
+
+    close(udp_fd);
+    usleep(200000);
+
+    // The ID and both commands in a single write
+    client_to_server_msg msgs[3];
+    memset(msgs, 0, sizeof(msgs));
+    strcpy(msgs[0].client_id.id, "snapshots");
+    msgs[0].len = htons(sizeof(msgs[0].client_id) + 2);
+
+    const char *topics[] = {"a/*", "b"};
+    for (int i = 1; i < 3; ++i) {
+        memcpy(msgs[i].client_sub.command, SUB_CMD, strlen(SUB_CMD));
+        memcpy(msgs[i].client_sub.topic, topics[i - 1],
+            strlen(topics[i - 1]));
+        msgs[i].client_sub.sf[0] = '0';
+        msgs[i].len = htons(sizeof(msgs[i].client_sub) + 2);
+    }
+
+    std::vector<char> stream;
+    for (const client_to_server_msg &msg : msgs) {
+        stream.insert(stream.end(), (const char *)&msg,
+            (const char *)&msg + ntohs(msg.len));
+    }
+
+    int err = 0;
+    sub.fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(sub.fd, (sockaddr *)&address, sizeof(address)) < 0 ||
+            send(sub.fd, stream.data(), stream.size(), 0) !=
+                (ssize_t)stream.size()) {
+        fprintf(stderr, "Error sending the commands.\n");
+        err = -1;
+    }
+
+    // The server must close the connection, once it got what fitted
+    sub.decoder = new FrameDecoder(CLIENT_DECODER_CAPACITY,
+        sizeof(server_to_client_msg));
+    sub.version = PROTOCOL_V1;
+    sub.closed = false;
+    while (err == 0 && receive(sub, TEST_TIMEOUT_MS) > 0) {
+    }
+
+    if (err == 0 && !sub.closed) {
+        fprintf(stderr, "The slow subscriber wasn't disconnected.\n");
+        err = -1;
+    }
+
+    close_subscriber(sub);
+    if (stop_server(server) < 0) {
+        err = -1;
+    }
+
+    return err;
+}
+
+int main() {
+    signal(SIGPIPE, SIG_IGN);
+
+    // Keep the messages in memory, then in an on-disk log
+    int failed = test_interrupted_replay({}) < 0;
+    if (failed) {
+        fprintf(stderr, "Interrupted replay from memory failed.\n");
+    }
+
+    if (test_unknown_data_types() < 0) {
+        fprintf(stderr, "Unknown data types failed.\n");
+        failed++;
+    }
+
+    if (test_pattern_announcements() < 0) {
+        fprintf(stderr, "Pattern announcements failed.\n");
+        failed++;
+    }
+
+    if (test_slow_consumers() < 0) {
+        fprintf(stderr, "Slow consumers failed.\n");
+        failed++;
+    }
+
+    if (test_snapshot_overflow() < 0) {
+        fprintf(stderr, "Snapshots over the high-water mark failed.\n");
+        failed++;
+    }
+
+    char log_dir[] = "/tmp/test_broker.XXXXXX";
+    if (mkdtemp(log_dir) == NULL) {
+        fprintf(stderr, "Error creating the log directory.\n");
+        return 1;
+    }
+
+    if (test_interrupted_replay({"-d", log_dir}) < 0) {
+        fprintf(stderr, "Interrupted replay from the log failed.\n");
+        failed++;
+    }
+
+    std::string remove = std::string("rm -rf ") + log_dir;
+    if (system(remove.c_str()) != 0) {
+        fprintf(stderr, "Error removing %s.\n", log_dir);
+    }
+
+    if (failed) {
+        fprintf(stderr, "test_broker: %d failed.\n", failed);
+        return 1;
+    }
+
+    printf("test_broker: all tests passed.\n");
+    return 0;
+}
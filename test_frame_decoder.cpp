@@ -0,0 +1,420 @@
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "include/frame_decoder.h"
+#include "include/protocol_v2.h"
+
+/*
+ * Randomized test of the frame decoder. Streams of random frames, legacy,
+ * compact, or legacy switching to compact, are cut into random chunks and
+ * decoded, and every frame yielded must have the length and the bytes it
+ * was encoded with. The chunks favour the places where a decoder goes
+ * wrong: single bytes around the length prefixes, and the point where the
+ * unread bytes are moved back to the front of the buffer.
+ *
+ * Each round is seeded by its number, so a failure prints the round to
+ * replay with -s.
+ */
+
+#define TEST_ROUNDS 2000
+#define TEST_MAX_FRAMES 200
+#define TEST_MAX_FRAME 300
+
+/**
+ * @brief A stream to decode, and the frames it must decode to.
+ *
+ */
+struct test_stream {
+    std::vector<char> bytes;
+
+    // Where each frame starts in the stream, and where its yielded bytes
+    // start and end (the legacy prefix is part of the frame, the varint
+    // one isn't)
+    std::vector<size_t> frame_starts;
+    std::vector<size_t> data_starts;
+    std::vector<size_t> data_ends;
+
+    // How many of the frames are legacy ones, the others being compact
+    size_t legacy_frames;
+};
+
+/**
+ * @brief Appends a legacy frame of the given length to the stream.
+ *
+ * @param stream the stream
+ * @param len the length of the frame, prefix included
+ * @param random the source of the frame's bytes
+ */
+static void add_legacy_frame(test_stream &stream, const uint16_t len,
+        std::mt19937 &random) {
+    size_t begin = stream.bytes.size();
+    uint16_t prefix = htons(len);
+
+    stream.frame_starts.push_back(begin);
+    stream.data_starts.push_back(begin);
+    stream.bytes.insert(stream.bytes.end(), (char *)&prefix,
+        (char *)&prefix + 2);
+    for (uint16_t i = 2; i < len; ++i) {
+        stream.bytes.push_back((char)random());
+    }
+
+    stream.data_ends.push_back(stream.bytes.size());
+}
+
+/**
+ * @brief Appends a compact frame with a body of the given length.
+ *
+ * @param stream the stream
+ * @param len the length of the body
+ * @param random the source of the body's bytes
+ */
+static void add_varint_frame(test_stream &stream, const uint32_t len,
+        std::mt19937 &random) {
+    char prefix[VARINT_MAX_LEN];
+    size_t prefix_len = put_varint(len, prefix);
+
+    stream.frame_starts.push_back(stream.bytes.size());
+    stream.bytes.insert(stream.bytes.end(), prefix, prefix + prefix_len);
+    stream.data_starts.push_back(stream.bytes.size());
+    for (uint32_t i = 0; i < len; ++i) {
+        stream.bytes.push_back((char)random());
+    }
+
+    stream.data_ends.push_back(stream.bytes.size());
+}
+
+/**
+ * @brief Picks a frame length, often one of the extremes.
+ *
+ * @param min the shortest length
+ * @param max the longest length
+ * @param random the source of randomness
+ * @return size_t - the length
+ */
+static size_t pick_len(const size_t min, const size_t max,
+        std::mt19937 &random) {
+    switch (random() % 8) {
+    case 0:
+        return min;
+    case 1:
+        return max;
+    case 2:
+        // Around the 1 to 2 byte boundary of the varints
+        return std::min(max, std::max(min, (size_t)(126 + random() % 4)));
+    default:
+        return min + random() % (max - min + 1);
+    }
+}
+
+/**
+ * @brief Picks the length of the next chunk.
+ *
+ * @param stream the stream
+ * @param pos where the chunk starts
+ * @param frame the frame the chunk starts in
+ * @param capacity the decoder's capacity
+ * @param random the source of randomness
+ * @return size_t - the length of the chunk
+ */
+static size_t pick_chunk(const test_stream &stream, const size_t pos,
+        const size_t frame, const size_t capacity, std::mt19937 &random) {
+    size_t left = stream.bytes.size() - pos;
+    size_t len;
+
+    switch (random() % 6) {
+    case 0:
+        len = 1;
+        break;
+    case 1: {
+        // Stop a byte or two before, at or after the start of a frame, so
+        // its length prefix is split
+        size_t next = frame + 1 < stream.frame_starts.size() ?
+            stream.frame_starts[frame + 1] : stream.bytes.size();
+        size_t target = next + random() % 5;
+        target = target >= 2 ? target - 2 : 0;
+        len = target > pos ? target - pos : 1;
+        break;
+    }
+    case 2:
+        len = 1 + random() % 16;
+        break;
+    case 3:
+        len = 1 + random() % capacity;
+        break;
+    default:
+        len = 1 + random() % (2 * TEST_MAX_FRAME);
+        break;
+    }
+
+    return std::min(len, left);
+}
+
+/**
+ * @brief Checks a yielded frame against the one expected.
+ *
+ * @param stream the stream
+ * @param index the index of the frame expected
+ * @param frame the frame yielded
+ * @return int - the error code
+ */
+static int check_frame(const test_stream &stream, const size_t index,
+        const frame_view &frame) {
+    if (index >= stream.data_starts.size()) {
+        fprintf(stderr, "Frame %zu yielded past the end of the stream.\n",
+            index);
+        return -1;
+    }
+
+    size_t len = stream.data_ends[index] - stream.data_starts[index];
+    if (frame.len != len) {
+        fprintf(stderr, "Frame %zu is %hu bytes long instead of %zu.\n",
+            index, frame.len, len);
+        return -1;
+    }
+
+    if (memcmp(frame.data, stream.bytes.data() + stream.data_starts[index],
+            len) != 0) {
+        fprintf(stderr, "Frame %zu holds the wrong bytes.\n", index);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Yields every complete frame the decoder holds, checking them.
+ *
+ * @param decoder the decoder
+ * @param stream the stream
+ * @param max_body the longest compact body
+ * @param frames how many frames were yielded so far
+ * @return int - the error code
+ */
+static int drain(FrameDecoder &decoder, const test_stream &stream,
+        const size_t max_body, size_t &frames) {
+    frame_view frame;
+    int ret;
+
+    while ((ret = decoder.next(frame)) == 1) {
+        if (check_frame(stream, frames, frame) < 0) {
+            return -1;
+        }
+
+        // Switch to the compact protocol after the last legacy frame, as
+        // the subscriber does after the ack
+        if (++frames == stream.legacy_frames &&
+                stream.legacy_frames < stream.data_starts.size()) {
+            decoder.use_varint_lengths(max_body);
+        }
+    }
+
+    if (ret < 0) {
+        fprintf(stderr, "Well-formed frame %zu reported as malformed.\n",
+            frames);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Runs one round: builds a random stream and decodes it from random
+ *   chunks, fed either directly or through a socket.
+ *
+ * @param round the round, which seeds it
+ * @return int - the error code
+ */
+static int run_round(const unsigned round) {
+    std::mt19937 random(round);
+
+    // The smallest capacity the decoder accepts, or a little more, so that
+    // the unread bytes are moved back to the front often
+    size_t max_frame = 3 + random() % (TEST_MAX_FRAME - 2);
+    size_t max_body = std::min((size_t)TEST_MAX_FRAME, max_frame + 20);
+    size_t capacity = 2 * std::max(max_frame, max_body) + VARINT_MAX_LEN +
+        random() % 64;
+
+    // Build the stream, its legacy frames first
+    test_stream stream;
+    size_t frame_count = 1 + random() % TEST_MAX_FRAMES;
+    int mode = random() % 3;
+    stream.legacy_frames = mode == 0 ? frame_count :
+        mode == 1 ? 0 : random() % frame_count;
+
+    for (size_t i = 0; i < frame_count; ++i) {
+        if (i < stream.legacy_frames) {
+            add_legacy_frame(stream, pick_len(2, max_frame, random), random);
+        } else {
+            add_varint_frame(stream, pick_len(1, max_body, random), random);
+        }
+    }
+
+    FrameDecoder decoder(capacity, max_frame);
+    if (stream.legacy_frames == 0) {
+        decoder.use_varint_lengths(max_body);
+    }
+
+    // Every fourth round goes through a socket, with recv_from()
+    bool through_socket = round % 4 == 3;
+    int fds[2] = {-1, -1};
+    if (through_socket && socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        fprintf(stderr, "Error creating a socket pair.\n");
+        return -1;
+    }
+
+    size_t frames = 0;
+    size_t pos = 0;
+    size_t frame = 0;
+    int err = 0;
+
+    while (pos < stream.bytes.size() && err == 0) {
+        while (frame + 1 < stream.frame_starts.size() &&
+                stream.frame_starts[frame + 1] <= pos) {
+            ++frame;
+        }
+
+        size_t len = pick_chunk(stream, pos, frame, capacity, random);
+
+        if (through_socket) {
+            // Write the chunk, no longer than a frame so it always fits,
+            // and receive it as recv() would
+            len = std::min(len, frames < stream.legacy_frames ?
+                max_frame : max_body);
+            if (write(fds[0], stream.bytes.data() + pos, len) !=
+                    (ssize_t)len) {
+                fprintf(stderr, "Error writing to the socket pair.\n");
+                err = -1;
+                break;
+            }
+
+            size_t received = 0;
+            while (received < len) {
+                ssize_t n = decoder.recv_from(fds[1]);
+                if (n <= 0) {
+                    fprintf(stderr, "Error receiving the chunk.\n");
+                    err = -1;
+                    break;
+                }
+
+                received += n;
+            }
+
+            pos += received;
+        } else {
+            // A full buffer takes part of the chunk, then frames must be
+            // read before the rest is taken, but there's always room for
+            // a frame
+            size_t taken = decoder.feed(stream.bytes.data() + pos, len);
+            if (taken == 0) {
+                fprintf(stderr, "Nothing taken with room left.\n");
+                err = -1;
+                break;
+            }
+
+            pos += taken;
+        }
+
+        if (err == 0) {
+            err = drain(decoder, stream, max_body, frames);
+        }
+    }
+
+    if (through_socket) {
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    if (err == 0 && (frames != frame_count || decoder.buffered() != 0)) {
+        fprintf(stderr, "%zu of %zu frames yielded, %zu bytes left.\n",
+            frames, frame_count, decoder.buffered());
+        err = -1;
+    }
+
+    if (err < 0) {
+        fprintf(stderr, "Round %u failed (capacity %zu, longest frame %zu, "
+            "%zu legacy and %zu compact frames).\n", round, capacity,
+            max_frame, stream.legacy_frames,
+            frame_count - stream.legacy_frames);
+    }
+
+    return err;
+}
+
+/**
+ * @brief Checks that malformed lengths are reported, rather than waited on.
+ *
+ * @return int - the error code
+ */
+static int check_malformed() {
+    struct malformed_case {
+        const char *bytes;
+        size_t len;
+        bool varint;
+        const char *name;
+    };
+
+    static const malformed_case cases[] = {
+        {"\x00\x00", 2, false, "legacy length 0"},
+        {"\x00\x01", 2, false, "legacy length 1"},
+        {"\xFF\xFF", 2, false, "legacy length above the largest"},
+        {"\x00", 1, true, "varint length 0"},
+        {"\xFF\xFF\x03", 3, true, "varint length above the largest"},
+        {"\xFF\xFF\xFF\xFF\xFF\x01", 6, true, "varint too long"},
+    };
+
+    int err = 0;
+    for (const malformed_case &test : cases) {
+        FrameDecoder decoder(1024, 300);
+        if (test.varint) {
+            decoder.use_varint_lengths(300);
+        }
+
+        decoder.feed(test.bytes, test.len);
+
+        frame_view frame;
+        if (decoder.next(frame) != -1) {
+            fprintf(stderr, "Malformed stream not reported: %s.\n",
+                test.name);
+            err = -1;
+        }
+    }
+
+    return err;
+}
+
+int main(int argc, char *argv[]) {
+    // Replay a single round with -s <round>
+    int opt;
+    long only = -1;
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        if (opt != 's') {
+            fprintf(stderr, "Usage: %s [-s <ROUND>]\n", argv[0]);
+            return -1;
+        }
+
+        only = atol(optarg);
+    }
+
+    int failed = check_malformed() < 0;
+
+    unsigned first = only < 0 ? 0 : only;
+    unsigned last = only < 0 ? TEST_ROUNDS : only + 1;
+    for (unsigned round = first; round < last; ++round) {
+        failed += run_round(round) < 0;
+    }
+
+    if (failed) {
+        fprintf(stderr, "test_frame_decoder: %d failed.\n", failed);
+        return 1;
+    }
+
+    printf("test_frame_decoder: %u rounds passed.\n", last - first);
+    return 0;
+}
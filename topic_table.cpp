@@ -0,0 +1,102 @@
+#include <cstring>
+#include <algorithm>
+#include "include/topic_table.h"
+
+#define TOPIC_HASH_SEED 0x243f6a8885a308d3ULL
+#define TOPIC_HASH_MUL 0x9e3779b97f4a7c15ULL
+#define TOPIC_TABLE_MIN_SLOTS 64
+
+topic_key make_topic_key(const std::string_view name) {
+    topic_key key;
+    size_t len = std::min(name.size(), (size_t)MAX_TOPIC_LEN);
+
+    memcpy(key.name, name.data(), len);
+    memset(key.name + len, 0, MAX_TOPIC_LEN - len);
+
+    return key;
+}
+
+uint64_t hash_topic(const char *name) {
+    uint64_t hash = TOPIC_HASH_SEED;
+
+    // Mix in the topic a word at a time, the last one padded with zeros
+    for (size_t i = 0; i < MAX_TOPIC_LEN; i += sizeof(uint64_t)) {
+        uint64_t word = 0;
+        memcpy(&word, name + i,
+            std::min(sizeof(uint64_t), (size_t)MAX_TOPIC_LEN - i));
+
+        hash = (hash ^ word) * TOPIC_HASH_MUL;
+        hash ^= hash >> 32;
+    }
+
+    return hash;
+}
+
+TopicTable::TopicTable() : slots(TOPIC_TABLE_MIN_SLOTS, -1) {}
+
+size_t TopicTable::find_slot(const char *name, const uint64_t hash) const {
+    size_t mask = slots.size() - 1;
+    size_t slot = hash & mask;
+
+    // Probe linearly until the topic or an empty slot is found
+    while (slots[slot] != -1) {
+        int id = slots[slot];
+        if (hashes[id] == hash &&
+                memcmp(keys[id].name, name, MAX_TOPIC_LEN) == 0) {
+            break;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+void TopicTable::grow() {
+    slots.assign(slots.size() * 2, -1);
+
+    // Place every topic again
+    size_t mask = slots.size() - 1;
+    for (size_t id = 0; id < keys.size(); ++id) {
+        size_t slot = hashes[id] & mask;
+        while (slots[slot] != -1) {
+            slot = (slot + 1) & mask;
+        }
+
+        slots[slot] = id;
+    }
+}
+
+int TopicTable::lookup(const char *name) const {
+    return slots[find_slot(name, hash_topic(name))];
+}
+
+int TopicTable::intern(const char *name) {
+    uint64_t hash = hash_topic(name);
+    size_t slot = find_slot(name, hash);
+    if (slots[slot] != -1) {
+        return slots[slot];
+    }
+
+    // Keep at least half of the slots empty
+    if (2 * (keys.size() + 1) > slots.size()) {
+        grow();
+        slot = find_slot(name, hash);
+    }
+
+    topic_key key;
+    memcpy(key.name, name, MAX_TOPIC_LEN);
+    keys.push_back(key);
+    hashes.push_back(hash);
+
+    slots[slot] = keys.size() - 1;
+    return slots[slot];
+}
+
+const char *TopicTable::name(const int id) const {
+    return keys[id].name;
+}
+
+size_t TopicTable::size() const {
+    return keys.size();
+}
@@ -0,0 +1,192 @@
+#include <cstring>
+#include <cstdio>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <unistd.h>
+#include "include/trace.h"
+#include "include/utils.h"
+
+// The rings are registered once, by their threads, and never freed, so a
+// dump reads them without a lock
+static TraceRing *rings[TRACE_MAX_THREADS];
+static std::atomic<int> ring_count(0);
+
+/**
+ * @brief A reading of both clocks, to convert ticks to nanoseconds.
+ *
+ */
+struct clock_pair {
+    uint64_t ticks;
+    int64_t ns;
+};
+
+static clock_pair read_clocks() {
+    return {trace_ticks(), monotonic_ns()};
+}
+
+// The clocks when the program started, which the dumps count from
+static const clock_pair epoch = read_clocks();
+
+TraceRing::TraceRing()
+        : events(new trace_event[TRACE_RING_EVENTS]), head(0) {
+    thread_name[0] = '\0';
+}
+
+TraceRing &TraceRing::local() {
+    static thread_local TraceRing *ring = NULL;
+    if (!ring) {
+        ring = new TraceRing;
+
+        // Threads past the limit still record, but aren't dumped
+        int index = ring_count.fetch_add(1, std::memory_order_relaxed);
+        if (index < TRACE_MAX_THREADS) {
+            snprintf(ring->thread_name, TRACE_THREAD_NAME_LEN, "thread %d",
+                index);
+            __atomic_store_n(&rings[index], ring, __ATOMIC_RELEASE);
+        }
+    }
+
+    return *ring;
+}
+
+void TraceRing::set_thread_name(const char *name) {
+    snprintf(thread_name, TRACE_THREAD_NAME_LEN, "%s", name);
+}
+
+size_t TraceRing::snapshot(trace_event *out) const {
+    uint64_t end = head.load(std::memory_order_acquire);
+    uint64_t begin = end > TRACE_RING_EVENTS ? end - TRACE_RING_EVENTS : 0;
+
+    for (uint64_t i = begin; i < end; ++i) {
+        out[i - begin] = events[i & (TRACE_RING_EVENTS - 1)];
+    }
+
+    // Leave out the events which the thread may have overwritten meanwhile,
+    // including the one it may be writing
+    uint64_t after = head.load(std::memory_order_acquire);
+    uint64_t valid = after + 1 > TRACE_RING_EVENTS ?
+        after + 1 - TRACE_RING_EVENTS : 0;
+    if (valid <= begin) {
+        return end - begin;
+    }
+
+    if (valid >= end) {
+        return 0;
+    }
+
+    memmove(out, out + (valid - begin), (end - valid) * sizeof(trace_event));
+    return end - valid;
+}
+
+/**
+ * @brief Writes a string as a JSON string, escaping what needs to be.
+ *
+ * @param file the file
+ * @param str the string
+ */
+static void write_json_string(FILE *file, const char *str) {
+    fputc('"', file);
+    for (; *str; ++str) {
+        if (*str == '"' || *str == '\\') {
+            fputc('\\', file);
+        }
+
+        if ((unsigned char)*str < 0x20) {
+            fprintf(file, "\\u%04x", *str);
+        } else {
+            fputc(*str, file);
+        }
+    }
+
+    fputc('"', file);
+}
+
+int trace_dump(const char *path) {
+    if (!TRACE_ENABLED) {
+        fprintf(stderr, "Tracing wasn't compiled in (make TRACE=1).\n");
+        return -1;
+    }
+
+    char default_path[64];
+    if (path == NULL) {
+        snprintf(default_path, sizeof(default_path), "trace-%d.json",
+            getpid());
+        path = default_path;
+    }
+
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Error writing the trace to %s.\n", path);
+        return -1;
+    }
+
+    // Convert ticks with the rate measured since the program started,
+    // over at least a few milliseconds
+    clock_pair now = read_clocks();
+    if (now.ns - epoch.ns < 10000000) {
+        usleep(10000);
+        now = read_clocks();
+    }
+
+    double ns_per_tick = (double)(now.ns - epoch.ns) /
+        (now.ticks - epoch.ticks);
+
+    std::unique_ptr<trace_event[]> events(
+        new trace_event[TRACE_RING_EVENTS]);
+    int pid = getpid();
+    size_t total = 0;
+    bool first = true;
+
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    int count = std::min(ring_count.load(std::memory_order_relaxed),
+        TRACE_MAX_THREADS);
+    for (int tid = 0; tid < count; ++tid) {
+        TraceRing *ring = __atomic_load_n(&rings[tid], __ATOMIC_ACQUIRE);
+        if (!ring) {
+            continue;
+        }
+
+        fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\","
+            "\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+            first ? "" : ",", pid, tid);
+        write_json_string(file, ring->get_thread_name());
+        fprintf(file, "}}");
+        first = false;
+
+        size_t len = ring->snapshot(events.get());
+        for (size_t i = 0; i < len; ++i) {
+            const trace_event &event = events[i];
+
+            // Timestamps are in microseconds
+            double ts = ((int64_t)(event.start - epoch.ticks)) *
+                ns_per_tick / 1000.0;
+
+            fprintf(file, ",\n{\"name\":");
+            write_json_string(file, event.name);
+            if (event.type == TRACE_SPAN) {
+                fprintf(file, ",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f}", pid, tid, ts,
+                    (event.end_or_value - event.start) * ns_per_tick /
+                        1000.0);
+            } else {
+                fprintf(file, ",\"ph\":\"C\",\"pid\":%d,\"tid\":%d,"
+                    "\"ts\":%.3f,\"args\":{\"value\":%lu}}", pid, tid, ts,
+                    event.end_or_value);
+            }
+        }
+
+        total += len;
+    }
+
+    fprintf(file, "\n]}\n");
+
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Error writing the trace to %s.\n", path);
+        return -1;
+    }
+
+    fprintf(stderr, "Trace of %zu events written to %s.\n", total, path);
+    return 0;
+}
@@ -3,12 +3,15 @@
 #include <cstdlib>
 #include <vector>
 #include <unistd.h>
+#include <fcntl.h>
+#include <ctime>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
-#include "include/defines.h"
+#include "include/utils.h"
 
 bool is_number(const char *str, const int len) {
     // Go through the entire string and check if all characters are digits
@@ -21,80 +24,87 @@ bool is_number(const char *str, const int len) {
     return true;
 }
 
-int recv_messages(const int tcp_socket, std::vector<char *> &messages) {
-    // Declare a buffer to receive the data
-    char buffer[BUFLEN];
-    memset(buffer, 0, BUFLEN);
+int framed_content_len(const udp_to_server_msg &received,
+        const int received_len) {
+    int received_content_len = received_len - (MAX_TOPIC_LEN + 1);
 
-    // Receive the first message
-    int n = recv(tcp_socket, buffer, BUFLEN, 0);
-    if (n < 0) {
-        fprintf(stderr, "Error reading from TCP socket.\n");
-        return -1;
-    }
+    switch (received.data_type) {
+        case UDP_INT:
+            return sizeof(server_to_client_msg::content.udp_int);
+
+        case UDP_SHORT_REAL:
+            return sizeof(server_to_client_msg::content.udp_short_real);
 
-    if (n == 0) {
-        // The connection to the server was lost
-        return 0;
+        case UDP_FLOAT:
+            return sizeof(server_to_client_msg::content.udp_float);
+
+        case UDP_STRING:
+            // The string is always sent along with its terminator
+            return strnlen(received.content,
+                std::min(received_content_len, MAX_CONTENT_LEN - 1)) + 1;
     }
-    
-    // Attempt to get more messages
-    int curr_len = 0;
-    while (true) {
-        // Check if we've reached the end of the buffer
-        if (curr_len == BUFLEN) {
-            break;
-        }
 
-        // Read the length of the message
-        int msg_len = 0;
-        memcpy(&msg_len, buffer + curr_len, 2);
-        msg_len = ntohs(msg_len);
+    return -1;
+}
 
-        // If the length is 0, we've finished receiving the messages
-        if (msg_len == 0) {
-            break;
-        }
+void frame_datagram(server_to_client_msg *msg,
+        const udp_to_server_msg &received, const int received_len,
+        const int content_len, const sockaddr_in &client_address) {
+    // Write the header
+    msg->len = htons(UDP_HDR_LEN + content_len);
+    memcpy(&msg->ip, (char *)&client_address.sin_addr, 4);
+    memcpy(&msg->port, (char *)&client_address.sin_port, 2);
+    msg->data_type = received.data_type;
 
-        // Calculate the remaining length
-        int remaining_length = BUFLEN - curr_len;
+    // Pad the topic with zeros after its end, so it can be compared and
+    // hashed as a whole
+    size_t topic_len = strnlen(received.topic, MAX_TOPIC_LEN);
+    memcpy(msg->topic, received.topic, topic_len);
+    memset(msg->topic + topic_len, 0, MAX_TOPIC_LEN - topic_len);
 
-        // Create a new message
-        char *new_msg = new char[msg_len];
-        if (!new_msg) {
-            fprintf(stderr, "Couldn't allocate memory for new_msg.\n");
-            return -1;
-        }
+    // Copy the received content, padding it with zeros if it was shorter
+    int copy_len = std::min(content_len,
+        received_len - (MAX_TOPIC_LEN + 1));
+    memcpy(msg->content.udp_string, received.content, copy_len);
+    memset(msg->content.udp_string + copy_len, 0, content_len - copy_len);
+}
 
-        // Check if we can fit in an entire message
-        if (msg_len <= remaining_length) {
-            // If we can, copy the entire message from the buffer
-            memcpy(new_msg, buffer + curr_len, msg_len);
-            curr_len += msg_len;
-        } else {
-            // Otherwise, copy the first part of the message
-            memcpy(new_msg, buffer + curr_len, remaining_length);
-
-            // Receive more bytes
-            memset(buffer, 0, BUFLEN);
-            int n = recv(tcp_socket, buffer, BUFLEN, 0);
-            if (n < 0) {
-                fprintf(stderr, "Error reading from TCP socket.\n");
-                return -1;
-            }
-
-            if (n == 0) {
-                return 1;
-            }
-
-            // Copy the last part of the message
-            memcpy(((char *)new_msg) + remaining_length, buffer, msg_len - remaining_length);
-            curr_len = msg_len - remaining_length;
-        }
+int set_non_blocking(const int fd) {
+    // Add O_NONBLOCK to the descriptor's flags
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
 
-        // Add the message to the list
-        messages.push_back(new_msg);
+int raise_fd_limit() {
+    // Get the current limits
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        return -1;
     }
 
-    return 1;
+    // Raise the soft limit to the hard one
+    limit.rlim_cur = limit.rlim_max;
+    return setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+int64_t monotonic_ms() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int64_t monotonic_us() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+int64_t monotonic_ns() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
 }